@@ -1,6 +1,8 @@
 #pragma once
 #include <kj/compat/http.h>
 #include <functional>
+#include <string>
+#include "db/binary.hpp"
 #include "db/container.hpp"
 #include "db/json.hpp"
 #include "db/serializable.hpp"
@@ -49,17 +51,29 @@ inline kj::Promise<void> Error(kj::HttpService::Response& resp, int status,
       .attach(std::move(ans), std::move(data));
 }
 
-inline kj::Promise<void> AnswerJson(kj::HttpService::Response& resp,
-                                    const json& j) {
+// write_result is called with a JsonWriter to write the result.
+template <typename F>
+kj::Promise<void> AnswerJsonWith(kj::HttpService::Response& resp,
+                                 const F& write_result) {
   static kj::HttpHeaderTable empty_table_;
-  json res;
-  res["result"] = j;
-  auto data = kj::str(res.dump().c_str());
+  std::string data;
+  JsonWriter writer(data);
+  writer.BeginObject();
+  writer.Key("result");
+  write_result(writer);
+  writer.EndObject();
   kj::HttpHeaders answer_headers(empty_table_);
   answer_headers.add("Content-Type", "application/json");
   auto ans = resp.send(200, "OK", answer_headers, data.size());
-  return ans->write(data.cStr(), data.size())
-      .attach(std::move(ans), std::move(data));
+  // On the heap, so that the buffer does not move.
+  auto text = kj::heap<std::string>(std::move(data));
+  return ans->write(text->data(), text->size())
+      .attach(std::move(ans), std::move(text));
+}
+
+inline kj::Promise<void> AnswerJson(kj::HttpService::Response& resp,
+                                    const json& j) {
+  return AnswerJsonWith(resp, [&j](JsonWriter& out) { out.Json(j); });
 }
 
 inline kj::Promise<void> AnswerRaw(kj::HttpService::Response& resp,
@@ -74,6 +88,11 @@ inline kj::Promise<void> AnswerRaw(kj::HttpService::Response& resp,
       .attach(std::move(ans), std::move(data));
 }
 
+inline kj::Promise<void> AnswerBinary(kj::HttpService::Response& resp,
+                                      const std::string& data) {
+  return AnswerRaw(resp, data.data(), data.size(), "application/octet-stream");
+}
+
 template <typename T, typename Context>
 class BaseAPIHandler {
  public:
@@ -150,7 +169,13 @@ class API<Data<U, Args...>, Context>
  public:
   static kj::Promise<void> Get(Context* context, const T* obj, const json& j,
                                kj::HttpService::Response& resp) {
-    return AnswerJson(resp, obj->Serialize());
+    if (obj->Storage().api_format == storage::Format::kBinary) {
+      std::string data;
+      obj->SerializeBinary(data);
+      return AnswerBinary(resp, data);
+    }
+    return AnswerJsonWith(resp,
+                          [obj](JsonWriter& out) { obj->Serialize(out); });
   }
   static void Register() { B::RegisterConstAPI("get", &Get); }
 };
@@ -175,6 +200,17 @@ class API<::db::detail::Value<
  public:
   static kj::Promise<void> List(Context* context, const T* obj, const json& j,
                                 kj::HttpService::Response& resp) {
+    // In binary, the list is the number of elements followed by the key and
+    // the summary of each.
+    if (obj->Storage().api_format == storage::Format::kBinary) {
+      std::string data;
+      binary::PutVarint(data, obj->Size());
+      for (const auto& [k, v] : *obj) {
+        ToBinary<typename T::KeyType>()(k, data);
+        ToBinary<json>()(Summary<typename T::Contained>::Get(&*v), data);
+      }
+      return AnswerBinary(resp, data);
+    }
     json r = json::array();
     for (const auto& [k, v] : *obj) {
       r[k] = Summary<typename T::Contained>::Get(&*v);
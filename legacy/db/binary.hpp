@@ -0,0 +1,306 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "db/json.hpp"
+#include "util/time.hpp"
+
+namespace db {
+
+// Binary encoding of values: integers are varints (zigzag-encoded if they are
+// signed), floating point numbers are little-endian IEEE 754, and strings and
+// collections are prefixed by their length.
+//
+// A Data is a sequence of fields, each made of the field id, the length of
+// the encoded member and the member itself. Field ids are the positions of
+// the members in the Data, so new members should only be added at the end.
+// Fields with an unknown id are skipped.
+namespace binary {
+
+inline void PutVarint(std::string& out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(char((v & 0x7F) | 0x80));
+    v >>= 7;
+  }
+  out.push_back(char(v));
+}
+
+inline void PutLengthPrefixed(std::string& out, std::string_view data) {
+  PutVarint(out, data.size());
+  out.append(data.data(), data.size());
+}
+
+inline void PutField(std::string& out, size_t id, std::string_view data) {
+  PutVarint(out, id);
+  PutLengthPrefixed(out, data);
+}
+
+class Reader {
+ public:
+  explicit Reader(std::string_view data)
+      : pos_(data.data()), end_(data.data() + data.size()) {}
+
+  uint64_t Varint() {
+    uint64_t v = 0;
+    for (size_t shift = 0; shift < 64; shift += 7) {
+      uint8_t b = Bytes(1)[0];
+      v |= uint64_t(b & 0x7F) << shift;
+      if (!(b & 0x80)) return v;
+    }
+    throw std::runtime_error("Invalid binary data!");
+  }
+
+  std::string_view Bytes(size_t n) {
+    if (Remaining() < n) throw std::runtime_error("Invalid binary data!");
+    std::string_view r(pos_, n);
+    pos_ += n;
+    return r;
+  }
+
+  std::string_view LengthPrefixed() { return Bytes(Varint()); }
+
+  // Like LengthPrefixed, but returns false if the data is truncated.
+  bool TryLengthPrefixed(std::string_view& out) {
+    const char* start = pos_;
+    try {
+      out = LengthPrefixed();
+      return true;
+    } catch (std::runtime_error&) {
+      pos_ = start;
+      return false;
+    }
+  }
+
+  size_t Remaining() const { return end_ - pos_; }
+  bool Done() const { return pos_ == end_; }
+
+ private:
+  const char* pos_;
+  const char* end_;
+};
+
+template <typename F>
+void ForEachField(std::string_view data, const F& f) {
+  Reader r(data);
+  while (!r.Done()) {
+    size_t id = r.Varint();
+    f(id, r.LengthPrefixed());
+  }
+}
+
+// Returns the fields with ids in [0, N), and throws if one is missing.
+template <size_t N>
+std::array<std::string_view, N> SplitFields(std::string_view data) {
+  std::array<std::string_view, N> fields;
+  std::array<bool, N> found = {};
+  ForEachField(data, [&](size_t id, std::string_view field) {
+    if (id >= N) return;
+    fields[id] = field;
+    found[id] = true;
+  });
+  for (bool f : found) {
+    if (!f) throw std::runtime_error("Invalid binary data!");
+  }
+  return fields;
+}
+
+}  // namespace binary
+
+template <typename T, typename = void>
+struct FromBinary;
+
+template <typename T>
+struct FromBinary<T, std::enable_if_t<std::is_integral_v<T>>> {
+  T operator()(binary::Reader& in) const {
+    uint64_t v = in.Varint();
+    if constexpr (std::is_same_v<T, bool>) {
+      return v != 0;
+    } else if constexpr (std::is_signed_v<T>) {
+      return T((v >> 1) ^ (~(v & 1) + 1));
+    } else {
+      return T(v);
+    }
+  }
+};
+
+template <typename T>
+struct FromBinary<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+  static_assert(sizeof(T) == 4 || sizeof(T) == 8);
+  T operator()(binary::Reader& in) const {
+    using I = std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t>;
+    std::string_view b = in.Bytes(sizeof(T));
+    I i = 0;
+    for (size_t k = 0; k < sizeof(T); k++) {
+      i |= I(uint8_t(b[k])) << (8 * k);
+    }
+    T v;
+    memcpy(&v, &i, sizeof(T));
+    return v;
+  }
+};
+
+template <>
+struct FromBinary<std::string> {
+  std::string operator()(binary::Reader& in) const {
+    return std::string(in.LengthPrefixed());
+  }
+};
+
+template <typename T>
+struct FromBinary<std::vector<T>> {
+  std::vector<T> operator()(binary::Reader& in) {
+    size_t n = in.Varint();
+    std::vector<T> res;
+    res.reserve(std::min(n, in.Remaining()));
+    for (size_t i = 0; i < n; i++) {
+      res.push_back(FromBinary<T>()(in));
+    }
+    return res;
+  }
+};
+
+template <typename T>
+struct FromBinary<std::unordered_set<T>> {
+  std::unordered_set<T> operator()(binary::Reader& in) {
+    size_t n = in.Varint();
+    std::unordered_set<T> res;
+    for (size_t i = 0; i < n; i++) {
+      res.emplace(FromBinary<T>()(in));
+    }
+    return res;
+  }
+};
+
+template <typename T, typename U>
+struct FromBinary<std::unordered_map<T, U>> {
+  std::unordered_map<T, U> operator()(binary::Reader& in) {
+    size_t n = in.Varint();
+    std::unordered_map<T, U> res;
+    for (size_t i = 0; i < n; i++) {
+      T k = FromBinary<T>()(in);
+      res.emplace(std::move(k), FromBinary<U>()(in));
+    }
+    return res;
+  }
+};
+
+// Free-form JSON values are stored as MessagePack.
+template <>
+struct FromBinary<json> {
+  json operator()(binary::Reader& in) {
+    std::string_view b = in.LengthPrefixed();
+    return json::from_msgpack(b.begin(), b.end());
+  }
+};
+
+template <>
+struct FromBinary<::util::tm_time_t> {
+  util::tm_time_t operator()(binary::Reader& in) {
+    return util::FromTimestamp(FromBinary<double>()(in));
+  }
+};
+
+template <typename T, typename = void>
+struct ToBinary;
+
+template <typename T>
+struct ToBinary<T, std::enable_if_t<std::is_integral_v<T>>> {
+  void operator()(const T& v, std::string& out) const {
+    if constexpr (std::is_signed_v<T> && !std::is_same_v<T, bool>) {
+      uint64_t u = uint64_t(int64_t(v));
+      binary::PutVarint(out, (u << 1) ^ (v < 0 ? ~uint64_t(0) : 0));
+    } else {
+      binary::PutVarint(out, uint64_t(v));
+    }
+  }
+};
+
+template <typename T>
+struct ToBinary<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+  static_assert(sizeof(T) == 4 || sizeof(T) == 8);
+  void operator()(const T& v, std::string& out) const {
+    using I = std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t>;
+    I i;
+    memcpy(&i, &v, sizeof(T));
+    for (size_t k = 0; k < sizeof(T); k++) {
+      out.push_back(char((i >> (8 * k)) & 0xFF));
+    }
+  }
+};
+
+template <>
+struct ToBinary<std::string> {
+  void operator()(const std::string& v, std::string& out) const {
+    binary::PutLengthPrefixed(out, v);
+  }
+};
+
+template <typename T>
+struct ToBinary<std::vector<T>> {
+  void operator()(const std::vector<T>& v, std::string& out) {
+    binary::PutVarint(out, v.size());
+    for (const auto& e : v) {
+      ToBinary<T>()(e, out);
+    }
+  }
+};
+
+template <typename T>
+struct ToBinary<std::unordered_set<T>> {
+  void operator()(const std::unordered_set<T>& v, std::string& out) {
+    binary::PutVarint(out, v.size());
+    for (const auto& e : v) {
+      ToBinary<T>()(e, out);
+    }
+  }
+};
+
+template <typename T, typename U>
+struct ToBinary<std::unordered_map<T, U>> {
+  void operator()(const std::unordered_map<T, U>& v, std::string& out) {
+    binary::PutVarint(out, v.size());
+    for (const auto& [k, e] : v) {
+      ToBinary<T>()(k, out);
+      ToBinary<U>()(e, out);
+    }
+  }
+};
+
+template <>
+struct ToBinary<json> {
+  void operator()(const json& v, std::string& out) {
+    std::vector<uint8_t> b = json::to_msgpack(v);
+    binary::PutLengthPrefixed(
+        out, std::string_view(reinterpret_cast<const char*>(b.data()),
+                              b.size()));
+  }
+};
+
+template <>
+struct ToBinary<::util::tm_time_t> {
+  void operator()(const ::util::tm_time_t t, std::string& out) {
+    ToBinary<double>()(util::ToTimestamp(t), out);
+  }
+};
+
+namespace binary {
+
+// Decodes a value that takes the whole of data.
+template <typename T>
+T Decode(std::string_view data) {
+  Reader r(data);
+  T v = FromBinary<T>()(r);
+  if (!r.Done()) throw std::runtime_error("Invalid binary data!");
+  return v;
+}
+
+}  // namespace binary
+
+}  // namespace db
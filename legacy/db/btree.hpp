@@ -0,0 +1,664 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace db {
+namespace util {
+
+// Ordered map stored as a B+ tree: entries are kept sorted in leaves of a few
+// hundred bytes, which are linked to each other for iteration, and inner
+// nodes only hold the keys that separate their children. Lookups touch one
+// node per level, and scans read entries contiguously.
+//
+// Inserting and erasing may move entries between leaves, which invalidates
+// iterators and references to other entries. As with FlatMap, objects whose
+// address must not change are kept behind a pointer.
+template <typename K, typename V, typename Compare = std::less<K>>
+class BTreeMap {
+ public:
+  using key_type = K;
+  using mapped_type = V;
+  using value_type = std::pair<const K, V>;
+
+ private:
+  template <typename C, typename = void>
+  struct IsTransparent : std::false_type {};
+  template <typename C>
+  struct IsTransparent<C, std::void_t<typename C::is_transparent>>
+      : std::true_type {};
+  template <typename Q>
+  using EnableIfTransparent = std::enable_if_t<IsTransparent<Compare>::value &&
+                                               !std::is_same_v<Q, K>>;
+
+  static constexpr size_t kLeafSlots =
+      std::clamp<size_t>(512 / sizeof(value_type), 4, 64);
+  static constexpr size_t kInnerSlots = 32;
+
+  // Storage for N objects of type T, of which the owner tracks the ones that
+  // are constructed.
+  template <typename T, size_t N>
+  struct Slots {
+    T& operator[](size_t i) {
+      return *std::launder(reinterpret_cast<T*>(data) + i);
+    }
+    const T& operator[](size_t i) const {
+      return *std::launder(reinterpret_cast<const T*>(data) + i);
+    }
+    template <typename... Args>
+    void Construct(size_t i, Args&&... args) {
+      new (reinterpret_cast<T*>(data) + i) T(std::forward<Args>(args)...);
+    }
+    void Destroy(size_t i) { (*this)[i].~T(); }
+    // Moves the object from j of from to i, which must not be constructed.
+    void Move(size_t i, Slots& from, size_t j) {
+      Construct(i, std::move(from[j]));
+      from.Destroy(j);
+    }
+    void Move(size_t i, size_t j) { Move(i, *this, j); }
+    alignas(T) unsigned char data[N * sizeof(T)];
+  };
+
+  struct Inner;
+  struct Node {
+    explicit Node(bool leaf) : leaf(leaf) {}
+    bool leaf;
+    // Entries of a leaf, or children of an inner node.
+    size_t count = 0;
+    Inner* parent = nullptr;
+    // Index in the children of parent.
+    size_t position = 0;
+  };
+  // One extra slot, so that nodes can be split after the insertion that
+  // overflows them.
+  struct Leaf : Node {
+    Leaf() : Node(true) {}
+    Leaf* prev = nullptr;
+    Leaf* next = nullptr;
+    Slots<value_type, kLeafSlots + 1> entries;
+  };
+  // keys[i] is greater than the keys of children[i], and not greater than
+  // those of children[i + 1].
+  struct Inner : Node {
+    Inner() : Node(false) {}
+    Node* children[kInnerSlots + 1];
+    Slots<K, kInnerSlots> keys;
+  };
+
+ public:
+  template <bool kConst>
+  class Iterator {
+    using Map = std::conditional_t<kConst, const BTreeMap, BTreeMap>;
+
+   public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = BTreeMap::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = std::conditional_t<kConst, const value_type*, value_type*>;
+    using reference =
+        std::conditional_t<kConst, const value_type&, value_type&>;
+
+    Iterator() = default;
+    template <bool kOtherConst,
+              typename = std::enable_if_t<kConst && !kOtherConst>>
+    Iterator(const Iterator<kOtherConst>& other)
+        : map_(other.map_), leaf_(other.leaf_), index_(other.index_) {}
+
+    reference operator*() const { return leaf_->entries[index_]; }
+    pointer operator->() const { return &leaf_->entries[index_]; }
+    Iterator& operator++() {
+      if (++index_ == leaf_->count) {
+        leaf_ = leaf_->next;
+        index_ = 0;
+      }
+      return *this;
+    }
+    Iterator operator++(int) {
+      Iterator r = *this;
+      ++*this;
+      return r;
+    }
+    Iterator& operator--() {
+      if (!leaf_) {
+        leaf_ = map_->last_;
+        index_ = leaf_->count - 1;
+      } else if (index_ == 0) {
+        leaf_ = leaf_->prev;
+        index_ = leaf_->count - 1;
+      } else {
+        index_--;
+      }
+      return *this;
+    }
+    Iterator operator--(int) {
+      Iterator r = *this;
+      --*this;
+      return r;
+    }
+    bool operator==(const Iterator& other) const {
+      return leaf_ == other.leaf_ && index_ == other.index_;
+    }
+    bool operator!=(const Iterator& other) const { return !(*this == other); }
+
+   private:
+    friend BTreeMap;
+    Iterator(Map* map, Leaf* leaf, size_t index)
+        : map_(map), leaf_(leaf), index_(index) {}
+    Map* map_ = nullptr;
+    // nullptr for end().
+    Leaf* leaf_ = nullptr;
+    size_t index_ = 0;
+  };
+  using iterator = Iterator<false>;
+  using const_iterator = Iterator<true>;
+  using reverse_iterator = std::reverse_iterator<iterator>;
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+  // An entry taken out of the map by extract.
+  class node_type {
+   public:
+    node_type() = default;
+    bool empty() const { return !entry_; }
+    explicit operator bool() const { return bool(entry_); }
+    K& key() { return entry_->first; }
+    V& mapped() { return entry_->second; }
+
+   private:
+    friend BTreeMap;
+    std::optional<std::pair<K, V>> entry_;
+  };
+
+  struct insert_return_type {
+    iterator position;
+    bool inserted;
+    node_type node;
+  };
+
+  BTreeMap() = default;
+  BTreeMap(const BTreeMap& other) {
+    for (const auto& [k, v] : other) emplace_hint(end(), k, v);
+  }
+  BTreeMap(BTreeMap&& other) noexcept { Take(other); }
+  BTreeMap& operator=(const BTreeMap& other) {
+    if (this != &other) *this = BTreeMap(other);
+    return *this;
+  }
+  BTreeMap& operator=(BTreeMap&& other) noexcept {
+    if (this != &other) {
+      clear();
+      Take(other);
+    }
+    return *this;
+  }
+  ~BTreeMap() { clear(); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  iterator begin() { return iterator(this, first_, 0); }
+  iterator end() { return iterator(this, nullptr, 0); }
+  const_iterator begin() const { return const_iterator(this, first_, 0); }
+  const_iterator end() const { return const_iterator(this, nullptr, 0); }
+  reverse_iterator rbegin() { return reverse_iterator(end()); }
+  reverse_iterator rend() { return reverse_iterator(begin()); }
+  const_reverse_iterator rbegin() const {
+    return const_reverse_iterator(end());
+  }
+  const_reverse_iterator rend() const {
+    return const_reverse_iterator(begin());
+  }
+
+  // First entry whose key is not less than key.
+  iterator lower_bound(const K& key) { return Bound<true>(key); }
+  const_iterator lower_bound(const K& key) const { return Bound<true>(key); }
+  template <typename Q, typename = EnableIfTransparent<Q>>
+  iterator lower_bound(const Q& key) {
+    return Bound<true>(key);
+  }
+  template <typename Q, typename = EnableIfTransparent<Q>>
+  const_iterator lower_bound(const Q& key) const {
+    return Bound<true>(key);
+  }
+  // First entry whose key is greater than key.
+  iterator upper_bound(const K& key) { return Bound<false>(key); }
+  const_iterator upper_bound(const K& key) const { return Bound<false>(key); }
+  template <typename Q, typename = EnableIfTransparent<Q>>
+  iterator upper_bound(const Q& key) {
+    return Bound<false>(key);
+  }
+  template <typename Q, typename = EnableIfTransparent<Q>>
+  const_iterator upper_bound(const Q& key) const {
+    return Bound<false>(key);
+  }
+
+  iterator find(const K& key) {
+    auto it = lower_bound(key);
+    return it == end() || Less(key, it->first) ? end() : it;
+  }
+  const_iterator find(const K& key) const {
+    auto it = lower_bound(key);
+    return it == end() || Less(key, it->first) ? end() : it;
+  }
+  size_t count(const K& key) const { return find(key) != end(); }
+
+  V& at(const K& key) {
+    auto it = find(key);
+    if (it == end()) throw std::out_of_range("BTreeMap::at");
+    return it->second;
+  }
+  const V& at(const K& key) const {
+    auto it = find(key);
+    if (it == end()) throw std::out_of_range("BTreeMap::at");
+    return it->second;
+  }
+
+  // Does not construct the value if the key is already present.
+  template <typename A, typename... Args>
+  std::pair<iterator, bool> emplace(A&& key, Args&&... args) {
+    if constexpr (std::is_same_v<std::decay_t<A>, K>) {
+      return Emplace(std::forward<A>(key), std::forward<Args>(args)...);
+    } else {
+      return Emplace(K(std::forward<A>(key)), std::forward<Args>(args)...);
+    }
+  }
+
+  // Takes constant time per leaf when appending in key order.
+  template <typename... Args>
+  iterator emplace_hint(const_iterator hint, const K& key, Args&&... args) {
+    if (hint == end() && last_ && Less(last_->entries[last_->count - 1].first,
+                                       key)) {
+      return Insert(last_, last_->count, K(key), std::forward<Args>(args)...);
+    }
+    return emplace(key, std::forward<Args>(args)...).first;
+  }
+
+  V& operator[](const K& key) { return emplace(key).first->second; }
+
+  size_t erase(const K& key) {
+    auto it = find(key);
+    if (it == end()) return 0;
+    EraseAt(it.leaf_, it.index_);
+    return 1;
+  }
+  iterator erase(const_iterator it) {
+    K key = it->first;
+    EraseAt(it.leaf_, it.index_);
+    return lower_bound(key);
+  }
+
+  node_type extract(const K& key) {
+    node_type node;
+    auto it = find(key);
+    if (it == end()) return node;
+    node.entry_.emplace(it->first, std::move(it->second));
+    EraseAt(it.leaf_, it.index_);
+    return node;
+  }
+
+  insert_return_type insert(node_type&& node) {
+    if (node.empty()) return {end(), false, node_type()};
+    auto r = Emplace(std::move(node.key()), std::move(node.mapped()));
+    if (!r.second) return {r.first, false, std::move(node)};
+    return {r.first, true, node_type()};
+  }
+
+  void clear() {
+    if (root_) Free(root_);
+    root_ = nullptr;
+    first_ = last_ = nullptr;
+    size_ = 0;
+  }
+
+  // Nothing to reserve; present so that BTreeMap can replace FlatMap.
+  void reserve(size_t) {}
+
+ private:
+  template <typename A, typename B>
+  static bool Less(const A& a, const B& b) {
+    return Compare()(a, b);
+  }
+
+  // Index of the child of node that may contain the first key that is not
+  // less than key if kLower, or greater than key otherwise.
+  template <bool kLower, typename Q>
+  static size_t ChildIndex(const Inner* node, const Q& key) {
+    size_t lo = 0, hi = node->count - 1;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      const K& separator = node->keys[mid];
+      if (kLower ? !Less(separator, key) : Less(key, separator)) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    return lo;
+  }
+
+  // Index of the first entry of leaf that is not less than key if kLower, or
+  // greater than key otherwise.
+  template <bool kLower, typename Q>
+  static size_t LeafIndex(const Leaf* leaf, const Q& key) {
+    size_t lo = 0, hi = leaf->count;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      const K& entry = leaf->entries[mid].first;
+      if (kLower ? !Less(entry, key) : Less(key, entry)) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    return lo;
+  }
+
+  template <bool kLower, typename Q>
+  std::pair<Leaf*, size_t> Descend(const Q& key) const {
+    if (!root_) return {nullptr, 0};
+    Node* node = root_;
+    while (!node->leaf) {
+      auto* inner = static_cast<Inner*>(node);
+      node = inner->children[ChildIndex<kLower>(inner, key)];
+    }
+    auto* leaf = static_cast<Leaf*>(node);
+    return {leaf, LeafIndex<kLower>(leaf, key)};
+  }
+
+  // The leaf that must contain key, and the index of the first entry in it
+  // that is not less than key, which may be past its end. Keys equal to a
+  // separator are to its right.
+  std::pair<Leaf*, size_t> Position(const K& key) const {
+    if (!root_) return {nullptr, 0};
+    Node* node = root_;
+    while (!node->leaf) {
+      auto* inner = static_cast<Inner*>(node);
+      node = inner->children[ChildIndex<false>(inner, key)];
+    }
+    auto* leaf = static_cast<Leaf*>(node);
+    return {leaf, LeafIndex<true>(leaf, key)};
+  }
+
+  // The first entry that is not less than key, or greater than key, which
+  // may be in the leaf after the one Descend reaches.
+  template <bool kLower, typename Q>
+  iterator Bound(const Q& key) {
+    auto [leaf, index] = Descend<kLower>(key);
+    if (leaf && index == leaf->count) return iterator(this, leaf->next, 0);
+    return iterator(this, leaf, index);
+  }
+  template <bool kLower, typename Q>
+  const_iterator Bound(const Q& key) const {
+    return const_cast<BTreeMap*>(this)->Bound<kLower>(key);
+  }
+
+  // key and value are only moved from if the entry is inserted, which is why
+  // they are not taken as a value_type.
+  template <typename... Args>
+  std::pair<iterator, bool> Emplace(K&& key, Args&&... args) {
+    auto [leaf, index] = Position(key);
+    if (leaf && index < leaf->count &&
+        !Less(key, leaf->entries[index].first)) {
+      return {iterator(this, leaf, index), false};
+    }
+    return {Insert(leaf, index, std::move(key), std::forward<Args>(args)...),
+            true};
+  }
+  template <typename... Args>
+  std::pair<iterator, bool> Emplace(const K& key, Args&&... args) {
+    return Emplace(K(key), std::forward<Args>(args)...);
+  }
+
+  // Inserts the entry at index of leaf, which must be where Position puts
+  // key.
+  template <typename... Args>
+  iterator Insert(Leaf* leaf, size_t index, K&& key, Args&&... args) {
+    if (!root_) {
+      leaf = new Leaf();
+      root_ = first_ = last_ = leaf;
+      index = 0;
+    }
+    for (size_t i = leaf->count; i > index; i--) leaf->entries.Move(i, i - 1);
+    leaf->entries.Construct(index, std::piecewise_construct,
+                            std::forward_as_tuple(std::move(key)),
+                            std::forward_as_tuple(std::forward<Args>(args)...));
+    leaf->count++;
+    size_++;
+    if (leaf->count > kLeafSlots) {
+      Leaf* right = SplitLeaf(leaf);
+      if (index >= leaf->count) {
+        index -= leaf->count;
+        leaf = right;
+      }
+    }
+    return iterator(this, leaf, index);
+  }
+
+  Leaf* SplitLeaf(Leaf* leaf) {
+    auto* right = new Leaf();
+    size_t keep = leaf->count / 2;
+    for (size_t i = keep; i < leaf->count; i++) {
+      right->entries.Move(i - keep, leaf->entries, i);
+    }
+    right->count = leaf->count - keep;
+    leaf->count = keep;
+    right->next = leaf->next;
+    right->prev = leaf;
+    if (leaf->next) leaf->next->prev = right;
+    leaf->next = right;
+    if (last_ == leaf) last_ = right;
+    InsertInParent(leaf, right->entries[0].first, right);
+    return right;
+  }
+
+  // Adds right after left, which is a child of its parent, with the given
+  // separator.
+  void InsertInParent(Node* left, const K& key, Node* right) {
+    Inner* parent = left->parent;
+    if (!parent) {
+      parent = new Inner();
+      parent->children[0] = left;
+      parent->count = 1;
+      left->parent = parent;
+      left->position = 0;
+      root_ = parent;
+    }
+    size_t i = left->position + 1;
+    for (size_t j = parent->count; j > i; j--) {
+      parent->children[j] = parent->children[j - 1];
+      parent->children[j]->position = j;
+    }
+    for (size_t j = parent->count - 1; j > i - 1; j--) {
+      parent->keys.Move(j, j - 1);
+    }
+    parent->keys.Construct(i - 1, key);
+    parent->children[i] = right;
+    right->parent = parent;
+    right->position = i;
+    parent->count++;
+    if (parent->count > kInnerSlots) SplitInner(parent);
+  }
+
+  void SplitInner(Inner* node) {
+    auto* right = new Inner();
+    size_t keep = node->count / 2;
+    for (size_t i = keep; i < node->count; i++) {
+      right->children[i - keep] = node->children[i];
+      right->children[i - keep]->parent = right;
+      right->children[i - keep]->position = i - keep;
+    }
+    for (size_t i = keep; i + 1 < node->count; i++) {
+      right->keys.Move(i - keep, node->keys, i);
+    }
+    right->count = node->count - keep;
+    node->count = keep;
+    K separator = std::move(node->keys[keep - 1]);
+    node->keys.Destroy(keep - 1);
+    InsertInParent(node, separator, right);
+  }
+
+  void EraseAt(Leaf* leaf, size_t index) {
+    leaf->entries.Destroy(index);
+    for (size_t i = index; i + 1 < leaf->count; i++) {
+      leaf->entries.Move(i, i + 1);
+    }
+    leaf->count--;
+    size_--;
+    if (leaf == root_) {
+      if (leaf->count == 0) clear();
+      return;
+    }
+    if (leaf->count >= kLeafSlots / 2) return;
+    Inner* parent = leaf->parent;
+    size_t pos = leaf->position;
+    Leaf* left = pos > 0 ? static_cast<Leaf*>(parent->children[pos - 1]) : leaf;
+    Leaf* right = pos > 0 ? leaf : static_cast<Leaf*>(parent->children[1]);
+    if (left->count + right->count <= kLeafSlots) {
+      MergeLeaves(left, right);
+    } else if (left == leaf) {
+      // Take the first entry of the right sibling.
+      left->entries.Move(left->count++, right->entries, 0);
+      for (size_t i = 0; i + 1 < right->count; i++) {
+        right->entries.Move(i, i + 1);
+      }
+      right->count--;
+      parent->keys[right->position - 1] = right->entries[0].first;
+    } else {
+      // Take the last entry of the left sibling.
+      for (size_t i = right->count; i > 0; i--) right->entries.Move(i, i - 1);
+      right->entries.Move(0, left->entries, --left->count);
+      right->count++;
+      parent->keys[right->position - 1] = right->entries[0].first;
+    }
+  }
+
+  void MergeLeaves(Leaf* left, Leaf* right) {
+    for (size_t i = 0; i < right->count; i++) {
+      left->entries.Move(left->count + i, right->entries, i);
+    }
+    left->count += right->count;
+    right->count = 0;
+    left->next = right->next;
+    if (right->next) right->next->prev = left;
+    if (last_ == right) last_ = left;
+    Inner* parent = right->parent;
+    RemoveChild(parent, right->position);
+    delete right;
+    Rebalance(parent);
+  }
+
+  // Removes children[i] and the separator before it.
+  void RemoveChild(Inner* node, size_t i) {
+    node->keys.Destroy(i - 1);
+    for (size_t j = i; j + 1 < node->count; j++) {
+      node->keys.Move(j - 1, j);
+      node->children[j] = node->children[j + 1];
+      node->children[j]->position = j;
+    }
+    node->count--;
+  }
+
+  void Rebalance(Inner* node) {
+    if (node == root_) {
+      if (node->count == 1) {
+        root_ = node->children[0];
+        root_->parent = nullptr;
+        root_->position = 0;
+        node->count = 0;
+        delete node;
+      }
+      return;
+    }
+    if (node->count >= kInnerSlots / 2) return;
+    Inner* parent = node->parent;
+    size_t pos = node->position;
+    Inner* left = pos > 0 ? static_cast<Inner*>(parent->children[pos - 1])
+                          : node;
+    Inner* right = pos > 0 ? node : static_cast<Inner*>(parent->children[1]);
+    size_t separator = right->position - 1;
+    if (left->count + right->count <= kInnerSlots) {
+      // The separator comes down between the keys of the two nodes.
+      left->keys.Construct(left->count - 1, parent->keys[separator]);
+      for (size_t i = 0; i < right->count; i++) {
+        Node* child = right->children[i];
+        left->children[left->count + i] = child;
+        child->parent = left;
+        child->position = left->count + i;
+        if (i + 1 < right->count) {
+          left->keys.Move(left->count + i, right->keys, i);
+        }
+      }
+      left->count += right->count;
+      right->count = 0;
+      RemoveChild(parent, right->position);
+      delete right;
+      Rebalance(parent);
+    } else if (left == node) {
+      // Rotate the first child of the right sibling through the parent.
+      left->keys.Construct(left->count - 1, parent->keys[separator]);
+      parent->keys[separator] = std::move(right->keys[0]);
+      Node* child = right->children[0];
+      left->children[left->count] = child;
+      child->parent = left;
+      child->position = left->count++;
+      right->keys.Destroy(0);
+      for (size_t i = 0; i + 1 < right->count; i++) {
+        if (i + 2 < right->count) right->keys.Move(i, i + 1);
+        right->children[i] = right->children[i + 1];
+        right->children[i]->position = i;
+      }
+      right->count--;
+    } else {
+      // Rotate the last child of the left sibling through the parent.
+      for (size_t i = right->count; i > 0; i--) {
+        if (i < right->count) right->keys.Move(i, i - 1);
+        right->children[i] = right->children[i - 1];
+        right->children[i]->position = i;
+      }
+      right->keys.Construct(0, parent->keys[separator]);
+      parent->keys[separator] = std::move(left->keys[left->count - 2]);
+      left->keys.Destroy(left->count - 2);
+      Node* child = left->children[--left->count];
+      right->children[0] = child;
+      child->parent = right;
+      child->position = 0;
+      right->count++;
+    }
+  }
+
+  void Free(Node* node) {
+    if (node->leaf) {
+      auto* leaf = static_cast<Leaf*>(node);
+      for (size_t i = 0; i < leaf->count; i++) leaf->entries.Destroy(i);
+      delete leaf;
+    } else {
+      auto* inner = static_cast<Inner*>(node);
+      for (size_t i = 0; i < inner->count; i++) Free(inner->children[i]);
+      for (size_t i = 0; i + 1 < inner->count; i++) inner->keys.Destroy(i);
+      delete inner;
+    }
+  }
+
+  void Take(BTreeMap& other) {
+    root_ = std::exchange(other.root_, nullptr);
+    first_ = std::exchange(other.first_, nullptr);
+    last_ = std::exchange(other.last_, nullptr);
+    size_ = std::exchange(other.size_, 0);
+  }
+
+  Node* root_ = nullptr;
+  // The leftmost and rightmost leaves.
+  Leaf* first_ = nullptr;
+  Leaf* last_ = nullptr;
+  size_t size_ = 0;
+};
+
+}  // namespace util
+}  // namespace db
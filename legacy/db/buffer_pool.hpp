@@ -0,0 +1,110 @@
+#pragma once
+#include <kj/debug.h>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+namespace db {
+namespace storage {
+
+// Bounds the memory used by the elements of all the LazyContainers of a
+// database. Each element in memory has a frame, with an estimate of its size;
+// when the total goes over the capacity, the least recently used elements are
+// dropped, and loaded again on their next access.
+//
+// Frames record the frame of the element they are loaded in, if any, so that
+// loading an element never drops the elements that contain it. Elements of
+// containers with an open editor are pinned, and are skipped.
+//
+// Not thread safe: it is only used by the thread that owns the objects.
+class BufferPool {
+ public:
+  using FrameId = size_t;
+  static constexpr FrameId kNoFrame = std::numeric_limits<FrameId>::max();
+
+  explicit BufferPool(size_t capacity) : capacity_(capacity) {}
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  // evict drops the element and returns true, or returns false if the element
+  // is pinned. It must not call Remove on its own frame.
+  FrameId Add(size_t bytes, FrameId parent, std::function<bool()> evict) {
+    FrameId id = next_id_++;
+    lru_.push_front(id);
+    frames_.emplace(id, Frame{bytes, parent, std::move(evict), lru_.begin()});
+    used_ += bytes;
+    return id;
+  }
+
+  // Marks the frame, and the ones containing it, as the most recently used.
+  void Touch(FrameId id) {
+    for (auto it = frames_.find(id); it != frames_.end();
+         it = frames_.find(it->second.parent)) {
+      lru_.splice(lru_.begin(), lru_, it->second.pos);
+    }
+  }
+
+  void Remove(FrameId id) {
+    auto it = frames_.find(id);
+    KJ_REQUIRE(it != frames_.end(), "unknown frame", id);
+    used_ -= it->second.bytes;
+    lru_.erase(it->second.pos);
+    frames_.erase(it);
+  }
+
+  // Drops elements until the used memory is within the capacity, or only
+  // pinned elements are left. id and the frames containing it are kept.
+  void Reclaim(FrameId id) {
+    auto pos = lru_.rbegin();
+    while (used_ > capacity_ && pos != lru_.rend()) {
+      FrameId victim = *pos;
+      if (Contains(victim, id)) {
+        ++pos;
+        continue;
+      }
+      // Dropping an element removes the frames of the elements within it,
+      // which may be anywhere in lru_.
+      auto evict = frames_.at(victim).evict;
+      if (!evict()) {
+        ++pos;
+        continue;
+      }
+      Remove(victim);
+      pos = lru_.rbegin();
+    }
+  }
+
+  size_t Used() const { return used_; }
+  size_t Capacity() const { return capacity_; }
+  size_t FrameCount() const { return frames_.size(); }
+
+ private:
+  struct Frame {
+    size_t bytes;
+    FrameId parent;
+    std::function<bool()> evict;
+    std::list<FrameId>::iterator pos;
+  };
+
+  // Whether the element of frame outer is, or contains, the one of inner.
+  bool Contains(FrameId outer, FrameId inner) const {
+    for (auto it = frames_.find(inner); it != frames_.end();
+         it = frames_.find(it->second.parent)) {
+      if (it->first == outer) return true;
+    }
+    return false;
+  }
+
+  size_t capacity_;
+  size_t used_ = 0;
+  FrameId next_id_ = 0;
+  // Most recently used first.
+  std::list<FrameId> lru_;
+  std::unordered_map<FrameId, Frame> frames_;
+};
+
+}  // namespace storage
+}  // namespace db
@@ -0,0 +1,87 @@
+#pragma once
+#include <kj/debug.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+#include "db/flat_map.hpp"
+#include "db/util.hpp"
+
+namespace db {
+namespace util {
+
+// The OnChange callbacks of the objects of type Owner, which are kept out of
+// the objects as most of them have none. Objects record whether they added
+// callbacks, and then must Remove them when they are destroyed.
+//
+// Thread safe, as objects are loaded in parallel; the callbacks of a single
+// object are only used by one thread at a time.
+template <typename Owner, typename... Args>
+class CallbackTable {
+ public:
+  using callback_t = std::function<bool(Args...)>;
+  using revert_callback_t = std::function<void(Args...)>;
+
+  static void Add(const Owner* obj, callback_t action,
+                  revert_callback_t revert) {
+    Entry& entry = Get().Find(obj, true);
+    entry.on_commit.push_back(std::move(action));
+    entry.on_undo_commit.push_back(std::move(revert));
+  }
+
+  // Gives to the callbacks of from, replacing its own.
+  static void Copy(const Owner* from, const Owner* to) {
+    auto& table = Get();
+    std::lock_guard<std::mutex> lock(table.mutex_);
+    auto entry = std::make_unique<Entry>(*table.entries_.at(from));
+    table.entries_[to] = std::move(entry);
+  }
+
+  static void Remove(const Owner* obj) {
+    auto& table = Get();
+    std::lock_guard<std::mutex> lock(table.mutex_);
+    table.entries_.erase(obj);
+  }
+
+  // Calls the callbacks of obj, undoing them if one of them fails.
+  static bool Run(const Owner* obj, std::remove_reference_t<Args>&... args) {
+    const Entry& entry = Get().Find(obj, false);
+    return propagate_callback_safe(entry.on_commit, entry.on_undo_commit,
+                                   args...);
+  }
+
+  static void Revert(const Owner* obj, std::remove_reference_t<Args>&... args) {
+    for (const auto& f : Get().Find(obj, false).on_undo_commit) f(args...);
+  }
+
+ private:
+  struct Entry {
+    std::vector<callback_t> on_commit;
+    std::vector<revert_callback_t> on_undo_commit;
+  };
+
+  Entry& Find(const Owner* obj, bool create) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(obj);
+    if (it == entries_.end()) {
+      KJ_ASSERT(create, "object without callbacks");
+      it = entries_.emplace(obj, std::make_unique<Entry>()).first;
+    }
+    return *it->second;
+  }
+
+  // Never destroyed, as objects may outlive static storage.
+  static CallbackTable& Get() {
+    static auto* table = new CallbackTable();
+    return *table;
+  }
+
+  std::mutex mutex_;
+  // Entries are boxed, so that callbacks can add callbacks, to any object,
+  // while they run.
+  FlatMap<const Owner*, std::unique_ptr<Entry>> entries_;
+};
+
+}  // namespace util
+}  // namespace db
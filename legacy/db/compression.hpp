@@ -0,0 +1,296 @@
+#pragma once
+#include <kj/debug.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "db/binary.hpp"
+
+namespace db {
+namespace storage {
+
+struct CompressionStats {
+  // Snapshots given to Compress, and their total size before and after.
+  uint64_t compressions = 0;
+  uint64_t raw_bytes = 0;
+  uint64_t compressed_bytes = 0;
+  uint64_t compress_ns = 0;
+  uint64_t decompressions = 0;
+  uint64_t decompress_ns = 0;
+
+  double Ratio() const {
+    return compressed_bytes ? double(raw_bytes) / compressed_bytes : 1.0;
+  }
+};
+
+// LZ77 compression of object snapshots, optionally against a dictionary: the
+// dictionary is treated as if it preceded every snapshot, so that the field
+// names that every object repeats compress well even in small objects.
+//
+// A compressed snapshot is kMagic, the id of the dictionary (0 for none), the
+// size of the snapshot, and a sequence of literal runs, each followed by a
+// match (length and distance back) unless it ends the snapshot. Snapshots
+// that do not get smaller are stored as they are; they never start with
+// kMagic, as JSON text and binary objects cannot.
+class Compressor {
+ public:
+  static constexpr std::string_view kMagic = "\x89" "DBZ";
+  static constexpr size_t kDefaultDictionarySize = 16 << 10;
+
+  // The last dictionary is used to compress; the others are kept to read
+  // snapshots written with them.
+  explicit Compressor(std::vector<std::string> dictionaries = {}) {
+    for (auto& d : dictionaries) {
+      uint32_t id = DictionaryId(d);
+      dictionaries_.emplace(id, std::move(d));
+      current_ = id;
+    }
+  }
+  Compressor(const Compressor&) = delete;
+  Compressor& operator=(const Compressor&) = delete;
+
+  // Builds a dictionary of at most size bytes out of the substrings that are
+  // common to many of the samples, which should be encoded objects.
+  static std::string Train(const std::vector<std::string>& samples,
+                           size_t size = kDefaultDictionarySize) {
+    constexpr size_t k = 6;
+    // Number of samples that contain each k-gram.
+    std::unordered_map<std::string_view, size_t> grams;
+    for (const auto& s : samples) {
+      std::unordered_set<std::string_view> seen;
+      for (size_t i = 0; i + k <= s.size(); i++) {
+        std::string_view g(s.data() + i, k);
+        if (seen.insert(g).second) grams[g]++;
+      }
+    }
+    size_t threshold = std::max<size_t>(2, samples.size() / 4);
+    auto frequent = [&](const std::string& s, size_t i) {
+      return i + k <= s.size() &&
+             grams[std::string_view(s.data() + i, k)] >= threshold;
+    };
+    // Maximal runs of frequent k-grams, with the number of samples that
+    // contain them.
+    std::unordered_map<std::string, size_t> segments;
+    for (const auto& s : samples) {
+      std::unordered_set<std::string> seen;
+      for (size_t i = 0; i + k <= s.size();) {
+        if (!frequent(s, i)) {
+          i++;
+          continue;
+        }
+        size_t j = i;
+        while (frequent(s, j)) j++;
+        std::string segment = s.substr(i, j - i + k - 1);
+        if (seen.insert(segment).second) segments[segment]++;
+        i = j;
+      }
+    }
+    std::vector<std::pair<size_t, std::string>> scored;
+    for (auto& [segment, count] : segments) {
+      scored.emplace_back(count * segment.size(), segment);
+    }
+    std::sort(scored.begin(), scored.end(), [](const auto& a, const auto& b) {
+      return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+    std::vector<std::string> chosen;
+    size_t total = 0;
+    for (auto& [score, segment] : scored) {
+      if (total + segment.size() > size) continue;
+      bool covered = false;
+      for (const auto& c : chosen) {
+        if (c.find(segment) != std::string::npos) covered = true;
+      }
+      if (covered) continue;
+      total += segment.size();
+      chosen.push_back(std::move(segment));
+    }
+    // The best segments go last, where matches are the shortest to encode.
+    std::string dictionary;
+    for (auto it = chosen.rbegin(); it != chosen.rend(); ++it) {
+      dictionary += *it;
+    }
+    return dictionary;
+  }
+
+  std::string Compress(std::string_view data) const {
+    auto start = std::chrono::steady_clock::now();
+    std::string_view dict = Dictionary(current_);
+    std::string out(kMagic);
+    binary::PutVarint(out, current_);
+    binary::PutVarint(out, data.size());
+    std::string window;
+    window.reserve(dict.size() + data.size());
+    window.append(dict.data(), dict.size());
+    window.append(data.data(), data.size());
+
+    std::vector<int32_t> head(size_t(1) << kHashBits, -1);
+    std::vector<int32_t> prev(window.size(), -1);
+    auto insert = [&](size_t i) {
+      if (i + kMinMatch > window.size()) return;
+      uint32_t h = Hash(window.data() + i);
+      prev[i] = head[h];
+      head[h] = i;
+    };
+    for (size_t i = 0; i < dict.size(); i++) insert(i);
+    size_t pos = dict.size();
+    size_t literals = pos;
+    while (pos + kMinMatch <= window.size()) {
+      size_t best_len = 0;
+      size_t best_distance = 0;
+      int32_t candidate = head[Hash(window.data() + pos)];
+      for (size_t chain = 0; candidate >= 0 && chain < kMaxChain; chain++) {
+        size_t len = 0;
+        size_t max = window.size() - pos;
+        while (len < max && window[candidate + len] == window[pos + len]) {
+          len++;
+        }
+        if (len > best_len) {
+          best_len = len;
+          best_distance = pos - candidate;
+        }
+        candidate = prev[candidate];
+      }
+      if (best_len < kMinMatch) {
+        insert(pos++);
+        continue;
+      }
+      binary::PutLengthPrefixed(
+          out, std::string_view(window).substr(literals, pos - literals));
+      binary::PutVarint(out, best_len);
+      binary::PutVarint(out, best_distance);
+      for (size_t i = 0; i < best_len; i++) insert(pos + i);
+      pos += best_len;
+      literals = pos;
+    }
+    binary::PutLengthPrefixed(out, std::string_view(window).substr(literals));
+    if (out.size() >= data.size()) out = std::string(data);
+
+    stats_.compressions++;
+    stats_.raw_bytes += data.size();
+    stats_.compressed_bytes += out.size();
+    stats_.compress_ns += Elapsed(start);
+    return out;
+  }
+
+  // Also accepts snapshots that are not compressed.
+  std::string Decompress(std::string_view data) const {
+    return Decompress(data, this);
+  }
+
+  // Snapshots compressed with a dictionary can only be read if compressor
+  // has it.
+  static std::string Decompress(std::string_view data,
+                                const Compressor* compressor) {
+    if (!IsCompressed(data)) return std::string(data);
+    auto start = std::chrono::steady_clock::now();
+    binary::Reader r(data.substr(kMagic.size()));
+    uint32_t id = r.Varint();
+    std::string_view dict;
+    if (id != 0) {
+      KJ_REQUIRE(compressor != nullptr,
+                 "snapshot compressed with a dictionary", id);
+      dict = compressor->Dictionary(id);
+    }
+    size_t size = dict.size() + r.Varint();
+    std::string out(dict);
+    out.reserve(size);
+    while (true) {
+      std::string_view literals = r.LengthPrefixed();
+      out.append(literals.data(), literals.size());
+      if (out.size() >= size) break;
+      size_t len = r.Varint();
+      size_t distance = r.Varint();
+      if (distance == 0 || distance > out.size() || out.size() + len > size) {
+        throw std::runtime_error("Invalid compressed data!");
+      }
+      // Byte by byte, as the match may overlap the bytes it produces.
+      for (size_t i = 0, from = out.size() - distance; i < len; i++) {
+        out.push_back(out[from + i]);
+      }
+    }
+    if (out.size() != size || !r.Done()) {
+      throw std::runtime_error("Invalid compressed data!");
+    }
+    if (compressor) {
+      compressor->stats_.decompressions++;
+      compressor->stats_.decompress_ns += Elapsed(start);
+    }
+    return out.substr(dict.size());
+  }
+
+  static bool IsCompressed(std::string_view data) {
+    return data.substr(0, kMagic.size()) == kMagic;
+  }
+
+  CompressionStats Stats() const {
+    CompressionStats stats;
+    stats.compressions = stats_.compressions;
+    stats.raw_bytes = stats_.raw_bytes;
+    stats.compressed_bytes = stats_.compressed_bytes;
+    stats.compress_ns = stats_.compress_ns;
+    stats.decompressions = stats_.decompressions;
+    stats.decompress_ns = stats_.decompress_ns;
+    return stats;
+  }
+
+ private:
+  static constexpr size_t kMinMatch = 4;
+  static constexpr size_t kHashBits = 15;
+  static constexpr size_t kMaxChain = 16;
+
+  // Snapshots are compressed on writer threads, and read on loader threads.
+  struct AtomicStats {
+    std::atomic<uint64_t> compressions{0};
+    std::atomic<uint64_t> raw_bytes{0};
+    std::atomic<uint64_t> compressed_bytes{0};
+    std::atomic<uint64_t> compress_ns{0};
+    std::atomic<uint64_t> decompressions{0};
+    std::atomic<uint64_t> decompress_ns{0};
+  };
+
+  // FNV-1a of the contents, so that ids do not depend on the order in which
+  // dictionaries are given. Never 0, which means no dictionary.
+  static uint32_t DictionaryId(std::string_view dictionary) {
+    uint32_t h = 2166136261u;
+    for (char c : dictionary) {
+      h ^= uint8_t(c);
+      h *= 16777619u;
+    }
+    return h ? h : 1;
+  }
+
+  std::string_view Dictionary(uint32_t id) const {
+    if (id == 0) return {};
+    auto it = dictionaries_.find(id);
+    KJ_REQUIRE(it != dictionaries_.end(), "unknown compression dictionary",
+               id);
+    return it->second;
+  }
+
+  static uint32_t Hash(const char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - kHashBits);
+  }
+
+  static uint64_t Elapsed(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  }
+
+  std::unordered_map<uint32_t, std::string> dictionaries_;
+  uint32_t current_ = 0;
+  mutable AtomicStats stats_;
+};
+
+}  // namespace storage
+}  // namespace db
@@ -1,7 +1,19 @@
 #pragma once
-#include <unordered_map>
-#include <unordered_set>
+#include <algorithm>
+#include <iterator>
+#include <list>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "db/binary.hpp"
+#include "db/btree.hpp"
+#include "db/flat_map.hpp"
 #include "db/serializable.hpp"
+#include "db/slab.hpp"
+#include "db/storage.hpp"
 #include "db/util.hpp"
 #include "db/value.hpp"
 
@@ -40,9 +52,9 @@ class OwnerPtr {
   }
   template <typename... Args>
   static auto New(Owner* obj, Args... args) {
-    return std::make_unique<T>(nullptr, nullptr, obj, std::move(args)...);
+    return obj->slab_.New(nullptr, nullptr, obj, std::move(args)...);
   }
-  using type = std::unique_ptr<T>;
+  using type = typename util::SlabPool<T>::Ptr;
 };
 
 }  // namespace detail
@@ -106,7 +118,169 @@ class member<T, placeholders::sibling_> {
   }
 };
 
+// Declares a secondary index of a Container on members of its elements, as in
+// Container<T, Foo, Key, Index<test2_m>>, to find elements with
+// FindBy<test2_m>(v). Composite indexes, such as Index<tenant_m, email_m>,
+// can also be searched by a prefix of their members, as in
+// FindBy<tenant_m, email_m>(tenant).
+template <template <typename> class... membs>
+class Index {};
+
+// An Index whose members must be different for every element: commits that
+// would break this fail and are rolled back.
+template <template <typename> class... membs>
+class UniqueIndex {};
+
 namespace detail {
+// Orders tuples by the members they have in common, so that tuples of the
+// first members of a composite key find all the keys that start with them.
+struct PrefixLess {
+  using is_transparent = void;
+  template <typename A, typename B>
+  bool operator()(const A& a, const B& b) const {
+    constexpr size_t n =
+        std::min(std::tuple_size_v<A>, std::tuple_size_v<B>);
+    return Less(a, b, std::make_index_sequence<n>());
+  }
+  template <typename A, typename B, size_t... I>
+  static bool Less(const A& a, const B& b, std::index_sequence<I...>) {
+    return std::tie(std::get<I>(a)...) < std::tie(std::get<I>(b)...);
+  }
+};
+
+// The elements of a container by the values of their members membs. Elements
+// are kept by address, which does not change while they are in the container.
+// Single members are hashed; composite keys are kept in order, for prefix
+// lookups.
+template <typename Contained, bool kUnique, template <typename> class... membs>
+class SecondaryIndex {
+  static constexpr size_t kSize = sizeof...(membs);
+
+ public:
+  using Key = std::conditional_t<
+      kSize == 1,
+      std::tuple_element_t<0, std::tuple<typename membs<Contained>::type_...>>,
+      std::tuple<typename membs<Contained>::type_...>>;
+
+  template <typename... Args>
+  std::vector<const Contained*> Find(const Args&... v) const {
+    static_assert(sizeof...(Args) > 0 && sizeof...(Args) <= kSize,
+                  "too many values for the index");
+    std::vector<const Contained*> found;
+    auto add = [&](const Elements& elements) {
+      found.insert(found.end(), elements.begin(), elements.end());
+    };
+    if constexpr (sizeof...(Args) == kSize) {
+      auto it = by_value_.find(Key(v...));
+      if (it != by_value_.end()) add(it->second);
+    } else {
+      auto prefix = std::tie(v...);
+      auto end = by_value_.upper_bound(prefix);
+      for (auto it = by_value_.lower_bound(prefix); it != end; ++it) {
+        add(it->second);
+      }
+    }
+    return found;
+  }
+
+  // Fails if the index is unique and another element has the same key.
+  bool Add(const Contained& e) { return Add(Get(e), e); }
+  void Remove(const Contained& e) { Remove(Get(e), e); }
+
+  // Keeps the index up to date when the members of e change.
+  void Watch(const Contained& e) {
+    Watch(e, std::make_index_sequence<kSize>());
+  }
+
+ private:
+  using Elements = util::FlatSet<const Contained*>;
+  using Map =
+      std::conditional_t<kSize == 1, util::FlatMap<Key, Elements>,
+                         util::BTreeMap<Key, Elements, PrefixLess>>;
+
+  static Key Get(const Contained& e) {
+    return Key(*member<Contained, membs>().ConstGet(e)...);
+  }
+
+  // The key of e, with v as its I-th member.
+  template <size_t I, typename V>
+  static Key With(const Contained& e, const V& v) {
+    if constexpr (kSize == 1) {
+      return v;
+    } else {
+      Key key = Get(e);
+      std::get<I>(key) = v;
+      return key;
+    }
+  }
+
+  template <size_t... I>
+  void Watch(const Contained& e, std::index_sequence<I...>) {
+    (WatchMember<I, membs>(e), ...);
+  }
+
+  template <size_t I, template <typename> class memb>
+  void WatchMember(const Contained& e) {
+    using V = typename memb<Contained>::type_;
+    member<Contained, memb>().ConstGet(e).OnChange(
+        [this, &e](const V& o, const V& n) {
+          return Move(e, With<I>(e, o), With<I>(e, n));
+        },
+        [this, &e](const V& o, const V& n) {
+          Move(e, With<I>(e, n), With<I>(e, o));
+        });
+  }
+
+  bool Add(const Key& key, const Contained& e) {
+    auto& elements = by_value_[key];
+    if (kUnique && !elements.empty()) return false;
+    elements.emplace(&e);
+    return true;
+  }
+
+  bool Remove(const Key& key, const Contained& e) {
+    auto it = by_value_.find(key);
+    if (it == by_value_.end() || !it->second.erase(&e)) return false;
+    if (it->second.empty()) by_value_.erase(it);
+    return true;
+  }
+
+  // Does nothing if e is not in the index under from, which is the case for
+  // elements that were erased from the container, or if it was already moved.
+  bool Move(const Contained& e, const Key& from, const Key& to) {
+    auto it = by_value_.find(from);
+    if (it == by_value_.end() || !it->second.count(&e)) return true;
+    if (kUnique) {
+      auto taken = by_value_.find(to);
+      if (taken != by_value_.end() && !taken->second.count(&e)) return false;
+    }
+    Remove(from, e);
+    return Add(to, e);
+  }
+
+  Map by_value_;
+};
+
+template <typename Contained, typename I>
+struct IndexFor;
+
+template <typename Contained, template <typename> class... membs>
+struct IndexFor<Contained, Index<membs...>> {
+  using type = SecondaryIndex<Contained, false, membs...>;
+};
+
+template <typename Contained, template <typename> class... membs>
+struct IndexFor<Contained, UniqueIndex<membs...>> {
+  using type = SecondaryIndex<Contained, true, membs...>;
+};
+
+template <typename T, typename Tuple>
+struct TupleHas;
+
+template <typename T, typename... Ts>
+struct TupleHas<T, std::tuple<Ts...>>
+    : std::disjunction<std::is_same<T, Ts>...> {};
+
 template <typename Type>
 class ContainerEditor {
   using Key_t = typename Type::Key_t;
@@ -117,7 +291,11 @@ class ContainerEditor {
 
  public:
   ContainerEditor(Type* obj, bool autocommit)
-      : obj(obj), autocommit(autocommit) {}
+      : obj(obj), autocommit(autocommit) {
+    if (obj) obj->BuildIndexes();
+    if (obj) obj->open_editors_++;
+    if (obj) obj->Pin(true);
+  }
   ContainerEditor(ContainerEditor&& other) { *this = std::move(other); }
   ContainerEditor& operator=(ContainerEditor&& other) {
     if (this == &other) return *this;
@@ -139,17 +317,21 @@ class ContainerEditor {
     KJ_REQUIRE(!finalized);
     if (!editors.count(v)) {
       KJ_ASSERT(obj->values.count(v));
-      editors.emplace(v, obj->values.at(v)->Edit());
+      editors.emplace(
+          v, std::make_unique<detail::ValueEditor<Type, Contained>>(
+                 obj->Resident(v).Edit()));
     }
-    return editors.at(v);
+    return *editors.at(v);
   }
   detail::ValueEditor<Type, Contained>& Get(const KeyType& v) {
     KJ_REQUIRE(!finalized);
     if (!editors.count(v)) {
       KJ_ASSERT(obj->values.count(v));
-      editors.emplace(v, obj->values.at(v)->Edit());
+      editors.emplace(
+          v, std::make_unique<detail::ValueEditor<Type, Contained>>(
+                 obj->Resident(v).Edit()));
     }
-    return editors.at(v);
+    return *editors.at(v);
   }
   bool Count(const KeyType& v) const {
     KJ_REQUIRE(!finalized);
@@ -159,7 +341,7 @@ class ContainerEditor {
   }
   size_t Size() const {
     KJ_REQUIRE(!finalized);
-    return obj->size() + extra_values.size() - to_erase.size();
+    return obj->Size() + extra_values.size() - to_erase.size();
   }
 
   template <typename A>
@@ -173,6 +355,31 @@ class ContainerEditor {
     return extra_values.emplace(k, std::move(temp)).second;
   }
 
+  // Emplaces an element for each of the arguments of Emplace in range, which
+  // must have a size, or none of them if any of them cannot be emplaced.
+  // Elements emplaced together are inserted together by Commit.
+  template <typename Range>
+  bool EmplaceBulk(const Range& range) {
+    KJ_REQUIRE(!finalized);
+    for (const auto& arg : range) {
+      if (!Ptr::IsValidPre(obj, arg)) return false;
+    }
+    // Only reserved once the arguments are valid, so that rejected batches
+    // do not grow the pool.
+    obj->slab_.Reserve(std::size(range));
+    util::FlatMap<KeyType, typename Ptr::type> batch;
+    batch.reserve(std::size(range));
+    for (const auto& arg : range) {
+      auto temp = Ptr::New(obj, arg);
+      const KeyType& k = Key_t().ConstGet(*temp);
+      if (!Ptr::IsValidPost(obj, k) || Count(k)) return false;
+      if (!batch.emplace(k, std::move(temp)).second) return false;
+    }
+    extra_values.reserve(extra_values.size() + batch.size());
+    for (auto& [k, v] : batch) extra_values.emplace(k, std::move(v));
+    return true;
+  }
+
   bool Erase(const KeyType& k) {
     KJ_REQUIRE(!finalized);
     if (!Count(k)) return false;
@@ -190,7 +397,7 @@ class ContainerEditor {
     if (obj) {
       try {
         for (auto& [k, v] : editors) {
-          ret = v.Commit();
+          ret = v->Commit();
           if (!ret) break;
           committed_editors.emplace(k, std::move(v));
         }
@@ -204,14 +411,11 @@ class ContainerEditor {
             erased.emplace(e, std::move(tmp));
           }
         }
-        if (ret) {
-          for (auto& [k, v] : extra_values) {
-            ret = obj->Insert(k, std::move(v));
-            if (!ret) {
-              break;
-            }
-            inserted.emplace(k);
-          }
+        if (ret && !extra_values.empty()) {
+          typename Type::Batch batch;
+          batch.reserve(extra_values.size());
+          for (auto& [k, v] : extra_values) batch.emplace_back(k, std::move(v));
+          ret = obj->InsertBatch(batch, inserted);
         }
       } catch (...) {
         finalized = true;
@@ -224,10 +428,19 @@ class ContainerEditor {
     if (!ret) {
       rolled_back = true;
       UndoCommit();
+    } else if (obj && Changed()) {
+      obj->NotifyParent();
     }
     return ret;
   }
 
+  // Same as Commit, but resolves once the commit is on disk.
+  kj::Promise<bool> CommitAsync() {
+    bool committed = Commit();
+    return storage::WhenCommitted(
+        committed, obj ? obj->Storage() : storage::DefaultOptions());
+  }
+
   void Rollback() {
     KJ_REQUIRE(!rolled_back);
     rolled_back = true;
@@ -242,23 +455,29 @@ class ContainerEditor {
     if (obj) {
       try {
         for (auto& [k, v] : committed_editors) {
-          v.UndoCommit();
+          v->UndoCommit();
         }
         for (const auto& e : inserted) {
           KJ_ASSERT(!!obj->Erase(e));
         }
-        for (auto& [k, v] : erased) {
-          KJ_ASSERT(obj->Insert(k, std::move(v)));
-        }
+        for (auto& [k, v] : erased) obj->Restore(k, std::move(v));
       } catch (std::exception& e) {
         std::terminate();
       }
+      if (Changed()) obj->NotifyParent();
     }
   }
 
+  // Whether the last commit modified the set of keys.
+  bool Changed() const {
+    return !committed_editors.empty() || !inserted.empty() || !erased.empty();
+  }
+
   ~ContainerEditor() {
     if (!finalized && autocommit) Commit();
     if (obj) obj->is_edited = false;
+    if (obj) obj->open_editors_--;
+    if (obj) obj->Pin(false);
   }
 
  private:
@@ -266,12 +485,14 @@ class ContainerEditor {
   bool autocommit;
   bool finalized = false;
   bool rolled_back = false;
-  std::unordered_map<KeyType, typename Ptr::type> extra_values;
-  std::unordered_set<KeyType> to_erase;
-  std::unordered_set<KeyType> inserted;
-  std::unordered_map<KeyType, typename Ptr::type> erased;
-  std::unordered_map<KeyType, detail::ValueEditor<Type, Contained>> editors;
-  std::unordered_map<KeyType, detail::ValueEditor<Type, Contained>>
+  util::FlatMap<KeyType, typename Ptr::type> extra_values;
+  util::FlatSet<KeyType> to_erase;
+  util::FlatSet<KeyType> inserted;
+  util::FlatMap<KeyType, typename Ptr::type> erased;
+  // Boxed, as Get returns references to them.
+  util::FlatMap<KeyType, std::unique_ptr<detail::ValueEditor<Type, Contained>>>
+      editors;
+  util::FlatMap<KeyType, std::unique_ptr<detail::ValueEditor<Type, Contained>>>
       committed_editors;
 };
 
@@ -293,6 +514,10 @@ class BaseContainer : public Config<U, T, Key, Other...> {
   using ParentType = typename ContainerSetup::ParentType;
   using Key_t = typename ContainerSetup::Key_t;
   using KeyType = typename Key_t::inner_type;
+  using Values =
+      std::conditional_t<ContainerSetup::kOrdered,
+                         util::BTreeMap<KeyType, typename Ptr::type>,
+                         util::FlatMap<KeyType, typename Ptr::type>>;
 
   template <typename... Args>
   static auto Builder(Args... args) {
@@ -300,11 +525,14 @@ class BaseContainer : public Config<U, T, Key, Other...> {
   }
 
   const constexpr static bool SkipSerialize = false;
-  BaseContainer(kj::Maybe<kj::Own<const kj::Directory>>&& dir,
-                const char* field_name, ParentType* parent,
+  BaseContainer(util::Dir&& dir, const char* field_name, ParentType* parent,
                 placeholders::detail::_)
       : dir(util::SubDir(dir, field_name)), parent(parent) {}
 
+  ~BaseContainer() {
+    for (const auto& [element, frame] : frames_) pool_->Remove(frame);
+  }
+
   json Serialize() const {
     json j;
     // We only serialize the keys, as the values live in a sub-folder.
@@ -314,39 +542,208 @@ class BaseContainer : public Config<U, T, Key, Other...> {
     return j;
   }
 
+  // Gives a directory to a container created without one, and to the
+  // elements it already has.
+  void SetDir(util::Dir&& dir, const char* field_name) {
+    KJ_REQUIRE(!this->dir, "SetDir should only be called when dir is null");
+    this->dir = util::SubDir(dir, field_name);
+    if constexpr (ContainerSetup::kRequiresDir) {
+      for (auto& [k, v] : values) {
+        std::string name = KeyName(k);
+        v->SetDir(ElementParent(name), name.c_str());
+      }
+      CompactKeys();
+    }
+  }
+
+  void Serialize(JsonWriter& out) const {
+    if (values.empty()) return out.Null();
+    out.BeginArray();
+    for (const auto& v : values) {
+      ToJson<KeyType>()(v.first, out);
+    }
+    out.EndArray();
+  }
+
+  // Containers with a directory store their keys in their own index.
+  void Store(JsonWriter& out) const {
+    if constexpr (ContainerSetup::kRequiresDir) {
+      if (dir) {
+        out.Null();
+        return;
+      }
+    }
+    Serialize(out);
+  }
+
+  void SerializeBinary(std::string& out) const {
+    binary::PutVarint(out, values.size());
+    for (const auto& v : values) {
+      ToBinary<KeyType>()(v.first, out);
+    }
+  }
+
+  void StoreBinary(std::string& out) const {
+    if constexpr (ContainerSetup::kRequiresDir) {
+      if (dir) return;
+    }
+    SerializeBinary(out);
+  }
+
+  // Elements of containers with a directory are added to writer, and
+  // referred to by their index. Those of a LazyContainer are loaded from their
+  // own files, so only its keys are written, without loading the elements.
+  void BinarySnapshot(storage::BinarySnapshotWriter& writer,
+                      std::string& out) const {
+    if constexpr (ContainerSetup::kRequiresDir && !ContainerSetup::kLazy) {
+      binary::PutVarint(out, values.size());
+      std::string element;
+      for (const auto& [k, v] : values) {
+        ToBinary<KeyType>()(k, out);
+        element.clear();
+        v->BinarySnapshot(writer, element);
+        binary::PutVarint(out, writer.Add(element));
+      }
+    } else {
+      SerializeBinary(out);
+    }
+  }
+
   // Allow editing inner values without editing the whole container.
-  ContainedRef& Get(const KeyType& v) { return *values.at(v); }
-  const Contained& Get(const KeyType& v) const { return *values.at(v); }
+  ContainedRef& Get(const KeyType& v) {
+    BuildIndexes();
+    return Resident(v);
+  }
+  const Contained& Get(const KeyType& v) const { return Resident(v); }
+  // The keys of every container are always in memory, so lookups never load
+  // elements of a LazyContainer.
   bool Count(const KeyType& v) const { return values.count(v); }
   size_t Size() const { return values.size(); }
 
-  auto begin() const { return values.begin(); }
-  auto end() const { return values.end(); }
+  // Iterator that loads the elements of a LazyContainer as they are reached.
+  class LazyIterator {
+    using Base = typename Values::const_iterator;
+
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = typename Base::value_type;
+    using difference_type = typename Base::difference_type;
+    using pointer = const value_type*;
+    using reference = const value_type&;
+
+    LazyIterator(const BaseContainer* cnt, Base it) : cnt(cnt), it(it) {}
+    reference operator*() const {
+      cnt->Resident(it->first);
+      return *it;
+    }
+    pointer operator->() const { return &**this; }
+    LazyIterator& operator++() {
+      ++it;
+      return *this;
+    }
+    bool operator==(const LazyIterator& other) const { return it == other.it; }
+    bool operator!=(const LazyIterator& other) const { return it != other.it; }
+
+   private:
+    const BaseContainer* cnt;
+    Base it;
+  };
+
+  auto begin() const {
+    if constexpr (ContainerSetup::kLazy) {
+      return LazyIterator(this, values.begin());
+    } else {
+      return values.begin();
+    }
+  }
+  auto end() const {
+    if constexpr (ContainerSetup::kLazy) {
+      return LazyIterator(this, values.end());
+    } else {
+      return values.end();
+    }
+  }
+
+  // Queries by key order, only available in an OrderedContainer.
+  auto rbegin() const {
+    static_assert(ContainerSetup::kOrdered, "not an OrderedContainer");
+    return values.rbegin();
+  }
+  auto rend() const {
+    static_assert(ContainerSetup::kOrdered, "not an OrderedContainer");
+    return values.rend();
+  }
+  // The first element whose key is not less than k.
+  auto LowerBound(const KeyType& k) const {
+    static_assert(ContainerSetup::kOrdered, "not an OrderedContainer");
+    return values.lower_bound(k);
+  }
+  // The elements with keys in [lo, hi).
+  auto Range(const KeyType& lo, const KeyType& hi) const {
+    static_assert(ContainerSetup::kOrdered, "not an OrderedContainer");
+    auto end = values.lower_bound(hi);
+    return util::IteratorRange(lo < hi ? values.lower_bound(lo) : end, end);
+  }
+
+  // The elements whose members membs are v, or start with v, which must be
+  // declared as an Index or UniqueIndex of the container.
+  template <template <typename> class... membs, typename... Args>
+  std::vector<const Contained*> FindBy(const Args&... v) const {
+    BuildIndexes();
+    using Indexes = typename ContainerSetup::Indexes;
+    using Multi = detail::SecondaryIndex<Contained, false, membs...>;
+    using Unique = detail::SecondaryIndex<Contained, true, membs...>;
+    if constexpr (detail::TupleHas<Multi, Indexes>::value) {
+      return std::get<Multi>(indexes_).Find(v...);
+    } else {
+      return std::get<Unique>(indexes_).Find(v...);
+    }
+  }
+
+  // Number of elements currently in memory.
+  size_t ResidentSize() const {
+    if constexpr (ContainerSetup::kLazy) {
+      return lru_.size();
+    } else {
+      return values.size();
+    }
+  }
 
   const constexpr static bool kIsAlsoValue = true;
   const constexpr static bool kIsSubObject = true;
   using Editor = detail::ContainerEditor<typename ContainerSetup::Self>;
   friend Editor;
+  template <typename, typename>
+  friend class OwnerPtr;
+  template <typename, typename>
+  friend struct ConstrainedOwnerPtr;
 
-  BaseContainer(const util::JsonConstructorTag&,
-                kj::Maybe<kj::Own<const kj::Directory>> dir,
-                const char* field_name, ParentType* parent, const json& j)
+  BaseContainer(const util::JsonConstructorTag&, util::Dir dir,
+                const char* field_name, ParentType* parent, const json& j,
+                const storage::Options& = storage::DefaultOptions())
       : BaseContainer(std::move(dir), field_name, parent, placeholders::_) {
-    KJ_IF_MAYBE(d, this->dir) {
-      if constexpr (ContainerSetup::kRequiresDir) {
-        for (const auto& v : j) {
-          if constexpr (std::is_same_v<std::string, KeyType>) {
-            AddFromKey(*d, v.get<std::string>());
-          } else {
-            AddFromKey(*d, std::to_string(v.get<KeyType>()));
-          }
-        }
+    LoadKeys(j);
+  }
+
+  BaseContainer(const util::JsonTextConstructorTag&, util::Dir dir,
+                const char* field_name, ParentType* parent,
+                std::string_view text,
+                const storage::Options& = storage::DefaultOptions())
+      : BaseContainer(util::JsonConstructorTag(), std::move(dir), field_name,
+                      parent, KeysFromText(text)) {}
+
+  BaseContainer(const util::BinaryConstructorTag&, util::Dir dir,
+                const char* field_name, ParentType* parent,
+                std::string_view data,
+                const storage::Options& = storage::DefaultOptions())
+      : BaseContainer(std::move(dir), field_name, parent, placeholders::_) {
+    if constexpr (ContainerSetup::kRequiresDir) {
+      if (this->dir && Storage().binary_snapshot) {
+        LoadFromBinarySnapshot(data);
         return;
       }
     }
-    for (const auto& v : j) {
-      AddFromKeyWithoutDir(v.get<KeyType>());
-    }
+    LoadKeys(KeysFromBinary(data));
   }
 
   auto Edit(bool autocommit = false) {
@@ -355,17 +752,54 @@ class BaseContainer : public Config<U, T, Key, Other...> {
     return detail::ValueEditor<ParentType, BaseContainer>(this, autocommit);
   }
 
+  // Fills the container, which must be empty and not edited, with an element
+  // for each of the arguments of Emplace in range, in a single commit that
+  // cannot be rolled back. Elements are built on the load pool, if there is
+  // one, and their keys are written to the key index at once. Returns false,
+  // leaving the container empty, if any of them cannot be emplaced.
+  template <typename Range>
+  bool BulkLoad(const Range& range) {
+    static_assert(ContainerSetup::kRequiresDir,
+                  "the keys of a Subset are stored by its parent");
+    KJ_REQUIRE(values.empty() && !this->is_edited && !open_editors_);
+    std::vector<const std::decay_t<decltype(*std::begin(range))>*> args;
+    args.reserve(std::size(range));
+    for (const auto& arg : range) args.push_back(&arg);
+    Batch batch(args.size());
+    slab_.Reserve(args.size());
+    // Elements that cannot be emplaced are left null.
+    std::function<void(size_t)> build = [&](size_t i) {
+      if (!Ptr::IsValidPre(this, *args[i])) return;
+      auto temp = Ptr::New(this, *args[i]);
+      const KeyType& k = Key_t().ConstGet(*temp);
+      if (!Ptr::IsValidPost(this, k)) return;
+      batch[i] = {k, std::move(temp)};
+    };
+    if (const auto& pool = Storage().load_pool) {
+      pool->ParallelFor(args.size(), build);
+    } else {
+      for (size_t i = 0; i < args.size(); i++) build(i);
+    }
+    util::FlatSet<KeyType> keys;
+    keys.reserve(batch.size());
+    for (const auto& [k, v] : batch) {
+      if (!v || !keys.emplace(k).second) return false;
+    }
+    util::FlatSet<KeyType> inserted;
+    return InsertBatch(batch, inserted);
+  }
+
   void OnInsert(const std::function<bool(const Contained&)>& insert,
                 const std::function<void(const Contained&)>& undo_insert =
                     [](auto&) {}) const {
-    std::unordered_set<KeyType> done;
+    util::FlatSet<KeyType> done;
     bool failed = false;
     for (const auto& [k, v] : values) {
       try {
-        if (!insert(v)) {
+        if (!insert(Resident(k))) {
           try {
             for (const auto& k : done) {
-              undo_insert(values.at(k));
+              undo_insert(Resident(k));
             }
           } catch (...) {
             std::terminate();
@@ -375,7 +809,7 @@ class BaseContainer : public Config<U, T, Key, Other...> {
         }
       } catch (...) {
         for (const auto& k : done) {
-          undo_insert(values.at(k));
+          undo_insert(Resident(k));
         }
         throw;
       }
@@ -398,7 +832,7 @@ class BaseContainer : public Config<U, T, Key, Other...> {
     if (Size() != other.Size()) return false;
     for (const auto& [k, v] : other) {
       if (!Count(k)) return false;
-      if (*values.at(k) != *v) return false;
+      if (Resident(k) != *v) return false;
     }
     return true;
   }
@@ -406,6 +840,32 @@ class BaseContainer : public Config<U, T, Key, Other...> {
   ParentType* Parent() { return parent; }
   const ParentType* Parent() const { return parent; }
 
+  const storage::Options& Storage() const {
+    if (!parent) return storage::DefaultOptions();
+    return parent->Storage();
+  }
+
+  // Editors of the container pin the objects containing it.
+  void Pin(bool pin) const {
+    if (parent) parent->Pin(pin);
+  }
+
+  // Elements store themselves when they change.
+  template <typename Child>
+  void ChildChanged(const Child&) {}
+
+  storage::BufferPool::FrameId Frame() const {
+    if (!parent) return storage::BufferPool::kNoFrame;
+    return parent->FrameOf(*this);
+  }
+  storage::BufferPool::FrameId FrameOf(const Contained& element) const {
+    if constexpr (ContainerSetup::kLazy) {
+      auto it = frames_.find(&element);
+      if (it != frames_.end()) return it->second;
+    }
+    return Frame();
+  }
+
   template <typename GetObject, typename Fun>
   static void Visit(std::vector<std::string>& path, const GetObject& get_object,
                     const Fun& reg) {
@@ -447,25 +907,128 @@ class BaseContainer : public Config<U, T, Key, Other...> {
   }
 
  protected:
-  void AddFromKey(const kj::Directory* d, const std::string& s) {
+  typename Ptr::type LoadFromKey(const std::string& s) {
     if constexpr (!ContainerSetup::kRequiresDir) {
-      KJ_FAIL_ASSERT("AddFromKey called, but kRequiresDir is false!");
+      KJ_FAIL_ASSERT("LoadFromKey called, but kRequiresDir is false!");
     } else {
-      auto temp = Inner::Load(d->clone(), s.c_str(), this);
-      const KeyType& k = Key_t().ConstGet(*temp);
-      if constexpr (std::is_same_v<KeyType, std::string>) {
-        if (k != s) {
-          throw std::runtime_error("Invalid object: " + s);
+      auto temp = Inner::Load(ElementParent(s), s.c_str(), this,
+                              storage::DefaultOptions(), NewElement());
+      if (KeyName(Key_t().ConstGet(*temp)) != s) {
+        throw std::runtime_error("Invalid object: " + s);
+      }
+      return temp;
+    }
+  }
+
+  std::string SerializeText() const {
+    std::string out;
+    JsonWriter writer(out);
+    Serialize(writer);
+    return out;
+  }
+
+  static json KeysToJson(std::vector<KeyType>&& keys) {
+    json j = json::array();
+    for (auto& k : keys) j.push_back(std::move(k));
+    return j;
+  }
+
+  // Nothing is stored if the keys are in the key index.
+  static json KeysFromBinary(std::string_view data) {
+    if (data.empty()) return json();
+    return KeysToJson(binary::Decode<std::vector<KeyType>>(data));
+  }
+
+  static json KeysFromText(std::string_view text) {
+    return KeysToJson(ParseJson<std::vector<KeyType>>(text));
+  }
+
+  // Elements are loaded in any order, possibly in parallel, but inserted in
+  // key order.
+  template <typename F>
+  void LoadElements(size_t n, const F& load_one) {
+    std::vector<typename Ptr::type> loaded(n);
+    slab_.Reserve(n);
+    std::function<void(size_t)> load = [&](size_t i) {
+      loaded[i] = load_one(i);
+    };
+    if (const auto& pool = Storage().load_pool) {
+      pool->ParallelFor(n, load);
+    } else {
+      for (size_t i = 0; i < n; i++) load(i);
+    }
+    values.reserve(n);
+    for (auto& v : loaded) {
+      const KeyType& k = Key_t().ConstGet(*v);
+      WatchKey(*v);
+      values.emplace(k, std::move(v));
+    }
+  }
+
+  // j holds the keys, unless they are in the key index.
+  void LoadKeys(const json& j) {
+    if (this->dir) {
+      if constexpr (ContainerSetup::kRequiresDir) {
+        std::vector<json> keys;
+        bool has_index =
+            storage::ReadKeys(Storage(), this->dir, keys, key_log_records_);
+        if (!has_index) {
+          // Databases written before the key index keep the keys in the
+          // parent object.
+          keys.assign(j.begin(), j.end());
         }
-      } else {
-        if (std::to_string(k) != s) {
-          throw std::runtime_error("Invalid object: " + s);
+        if constexpr (ContainerSetup::kLazy) {
+          values.reserve(keys.size());
+          for (const auto& v : keys) {
+            values.emplace(v.get<KeyType>(), nullptr);
+          }
+        } else {
+          LoadElements(keys.size(), [&](size_t i) {
+            return LoadFromKey(KeyName(keys[i].get<KeyType>()));
+          });
         }
+        // Written once values holds the keys, which it is written from.
+        if (!has_index) CompactKeys();
+        return;
       }
-      this->values.emplace(k, std::move(temp));
+    }
+    for (const auto& v : j) {
+      AddFromKeyWithoutDir(v.get<KeyType>());
     }
   }
 
+  // See BinarySnapshot. The elements of a LazyContainer are left out of
+  // memory, and loaded from their own files when needed.
+  void LoadFromBinarySnapshot(std::string_view data) {
+    binary::Reader in(data);
+    size_t n = in.Varint();
+    if constexpr (ContainerSetup::kLazy) {
+      values.reserve(std::min(n, in.Remaining()));
+      for (size_t i = 0; i < n; i++) {
+        values.emplace(FromBinary<KeyType>()(in), nullptr);
+      }
+    } else {
+      const auto& snapshot = Storage().binary_snapshot;
+      std::vector<std::pair<KeyType, size_t>> elements;
+      elements.reserve(std::min(n, in.Remaining()));
+      for (size_t i = 0; i < n; i++) {
+        KeyType k = FromBinary<KeyType>()(in);
+        elements.emplace_back(std::move(k), in.Varint());
+      }
+      LoadElements(elements.size(), [&](size_t i) {
+        std::string s = KeyName(elements[i].first);
+        auto temp = NewElement()(util::BinaryConstructorTag(),
+                                 ElementParent(s), s.c_str(), this,
+                                 snapshot->Get(elements[i].second));
+        if (KeyName(Key_t().ConstGet(*temp)) != s) {
+          throw std::runtime_error("Invalid object: " + s);
+        }
+        return temp;
+      });
+    }
+    if (!in.Done()) throw std::runtime_error("Invalid binary data!");
+  }
+
   void AddFromKeyWithoutDir(const KeyType& s) {
     if constexpr (ContainerSetup::kRequiresDir) {
       throw std::runtime_error(
@@ -474,7 +1037,8 @@ class BaseContainer : public Config<U, T, Key, Other...> {
       if (!Ptr::IsValidPost(this, s))
         throw std::runtime_error("Invalid deserialized data!");
       auto temp = Ptr::New(this, s);
-      const auto& k = typename ContainerSetup::Key_t().ConstGet(*temp);
+      const KeyType& k =
+          typename ContainerSetup::Key_t().ConstGet(*temp);
       if (this->Count(k))
         throw std::runtime_error("Invalid deserialized data!");
       if (!this->values.emplace(k, std::move(temp)).second)
@@ -485,35 +1049,121 @@ class BaseContainer : public Config<U, T, Key, Other...> {
   bool Insert(const KeyType& k, typename Ptr::type&& v) {
     KJ_ASSERT(!!v);
     if (Count(k)) return false;
-    if constexpr (ContainerSetup::kRequiresDir) {
-      if constexpr (std::is_same_v<KeyType, std::string>) {
-        v->SetDir(util::CloneDir(dir), k.c_str());
-      } else {
-        v->SetDir(util::CloneDir(dir), std::to_string(k).c_str());
+    BuildIndexes();
+    // Elements rejected by a callback never reach the container.
+    if (!util::propagate_callback_safe(on_insert, on_undo_insert, *v)) {
+      return false;
+    }
+    Place(k, std::move(v));
+    LogKey(true, k);
+    return true;
+  }
+
+  using Batch = std::vector<std::pair<KeyType, typename Ptr::type>>;
+
+  // Inserts the elements of batch, whose keys must be distinct, as Insert
+  // does, but only adds them once the callbacks have accepted all of them,
+  // and logs their keys together. Returns false, without adding any, if one
+  // of them is rejected. The keys of the elements that were added are put in
+  // inserted, also if an exception is thrown.
+  bool InsertBatch(Batch& batch, util::FlatSet<KeyType>& inserted) {
+    for (const auto& [k, v] : batch) {
+      KJ_ASSERT(!!v);
+      if (Count(k)) return false;
+    }
+    BuildIndexes();
+    auto undo = [&](size_t from, size_t to) noexcept {
+      for (size_t i = from; i < to; i++) {
+        for (const auto& f : on_undo_insert) f(*batch[i].second);
       }
+    };
+    size_t accepted = 0;
+    try {
+      for (; accepted < batch.size(); accepted++) {
+        const auto& v = *batch[accepted].second;
+        if (!util::propagate_callback_safe(on_insert, on_undo_insert, v)) {
+          undo(0, accepted);
+          return false;
+        }
+      }
+    } catch (...) {
+      undo(0, accepted);
+      throw;
     }
-    KJ_ASSERT(values.emplace(k, std::move(v)).second);
-    Key_t()
-        .ConstGet(*values.at(k))
-        .OnChange(
-            [this](const auto& o, const auto& n) { return ChangeKey(o, n); },
-            [this](const auto& o, const auto& n) {
-              KJ_ASSERT(ChangeKey(n, o));
-            });
-    if (!util::propagate_callback_safe(on_insert, on_undo_insert,
-                                       *values.at(k)))
-      return false;
+    values.reserve(values.size() + batch.size());
+    size_t added = 0;
+    try {
+      for (; added < batch.size(); added++) {
+        Place(batch[added].first, std::move(batch[added].second));
+        inserted.insert(batch[added].first);
+      }
+    } catch (...) {
+      undo(added, batch.size());
+      throw;
+    }
+    LogKeys(batch);
     return true;
   }
 
+  // Adds an element that the insert callbacks accepted.
+  void Place(const KeyType& k, typename Ptr::type&& v) {
+    if constexpr (ContainerSetup::kRequiresDir) {
+      std::string name = KeyName(k);
+      v->SetDir(ElementParent(name), name.c_str());
+    }
+    if constexpr (ContainerSetup::kLazy) Evict();
+    KJ_ASSERT(values.emplace(k, std::move(v)).second);
+    if constexpr (ContainerSetup::kLazy) {
+      Touch(k);
+      Admit(k);
+    }
+    WatchKey(*values.at(k));
+  }
+
+  // Moves the element when its key changes. Elements that are loaded or
+  // reloaded from disk, which come without callbacks, are watched too.
+  void WatchKey(const Contained& element) const {
+    auto* self = const_cast<BaseContainer*>(this);
+    Key_t().ConstGet(element).OnChange(
+        [self](const auto& o, const auto& n) { return self->ChangeKey(o, n); },
+        [self](const auto& o, const auto& n) {
+          KJ_ASSERT(self->ChangeKey(n, o));
+        });
+  }
+
+  // Puts back an element returned by Erase, which still has its directory
+  // and the callbacks that the container and its indexes added to it.
+  void Restore(const KeyType& k, typename Ptr::type&& v) {
+    KJ_ASSERT(!!v && !Count(k));
+    for (const auto& f : on_undo_erase) f(*v);
+    if constexpr (ContainerSetup::kLazy) Evict();
+    KJ_ASSERT(values.emplace(k, std::move(v)).second);
+    if constexpr (ContainerSetup::kLazy) {
+      Touch(k);
+      Admit(k);
+    }
+    LogKey(true, k);
+  }
+
   typename Ptr::type Erase(const KeyType& v) {
     if (!Count(v)) return nullptr;
+    Resident(v);
     auto ret = std::move(values.at(v));
     values.erase(v);
     if (!util::propagate_callback_safe(on_erase, on_undo_erase, *ret)) {
       KJ_ASSERT(values.emplace(v, std::move(ret)).second);
       return nullptr;
     }
+    if constexpr (ContainerSetup::kLazy) {
+      lru_.erase(lru_pos_.at(v));
+      lru_pos_.erase(v);
+      auto frame = frames_.find(ret.get());
+      if (frame != frames_.end()) {
+        pool_->Remove(frame->second);
+        frames_.erase(frame);
+      }
+    }
+    LogKey(false, v);
     return ret;
   }
 
@@ -526,12 +1176,238 @@ class BaseContainer : public Config<U, T, Key, Other...> {
     auto node = values.extract(o);
     node.key() = n;
     KJ_ASSERT(values.insert(std::move(node)).inserted);
+    if constexpr (ContainerSetup::kLazy) {
+      auto pos = lru_pos_.extract(o);
+      *pos.mapped() = n;
+      pos.key() = n;
+      lru_pos_.insert(std::move(pos));
+    }
+    LogKey(false, o);
+    LogKey(true, n);
     return true;
   }
 
+  static std::string KeyName(const KeyType& k) {
+    if constexpr (std::is_same_v<KeyType, std::string>) {
+      return k;
+    } else {
+      return std::to_string(k);
+    }
+  }
+
+  // Directory that holds the directory of the element named name.
+  util::Dir ElementParent(const std::string& name) const {
+    return storage::ElementParent(dir, Storage().layout, name);
+  }
+
+  // Records an insertion or removal in the key index. The index is compacted
+  // once its log is longer than the number of keys plus the checkpoint
+  // interval, which keeps the amortized cost of each change constant.
+  void LogKey(bool insert, const KeyType& k) {
+    if constexpr (ContainerSetup::kRequiresDir) {
+      if (dir) {
+        const storage::Options& options = Storage();
+        if (key_log_records_ >= values.size() + options.checkpoint_interval) {
+          CompactKeys();
+          return;
+        }
+        storage::Append(options, this, dir, storage::kKeyFiles,
+                        storage::KeyRecord(insert, k), !key_index_written_);
+        key_index_written_ = true;
+        key_log_records_++;
+      }
+    }
+  }
+
+  // Logs the insertion of the keys of batch, which are already in values.
+  // The index is rewritten once instead if the batch at least doubled the
+  // container.
+  void LogKeys(const Batch& batch) {
+    if constexpr (ContainerSetup::kRequiresDir) {
+      if (dir && batch.size() > 1 && 2 * batch.size() >= values.size()) {
+        CompactKeys();
+        return;
+      }
+    }
+    for (const auto& [k, v] : batch) LogKey(true, k);
+  }
+
+  // Constructs elements in slab_, from the arguments of a constructor of
+  // Inner.
+  auto NewElement() const {
+    return [this](auto&&... args) {
+      return slab_.New(std::forward<decltype(args)>(args)...);
+    };
+  }
+
+  // Returns the element with key k, loading it if it is not in memory.
+  auto& Resident(const KeyType& k) const {
+    auto& ptr = values.at(k);
+    if constexpr (ContainerSetup::kLazy) {
+      if (!ptr) {
+        Evict();
+        // Pending writes must reach the files before they are read back.
+        storage::Flush(Storage());
+        KJ_REQUIRE(bool(dir), "LazyContainer without a directory");
+        std::string name = KeyName(k);
+        ptr = Inner::Load(ElementParent(name), name.c_str(),
+                          const_cast<BaseContainer*>(this),
+                          storage::DefaultOptions(), NewElement());
+        WatchKey(*ptr);
+        Touch(k);
+        Admit(k);
+      } else {
+        Touch(k);
+      }
+    }
+    return *ptr;
+  }
+
+  void Touch(const KeyType& k) const {
+    auto it = lru_pos_.find(k);
+    if (it != lru_pos_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+    } else {
+      lru_.push_front(k);
+      lru_pos_.emplace(k, lru_.begin());
+    }
+    if (pool_) {
+      auto frame = frames_.find(values.at(k).get());
+      if (frame != frames_.end()) pool_->Touch(frame->second);
+    }
+  }
+
+  // Drops the least recently used elements until there is room for one more.
+  // Elements can only be dropped while neither the container nor they have an
+  // open editor, as editors keep pointers to them. Every committed change is
+  // already on disk.
+  void Evict() const {
+    size_t limit = Storage().resident_limit;
+    if (limit == 0 || open_editors_) return;
+    std::vector<KeyType> victims;
+    for (auto it = lru_.rbegin();
+         it != lru_.rend() && lru_.size() - victims.size() >= limit; ++it) {
+      if (!values.at(*it)->Pinned()) victims.push_back(*it);
+    }
+    for (const auto& k : victims) {
+      auto frame = Unload(k);
+      if (frame != storage::BufferPool::kNoFrame) pool_->Remove(frame);
+    }
+  }
+
+  // Gives element k a frame in the buffer pool, if there is one, and drops
+  // other elements to make room for it. Its size is estimated from its binary
+  // encoding; the elements of containers within it have their own frames.
+  void Admit(const KeyType& k) const {
+    const auto& pool = Storage().buffer_pool;
+    if (!pool) return;
+    KJ_REQUIRE(!pool_ || pool_ == pool, "the buffer pool cannot be changed");
+    pool_ = pool;
+    const Contained* element = values.at(k).get();
+    std::string encoded;
+    element->SerializeBinary(encoded);
+    auto frame = pool->Add(sizeof(Inner) + encoded.size(), Frame(),
+                           [this, element]() { return Drop(element); });
+    frames_.emplace(element, frame);
+    pool->Reclaim(frame);
+  }
+
+  // Called by the buffer pool, which removes the frame itself. The pool is
+  // shared by all the LazyContainers of the database, so this is also called
+  // while another container admits an element; the element then leaves the
+  // bookkeeping of this container as if it was evicted by it.
+  bool Drop(const Contained* element) const {
+    if (open_editors_ || element->Pinned()) return false;
+    KJ_ASSERT(frames_.count(element), "frame of another container");
+    const KeyType& k = Key_t().ConstGet(*element);
+    Unload(k);
+    return true;
+  }
+
+  // Returns the frame of the element, if it had one.
+  storage::BufferPool::FrameId Unload(KeyType k) const {
+    auto frame = storage::BufferPool::kNoFrame;
+    auto it = frames_.find(values.at(k).get());
+    if (it != frames_.end()) {
+      frame = it->second;
+      frames_.erase(it);
+    }
+    lru_.erase(lru_pos_.at(k));
+    lru_pos_.erase(k);
+    values.at(k) = nullptr;
+    return frame;
+  }
+
+  // Indexes follow the elements that are inserted or erased through the
+  // callbacks of the container, and changes to their members through those
+  // of the members. They are built before the first lookup or change, so that
+  // unique indexes see every change.
+  void BuildIndexes() const {
+    if (indexed_) return;
+    indexed_ = true;
+    std::apply(
+        [this](auto&... index) {
+          (OnInsert(
+               [&index](const Contained& e) {
+                 if (!index.Add(e)) return false;
+                 index.Watch(e);
+                 return true;
+               },
+               [&index](const Contained& e) { index.Remove(e); }),
+           ...);
+          (OnErase(
+               [&index](const Contained& e) {
+                 index.Remove(e);
+                 return true;
+               },
+               [&index](const Contained& e) { index.Add(e); }),
+           ...);
+        },
+        indexes_);
+  }
+
+  // Containers with a directory store their keys by themselves, the others
+  // are stored by their parent.
+  void NotifyParent() {
+    if constexpr (ContainerSetup::kRequiresDir) {
+      if (dir) return;
+    }
+    if (parent) parent->ChildChanged(*this);
+  }
+
+  void CompactKeys() {
+    if (dir) {
+      storage::Snapshot(Storage(), this, dir, storage::kKeyFiles,
+                        SerializeText(), !key_index_written_);
+      key_index_written_ = true;
+      key_log_records_ = 0;
+    }
+  }
+
   bool is_edited = false;
-  std::unordered_map<KeyType, typename Ptr::type> values;
-  kj::Maybe<kj::Own<const kj::Directory>> dir;
+  size_t open_editors_ = 0;
+  // Mutable as elements of a LazyContainer are loaded on first access, which
+  // is logically const.
+  // Elements are allocated in slabs, so that their address does not change
+  // when the table grows, and the slots of erased elements are reused. The
+  // slabs must outlive the elements.
+  mutable util::SlabPool<Inner> slab_;
+  mutable Values values;
+  // Keys of the elements of a LazyContainer that are in memory, most recently
+  // used first.
+  mutable std::list<KeyType> lru_;
+  mutable util::FlatMap<KeyType, typename std::list<KeyType>::iterator>
+      lru_pos_;
+  // Frames of the elements of a LazyContainer in the buffer pool, if the
+  // database has one.
+  mutable std::shared_ptr<storage::BufferPool> pool_;
+  mutable util::FlatMap<const Contained*, storage::BufferPool::FrameId>
+      frames_;
+  mutable typename ContainerSetup::Indexes indexes_;
+  mutable bool indexed_ = false;
+  util::Dir dir;
+  size_t key_log_records_ = 0;
+  bool key_index_written_ = false;
   ParentType* parent;
   mutable std::vector<std::function<bool(const Contained&)>> on_erase;
   mutable std::vector<std::function<void(const Contained&)>> on_undo_erase;
@@ -550,6 +1426,8 @@ struct RefPtr {
     static bool IsValidPost(U* obj, const KeyType& t) { return true; }
     static auto New(U* obj, const KeyType& t) {
       auto& cnt = typename ContainerGetter::template Impl<U>()(*obj);
+      static_assert(!std::decay_t<decltype(cnt)>::kLazy,
+                    "Subsets of a LazyContainer are not supported");
       // TODO(veluca): add some more checks (such as that keytype is the same as
       // the returned container's key type, and/or that they look at the same
       // member), if that does not result in cycles.
@@ -574,9 +1452,9 @@ struct ConstrainedOwnerPtr {
     }
     template <typename... Args>
     static auto New(U* obj, Args... args) {
-      return std::make_unique<T>(nullptr, nullptr, obj, std::move(args)...);
+      return obj->slab_.New(nullptr, nullptr, obj, std::move(args)...);
     }
-    using type = std::unique_ptr<T>;
+    using type = typename util::SlabPool<T>::Ptr;
   };
 };
 
@@ -616,9 +1494,17 @@ class ContainerGetter<> {
 
 namespace detail {
 template <typename U, template <typename> class T,
-          template <typename> class Key>
+          template <typename> class Key, typename... Indexes>
 class BaseContainerSetup;
 
+template <typename U, template <typename> class T,
+          template <typename> class Key>
+class BaseLazyContainerSetup;
+
+template <typename U, template <typename> class T,
+          template <typename> class Key, typename... Indexes>
+class BaseOrderedContainerSetup;
+
 template <typename U, template <typename> class T,
           template <typename> class Key, typename ContainerGetter>
 class BaseSubsetSetup;
@@ -634,9 +1520,33 @@ template <typename U, template <typename> class T,
 using Subset =
     detail::BaseContainer<detail::BaseSubsetSetup, U, T, Key, ContainerGetter>;
 
+// Indexes are Index<memb> declarations.
+template <typename U, template <typename> class T,
+          template <typename> class Key, typename... Indexes>
+using Container =
+    detail::BaseContainer<detail::BaseContainerSetup, U, T, Key, Indexes...>;
+
+// A Container that only loads its keys, and loads each element on first
+// access. At most storage::Options::resident_limit elements are kept in
+// memory, and the elements of all LazyContainers fit in
+// storage::Options::buffer_pool; references to elements may be invalidated by
+// accessing other elements, unless the container or the element is being
+// edited. Dropping an element also drops the callbacks that were added to it
+// and to its members, so they must be added again after each access; those
+// of the container itself are. Subsets of a LazyContainer are not supported.
 template <typename U, template <typename> class T,
           template <typename> class Key>
-using Container = detail::BaseContainer<detail::BaseContainerSetup, U, T, Key>;
+using LazyContainer =
+    detail::BaseContainer<detail::BaseLazyContainerSetup, U, T, Key>;
+
+// A Container whose elements are kept sorted by key, in a B+ tree, which can
+// be iterated in reverse and queried for ranges of keys. Keys must be ordered
+// by operator<, and hashable, as editors hash them.
+template <typename U, template <typename> class T,
+          template <typename> class Key, typename... Indexes>
+using OrderedContainer =
+    detail::BaseContainer<detail::BaseOrderedContainerSetup, U, T, Key,
+                          Indexes...>;
 
 template <typename U, template <typename> class T,
           template <typename> class Key, typename ContainerGetter>
@@ -645,17 +1555,56 @@ using ConstrainedSet = detail::BaseContainer<detail::BaseConstrainedSetSetup, U,
 
 namespace detail {
 template <typename U, template <typename> class T,
-          template <typename> class Key>
+          template <typename> class Key, typename... Indexes_>
 class BaseContainerSetup {
  public:
-  using Self = Container<U, T, Key>;
+  using Self = Container<U, T, Key, Indexes_...>;
+  using Contained = T<Self>;
+  using ContainedRef = T<Self>&;
+  using Inner = ::db::Value<Self, Contained>;
+  using Key_t = Key<Contained>;
+  using ParentType = U;
+  using Ptr = OwnerPtr<Self, Inner>;
+  using Indexes =
+      std::tuple<typename IndexFor<Contained, Indexes_>::type...>;
+  static const constexpr bool kRequiresDir = true;
+  static const constexpr bool kLazy = false;
+  static const constexpr bool kOrdered = false;
+};
+
+template <typename U, template <typename> class T,
+          template <typename> class Key>
+class BaseLazyContainerSetup {
+ public:
+  using Self = LazyContainer<U, T, Key>;
+  using Contained = T<Self>;
+  using ContainedRef = T<Self>&;
+  using Inner = ::db::Value<Self, Contained>;
+  using Key_t = Key<Contained>;
+  using ParentType = U;
+  using Ptr = OwnerPtr<Self, Inner>;
+  using Indexes = std::tuple<>;
+  static const constexpr bool kRequiresDir = true;
+  static const constexpr bool kLazy = true;
+  static const constexpr bool kOrdered = false;
+};
+
+template <typename U, template <typename> class T,
+          template <typename> class Key, typename... Indexes_>
+class BaseOrderedContainerSetup {
+ public:
+  using Self = OrderedContainer<U, T, Key, Indexes_...>;
   using Contained = T<Self>;
   using ContainedRef = T<Self>&;
   using Inner = ::db::Value<Self, Contained>;
   using Key_t = Key<Contained>;
   using ParentType = U;
   using Ptr = OwnerPtr<Self, Inner>;
+  using Indexes =
+      std::tuple<typename IndexFor<Contained, Indexes_>::type...>;
   static const constexpr bool kRequiresDir = true;
+  static const constexpr bool kLazy = false;
+  static const constexpr bool kOrdered = true;
 };
 
 template <typename U, template <typename> class T,
@@ -671,7 +1620,10 @@ class BaseSubsetSetup {
   using ParentType = U;
   using Ptr = typename detail::RefPtr<KeyType, ContainerGetter>::template Impl<
       Subset<U, T, Key, ContainerGetter>, Inner>;
+  using Indexes = std::tuple<>;
   static const constexpr bool kRequiresDir = false;
+  static const constexpr bool kLazy = false;
+  static const constexpr bool kOrdered = false;
 };
 
 template <typename U, template <typename> class T,
@@ -690,7 +1642,10 @@ class BaseConstrainedSetSetup {
       KeyType, ContainerGetter>::template Impl<Self, Inner>;
   using OtherContainer = typename ContainerGetter::template Impl<Self>::type;
   using SiblingType = typename OtherContainer::Contained;
+  using Indexes = std::tuple<>;
   static const constexpr bool kRequiresDir = true;
+  static const constexpr bool kLazy = false;
+  static const constexpr bool kOrdered = false;
   const typename OtherContainer::Contained& Sibling(const KeyType& v) const {
     return typename ContainerGetter::template Impl<Self>()(
                static_cast<const Self&>(*this))
@@ -1,4 +1,6 @@
 #include "db/container.hpp"
+#include <map>
+#include <random>
 #include <unordered_map>
 #include "db/serializable.hpp"
 #include "gmock/gmock.h"
@@ -44,6 +46,58 @@ TEST(Container, TestInnerEdit) {
   EXPECT_THAT(*inf.cont.Get(3).test2, Eq(6));
 };
 
+TEST(Container, TestFlatMap) {
+  util::FlatMap<std::string, int> map;
+  for (int i = 0; i < 100; i++) {
+    EXPECT_TRUE(map.emplace(std::to_string(i), i).second);
+  }
+  EXPECT_FALSE(map.emplace("7", 0).second);
+  for (int i = 0; i < 100; i += 2) {
+    EXPECT_THAT(map.erase(std::to_string(i)), Eq(1));
+  }
+  EXPECT_THAT(map.size(), Eq(50));
+  EXPECT_THAT(map.at(std::string_view("7")), Eq(7));
+  EXPECT_FALSE(map.count(std::string_view("8")));
+  auto node = map.extract("7");
+  node.key() = "seven";
+  EXPECT_TRUE(map.insert(std::move(node)).inserted);
+  EXPECT_THAT(map.at("seven"), Eq(7));
+  int sum = 0;
+  for (const auto& [k, v] : map) sum += v;
+  EXPECT_THAT(sum, Eq(2500));
+
+  // References to editors stay valid as more of them are opened.
+  using db::placeholders::_;
+  Info inf(Info::Builder(_));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 100; i++) edit.cont.Emplace(Info::cont_t::Builder(i, i));
+  EXPECT_TRUE(edit.Commit());
+  auto edit2 = inf.Edit();
+  auto& first = edit2.cont.Get(0);
+  for (int i = 1; i < 100; i++) *edit2.cont.Get(i).test2 = 0;
+  *first.test2 = 1;
+  EXPECT_TRUE(edit2.Commit());
+  EXPECT_THAT(*inf.cont.Get(0).test2, Eq(1));
+  EXPECT_THAT(*inf.cont.Get(99).test2, Eq(0));
+};
+
+TEST(Container, TestSlabPool) {
+  util::SlabPool<std::string> pool;
+  std::vector<util::SlabPool<std::string>::Ptr> strings;
+  for (int i = 0; i < 100; i++) {
+    strings.push_back(pool.New(std::to_string(i)));
+  }
+  EXPECT_THAT(pool.Size(), Eq(100));
+  size_t capacity = pool.Capacity();
+  strings.erase(strings.begin(), strings.begin() + 50);
+  EXPECT_THAT(pool.Size(), Eq(50));
+  // Freed slots are reused before new slabs are allocated.
+  for (int i = 0; i < 50; i++) strings.push_back(pool.New("x"));
+  EXPECT_THAT(pool.Capacity(), Eq(capacity));
+  EXPECT_THAT(*strings[0], Eq("50"));
+  EXPECT_THAT(*strings[50], Eq("x"));
+};
+
 TEST(Container, TestDeserialize) {
   auto dir = kj::newInMemoryDirectory(kj::nullClock());
   auto cont = dir->openSubdir(kj::Path("cont"), kj::WriteMode::CREATE);
@@ -64,6 +118,36 @@ TEST(Container, TestDeserialize) {
   EXPECT_THAT(*inf->cont.Get(2).test2, Eq(8));
 };
 
+// Databases written before the key index get one on their first load.
+TEST(Container, TestLoadWithoutKeyIndex) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  auto root = dir->replaceFile(kj::Path("data.json"), kj::WriteMode::CREATE);
+  root->get().writeAll(R"({"cont": [1]})");
+  root->commit();
+  auto e = dir->openSubdir(
+      kj::Path{"cont", "1"},
+      kj::WriteMode::CREATE | kj::WriteMode::CREATE_PARENT);
+  auto ef = e->replaceFile(kj::Path("data.json"), kj::WriteMode::CREATE);
+  ef->get().writeAll(R"({"test": 1, "test2": 7})");
+  ef->commit();
+  auto inf = Info::Load(dir->clone(), "", nullptr);
+  EXPECT_THAT(inf->cont.Size(), Eq(1));
+  EXPECT_TRUE(dir->exists(kj::Path{"cont", "keys.json"}));
+  auto inf2 = Info::Load(dir->clone(), "", nullptr);
+  EXPECT_THAT(inf2->cont.Size(), Eq(1));
+  EXPECT_THAT(*inf2->cont.Get(1).test2, Eq(7));
+};
+
+// Loading a missing element fails without creating its directory.
+TEST(Container, TestLoadMissingElement) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  auto root = dir->replaceFile(kj::Path("data.json"), kj::WriteMode::CREATE);
+  root->get().writeAll(R"({"cont": [1]})");
+  root->commit();
+  EXPECT_ANY_THROW(Info::Load(dir->clone(), "", nullptr));
+  EXPECT_FALSE(dir->exists(kj::Path{"cont", "1"}));
+};
+
 TEST(Container, TestRoundTrip) {
   auto dir = kj::newInMemoryDirectory(kj::nullClock());
   using db::placeholders::_;
@@ -79,6 +163,892 @@ TEST(Container, TestRoundTrip) {
   EXPECT_TRUE(inf == *inf2);
 };
 
+TEST(Container, TestKeyIndex) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  Info inf(Info::Builder(_).SetDir(dir->clone()));
+  for (int i = 0; i < 3; i++) {
+    auto edit = inf.Edit();
+    edit.cont.Emplace(Info::cont_t::Builder(i, 5));
+    EXPECT_TRUE(edit.Commit());
+  }
+  auto edit = inf.Edit();
+  EXPECT_TRUE(edit.cont.Erase(1));
+  EXPECT_TRUE(edit.Commit());
+  EXPECT_TRUE(dir->exists(kj::Path{"cont", "keys.jsonl"}));
+  auto inf2 = Info::Load(dir->clone(), "", nullptr);
+  EXPECT_THAT(inf2->cont.Size(), Eq(2));
+  EXPECT_FALSE(inf2->cont.Count(1));
+  EXPECT_TRUE(inf == *inf2);
+};
+
+TEST(Container, TestKeyIndexCompaction) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  storage::Options options;
+  options.checkpoint_interval = 2;
+  Info inf(Info::Builder(_).SetDir(dir->clone()).SetStorage(options));
+  for (int i = 0; i < 3; i++) {
+    auto edit = inf.Edit();
+    edit.cont.Emplace(Info::cont_t::Builder(i, 5));
+    EXPECT_TRUE(edit.Commit());
+  }
+  EXPECT_FALSE(dir->exists(kj::Path{"cont", "keys.json"}));
+  for (int i = 0; i < 3; i++) {
+    auto edit = inf.Edit();
+    EXPECT_TRUE(edit.cont.Erase(0));
+    EXPECT_TRUE(edit.Commit());
+    auto edit2 = inf.Edit();
+    edit2.cont.Emplace(Info::cont_t::Builder(0, i));
+    EXPECT_TRUE(edit2.Commit());
+  }
+  EXPECT_TRUE(dir->exists(kj::Path{"cont", "keys.json"}));
+  auto inf2 = Info::Load(dir->clone(), "", nullptr);
+  EXPECT_THAT(inf2->cont.Size(), Eq(3));
+  EXPECT_TRUE(inf == *inf2);
+};
+
+TEST(Container, TestEmplaceBulk) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  Info inf(Info::Builder(_).SetDir(dir->clone()));
+  std::vector<decltype(Info::cont_t::Builder(0, 0))> builders;
+  for (int i = 0; i < 100; i++) builders.push_back(Info::cont_t::Builder(i, i));
+  auto edit = inf.Edit();
+  EXPECT_TRUE(edit.cont.EmplaceBulk(builders));
+  // Nothing is emplaced if any element is a duplicate.
+  builders[0] = Info::cont_t::Builder(200, 0);
+  EXPECT_FALSE(edit.cont.EmplaceBulk(builders));
+  EXPECT_THAT(edit.cont.Size(), Eq(100));
+  EXPECT_TRUE(edit.Commit());
+  EXPECT_THAT(inf.cont.Size(), Eq(100));
+  EXPECT_THAT(*inf.cont.Get(42).test2, Eq(42));
+  // The key index is rewritten once rather than logging every key.
+  EXPECT_TRUE(dir->exists(kj::Path{"cont", "keys.json"}));
+  auto inf2 = Info::Load(dir->clone(), "", nullptr);
+  EXPECT_TRUE(inf == *inf2);
+
+  edit.Rollback();
+  EXPECT_THAT(inf.cont.Size(), Eq(0));
+};
+
+TEST(Container, TestBulkLoad) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  storage::Options options;
+  options.load_pool = std::make_shared<util::ThreadPool>(4);
+  Info inf(Info::Builder(_).SetDir(dir->clone()).SetStorage(options));
+  std::vector<decltype(Info::cont_t::Builder(0, 0))> builders;
+  for (int i = 0; i < 1000; i++) {
+    builders.push_back(Info::cont_t::Builder(i, i % 7));
+  }
+  builders.push_back(Info::cont_t::Builder(5, 0));
+  EXPECT_FALSE(inf.cont.BulkLoad(builders));
+  EXPECT_THAT(inf.cont.Size(), Eq(0));
+  builders.pop_back();
+  EXPECT_TRUE(inf.cont.BulkLoad(builders));
+  EXPECT_THAT(inf.cont.Size(), Eq(1000));
+  auto inf2 = Info::Load(dir->clone(), "", nullptr);
+  EXPECT_THAT(inf2->cont.Size(), Eq(1000));
+  EXPECT_TRUE(inf == *inf2);
+};
+
+TEST(Container, TestDirPool) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  util::Dir root(dir->clone(), /*capacity=*/2);
+  Info inf(Info::Builder(_).SetDir(root));
+  for (int i = 0; i < 10; i++) {
+    auto edit = inf.Edit();
+    edit.cont.Emplace(Info::cont_t::Builder(i, 5));
+    EXPECT_TRUE(edit.Commit());
+  }
+  EXPECT_THAT(root.Pool()->OpenCount(), Eq(2));
+  EXPECT_TRUE(dir->exists(kj::Path{"cont", "7", "data.json"}));
+  auto inf2 = Info::Load(util::Dir(dir->clone(), 2), "", nullptr);
+  EXPECT_TRUE(inf == *inf2);
+};
+
+// Enough keys for inner nodes to split, and erases that borrow from and
+// merge nodes until the tree is empty.
+TEST(Container, TestBTreeMap) {
+  util::BTreeMap<int, int> map;
+  std::map<int, int> expected;
+  std::mt19937 rng(42);
+  auto check = [&]() {
+    ASSERT_THAT(map.size(), Eq(expected.size()));
+    EXPECT_TRUE(std::equal(map.begin(), map.end(), expected.begin(),
+                           expected.end()));
+    EXPECT_TRUE(std::equal(map.rbegin(), map.rend(), expected.rbegin(),
+                           expected.rend()));
+    for (int i = 0; i < 100; i++) {
+      int k = rng() % 20010 - 5;
+      auto lower = map.lower_bound(k);
+      auto expected_lower = expected.lower_bound(k);
+      if (expected_lower == expected.end()) {
+        EXPECT_TRUE(lower == map.end());
+      } else {
+        ASSERT_TRUE(lower != map.end());
+        EXPECT_THAT(lower->first, Eq(expected_lower->first));
+      }
+      auto upper = map.upper_bound(k);
+      auto expected_upper = expected.upper_bound(k);
+      if (expected_upper == expected.end()) {
+        EXPECT_TRUE(upper == map.end());
+      } else {
+        ASSERT_TRUE(upper != map.end());
+        EXPECT_THAT(upper->first, Eq(expected_upper->first));
+      }
+      EXPECT_THAT(map.count(k), Eq(expected.count(k)));
+    }
+  };
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < 5000; i++) {
+      int k = rng() % 20000;
+      EXPECT_THAT(map.emplace(k, i).second, Eq(expected.emplace(k, i).second));
+      if (i % 3 == 0) {
+        int e = rng() % 20000;
+        EXPECT_THAT(map.erase(e), Eq(expected.erase(e)));
+      }
+    }
+    check();
+    // Drain the tree, alternating between both ends and the middle.
+    while (!expected.empty()) {
+      auto it = expected.begin();
+      switch (expected.size() % 3) {
+        case 0:
+          it = std::prev(expected.end());
+          break;
+        case 1:
+          it = std::next(it, expected.size() / 2);
+          break;
+      }
+      EXPECT_THAT(map.erase(it->first), Eq(1));
+      expected.erase(it);
+      if (expected.size() % 997 == 0) check();
+    }
+    check();
+  }
+};
+
+DECLARE_MEMBER((OrderedContainer<T, Foo, Key>), ordered);
+
+using InfoOrdered = MainData<ordered_m>;
+
+TEST(Container, TestOrdered) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  InfoOrdered inf(InfoOrdered::Builder(_).SetDir(dir->clone()));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 100; i++) {
+    edit.ordered.Emplace(InfoOrdered::ordered_t::Builder(i * 37 % 100, i));
+  }
+  EXPECT_TRUE(edit.Commit());
+  int expected = 0;
+  for (const auto& [k, v] : inf.ordered) EXPECT_THAT(k, Eq(expected++));
+  EXPECT_THAT(expected, Eq(100));
+  EXPECT_THAT(inf.ordered.LowerBound(50)->first, Eq(50));
+  int sum = 0;
+  for (const auto& [k, v] : inf.ordered.Range(10, 20)) sum += k;
+  EXPECT_THAT(sum, Eq(145));
+  EXPECT_TRUE(inf.ordered.Range(20, 10).empty());
+  EXPECT_THAT(inf.ordered.rbegin()->first, Eq(99));
+
+  auto edit2 = inf.Edit();
+  EXPECT_TRUE(edit2.ordered.Erase(99));
+  EXPECT_TRUE(edit2.Commit());
+  EXPECT_THAT(inf.ordered.rbegin()->first, Eq(98));
+  auto inf2 = InfoOrdered::Load(dir->clone(), "", nullptr);
+  EXPECT_TRUE(inf == *inf2);
+  EXPECT_THAT(inf2->ordered.Size(), Eq(99));
+
+  // Changing a key moves the element.
+  auto edit3 = inf.Edit();
+  *edit3.ordered.Get(0).test = 1000;
+  EXPECT_TRUE(edit3.Commit());
+  EXPECT_THAT(inf.ordered.begin()->first, Eq(1));
+  EXPECT_THAT(inf.ordered.rbegin()->first, Eq(1000));
+  EXPECT_THAT(*inf.ordered.rbegin()->second->test2, Eq(0));
+};
+
+DECLARE_MEMBER((Container<T, Foo, Key, Index<test2_m>>), indexed);
+
+using InfoIndexed = MainData<indexed_m>;
+
+TEST(Container, TestIndex) {
+  using db::placeholders::_;
+  InfoIndexed inf(InfoIndexed::Builder(_));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 10; i++) {
+    edit.indexed.Emplace(InfoIndexed::indexed_t::Builder(i, i % 3));
+  }
+  EXPECT_TRUE(edit.Commit());
+  EXPECT_THAT(inf.indexed.FindBy<test2_m>(0).size(), Eq(4));
+  for (const auto* e : inf.indexed.FindBy<test2_m>(1)) {
+    EXPECT_THAT(*e->test % 3, Eq(1));
+  }
+  EXPECT_TRUE(inf.indexed.FindBy<test2_m>(5).empty());
+
+  auto edit2 = inf.Edit();
+  *edit2.indexed.Get(3).test2 = 5;
+  EXPECT_TRUE(edit2.indexed.Erase(0));
+  EXPECT_TRUE(edit2.indexed.Emplace(InfoIndexed::indexed_t::Builder(10, 5)));
+  EXPECT_TRUE(edit2.Commit());
+  EXPECT_THAT(inf.indexed.FindBy<test2_m>(0).size(), Eq(2));
+  EXPECT_THAT(inf.indexed.FindBy<test2_m>(5).size(), Eq(2));
+  edit2.Rollback();
+  EXPECT_THAT(inf.indexed.FindBy<test2_m>(0).size(), Eq(4));
+  EXPECT_TRUE(inf.indexed.FindBy<test2_m>(5).empty());
+};
+
+TEST(Container, TestIndexLoad) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  InfoIndexed inf(InfoIndexed::Builder(_).SetDir(dir->clone()));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 10; i++) {
+    edit.indexed.Emplace(InfoIndexed::indexed_t::Builder(i, i % 3));
+  }
+  EXPECT_TRUE(edit.Commit());
+  // Indexes of loaded containers are built on first use.
+  auto inf2 = InfoIndexed::Load(dir->clone(), "", nullptr);
+  EXPECT_THAT(inf2->indexed.FindBy<test2_m>(2).size(), Eq(3));
+  auto edit2 = inf2->Edit();
+  *edit2.indexed.Get(2).test2 = 0;
+  EXPECT_TRUE(edit2.Commit());
+  EXPECT_THAT(inf2->indexed.FindBy<test2_m>(2).size(), Eq(2));
+  EXPECT_THAT(inf2->indexed.FindBy<test2_m>(0).size(), Eq(5));
+};
+
+DECLARE_MEMBER(int, test3);
+
+template <typename T>
+using Foo3 = Data<T, test_m, test2_m, test3_m>;
+
+DECLARE_MEMBER((Container<T, Foo3, Key, UniqueIndex<test2_m, test3_m>>),
+               unique);
+
+using InfoUnique = MainData<unique_m>;
+
+TEST(Container, TestUniqueIndex) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  InfoUnique inf(InfoUnique::Builder(_).SetDir(dir->clone()));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 10; i++) {
+    edit.unique.Emplace(InfoUnique::unique_t::Builder(i, i % 3, i));
+  }
+  EXPECT_TRUE(edit.Commit());
+  auto find = [&](auto... v) {
+    return inf.unique.FindBy<test2_m, test3_m>(v...);
+  };
+  EXPECT_THAT(find(1, 4).size(), Eq(1));
+  EXPECT_TRUE(find(1, 5).empty());
+  // Lookups by a prefix of the members.
+  auto found = find(2);
+  ASSERT_THAT(found.size(), Eq(3));
+  for (const auto* e : found) EXPECT_THAT(*e->test2, Eq(2));
+
+  auto edit2 = inf.Edit();
+  EXPECT_TRUE(edit2.unique.Emplace(InfoUnique::unique_t::Builder(10, 1, 4)));
+  EXPECT_FALSE(edit2.Commit());
+  EXPECT_THAT(inf.unique.Size(), Eq(10));
+
+  auto edit3 = inf.Edit();
+  *edit3.unique.Get(6).test3 = 7;
+  *edit3.unique.Get(3).test2 = 2;
+  *edit3.unique.Get(3).test3 = 5;
+  EXPECT_FALSE(edit3.Commit());
+  EXPECT_THAT(*inf.unique.Get(6).test3, Eq(6));
+  EXPECT_THAT(*inf.unique.Get(3).test2, Eq(0));
+  EXPECT_THAT(find(0, 6).size(), Eq(1));
+  EXPECT_THAT(find(2, 5).size(), Eq(1));
+  EXPECT_THAT(find(0, 3).size(), Eq(1));
+
+  // Elements erased by a rejected commit are put back as they were.
+  auto edit5 = inf.Edit();
+  EXPECT_TRUE(edit5.unique.Erase(4));
+  EXPECT_TRUE(edit5.unique.Emplace(InfoUnique::unique_t::Builder(10, 1, 7)));
+  EXPECT_FALSE(edit5.Commit());
+  EXPECT_THAT(inf.unique.Size(), Eq(10));
+  ASSERT_THAT(find(1, 4).size(), Eq(1));
+  EXPECT_THAT(*find(1, 4)[0]->test, Eq(4));
+  EXPECT_TRUE(*InfoUnique::Load(dir->clone(), "", nullptr) == inf);
+
+  // Erased elements release their keys before new ones are inserted.
+  auto edit4 = inf.Edit();
+  EXPECT_TRUE(edit4.unique.Erase(4));
+  EXPECT_TRUE(edit4.unique.Emplace(InfoUnique::unique_t::Builder(10, 1, 4)));
+  EXPECT_TRUE(edit4.Commit());
+  EXPECT_THAT(*find(1, 4)[0]->test, Eq(10));
+  EXPECT_TRUE(*InfoUnique::Load(dir->clone(), "", nullptr) == inf);
+};
+
+DECLARE_MEMBER((LazyContainer<T, Foo, Key>), lazy_cont);
+
+using InfoLazy = MainData<lazy_cont_m>;
+
+TEST(Container, TestLazyLoad) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  InfoLazy inf(InfoLazy::Builder(_).SetDir(dir->clone()));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 5; i++) {
+    edit.lazy_cont.Emplace(InfoLazy::lazy_cont_t::Builder(i, i + 5));
+  }
+  EXPECT_TRUE(edit.Commit());
+  auto inf2 = InfoLazy::Load(dir->clone(), "", nullptr);
+  EXPECT_THAT(inf2->lazy_cont.Size(), Eq(5));
+  EXPECT_THAT(inf2->lazy_cont.ResidentSize(), Eq(0));
+  EXPECT_TRUE(inf2->lazy_cont.Count(3));
+  EXPECT_THAT(inf2->lazy_cont.ResidentSize(), Eq(0));
+  EXPECT_THAT(*inf2->lazy_cont.Get(3).test2, Eq(8));
+  EXPECT_THAT(inf2->lazy_cont.ResidentSize(), Eq(1));
+  EXPECT_TRUE(inf == *inf2);
+};
+
+TEST(Container, TestLazyLookup) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  InfoLazy inf(InfoLazy::Builder(_).SetDir(dir->clone()));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 5; i++) {
+    edit.lazy_cont.Emplace(InfoLazy::lazy_cont_t::Builder(i, i + 5));
+  }
+  EXPECT_TRUE(edit.Commit());
+  auto inf2 = InfoLazy::Load(dir->clone(), "", nullptr);
+  {
+    auto edit2 = inf2->Edit();
+    EXPECT_FALSE(edit2.lazy_cont.Count(7));
+    EXPECT_FALSE(edit2.lazy_cont.Erase(7));
+    EXPECT_FALSE(edit2.lazy_cont.Emplace(InfoLazy::lazy_cont_t::Builder(2, 0)));
+    EXPECT_TRUE(edit2.lazy_cont.Emplace(InfoLazy::lazy_cont_t::Builder(7, 0)));
+    EXPECT_TRUE(edit2.Commit());
+  }
+  EXPECT_THAT(inf2->lazy_cont.Size(), Eq(6));
+  // Only the inserted element is in memory.
+  EXPECT_THAT(inf2->lazy_cont.ResidentSize(), Eq(1));
+};
+
+TEST(Container, TestLazyEvict) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  InfoLazy inf(InfoLazy::Builder(_).SetDir(dir->clone()));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 5; i++) {
+    edit.lazy_cont.Emplace(InfoLazy::lazy_cont_t::Builder(i, i + 5));
+  }
+  EXPECT_TRUE(edit.Commit());
+  auto inf2 = InfoLazy::Load(dir->clone(), "", nullptr);
+  storage::Options options;
+  options.resident_limit = 2;
+  inf2->SetStorage(options);
+  int sum = 0;
+  for (const auto& [k, v] : inf2->lazy_cont) {
+    sum += *v->test2;
+    EXPECT_LE(inf2->lazy_cont.ResidentSize(), 2);
+  }
+  EXPECT_THAT(sum, Eq(35));
+
+  {
+    auto edit2 = inf2->Edit();
+    *edit2.lazy_cont.Get(0).test2 = 1;
+    *edit2.lazy_cont.Get(1).test2 = 1;
+    *edit2.lazy_cont.Get(2).test2 = 1;
+    EXPECT_TRUE(edit2.Commit());
+  }
+  EXPECT_THAT(*inf2->lazy_cont.Get(3).test2, Eq(8));
+  EXPECT_THAT(*inf2->lazy_cont.Get(0).test2, Eq(1));
+  EXPECT_LE(inf2->lazy_cont.ResidentSize(), 2);
+  auto inf3 = InfoLazy::Load(dir->clone(), "", nullptr);
+  EXPECT_TRUE(*inf2 == *inf3);
+};
+
+TEST(Container, TestLazyEvictCallbacks) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  InfoLazy inf(InfoLazy::Builder(_).SetDir(dir->clone()));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 5; i++) {
+    edit.lazy_cont.Emplace(InfoLazy::lazy_cont_t::Builder(i, i + 5));
+  }
+  EXPECT_TRUE(edit.Commit());
+  storage::Options options;
+  options.resident_limit = 2;
+  auto inf2 = InfoLazy::Load(dir->clone(), "", nullptr, options);
+  auto& lazy_cont = inf2->lazy_cont;
+  int changes = 0;
+  lazy_cont.Get(0).test2.OnChange([&changes](int o, int n) {
+    changes++;
+    return true;
+  });
+  for (int i = 1; i < 4; i++) lazy_cont.Get(i);
+  EXPECT_THAT(lazy_cont.ResidentSize(), Eq(2));
+
+  // The reloaded element has lost the callback, but not the key callback of
+  // the container.
+  {
+    auto element = lazy_cont.Get(0).Edit();
+    *element.test2 = 1;
+    *element.test = 10;
+    EXPECT_TRUE(element.Commit());
+  }
+  EXPECT_THAT(changes, Eq(0));
+  EXPECT_FALSE(lazy_cont.Count(0));
+  ASSERT_TRUE(lazy_cont.Count(10));
+  EXPECT_THAT(*lazy_cont.Get(10).test2, Eq(1));
+};
+
+TEST(Container, TestBufferPool) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  InfoLazy inf(InfoLazy::Builder(_).SetDir(dir->clone()));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 20; i++) {
+    edit.lazy_cont.Emplace(InfoLazy::lazy_cont_t::Builder(i, i + 5));
+  }
+  EXPECT_TRUE(edit.Commit());
+  storage::Options options;
+  options.buffer_pool = std::make_shared<storage::BufferPool>(1 << 20);
+  auto inf2 = InfoLazy::Load(dir->clone(), "", nullptr, options);
+  EXPECT_THAT(*inf2->lazy_cont.Get(0).test2, Eq(5));
+  size_t element = options.buffer_pool->Used();
+  EXPECT_GT(element, 0);
+
+  options.buffer_pool = std::make_shared<storage::BufferPool>(3 * element);
+  auto inf3 = InfoLazy::Load(dir->clone(), "", nullptr, options);
+  auto& lazy_cont = inf3->lazy_cont;
+  // An element with an open editor stays in memory.
+  auto pinned = lazy_cont.Get(1).Edit();
+  int sum = 0;
+  for (const auto& [k, v] : lazy_cont) {
+    sum += *v->test2;
+    EXPECT_LE(lazy_cont.ResidentSize(), 4);
+  }
+  EXPECT_THAT(sum, Eq(290));
+  *pinned.test2 = 0;
+  EXPECT_TRUE(pinned.Commit());
+  EXPECT_THAT(*lazy_cont.Get(1).test2, Eq(0));
+
+  {
+    // So are all the elements of a container with an open editor.
+    auto edit2 = inf3->Edit();
+    for (int i = 0; i < 6; i++) *edit2.lazy_cont.Get(i).test2 = 1;
+    EXPECT_GE(lazy_cont.ResidentSize(), 6);
+    EXPECT_TRUE(edit2.Commit());
+  }
+  for (int i = 10; i < 20; i++) {
+    EXPECT_THAT(*lazy_cont.Get(i).test2, Eq(i + 5));
+  }
+  EXPECT_LE(options.buffer_pool->Used(), 3 * element);
+  EXPECT_THAT(*lazy_cont.Get(0).test2, Eq(1));
+  auto inf4 = InfoLazy::Load(dir->clone(), "", nullptr);
+  EXPECT_TRUE(*inf3 == *inf4);
+};
+
+DECLARE_MEMBER((LazyContainer<T, Foo, Key>), lazy_other);
+
+using InfoLazyPair = MainData<lazy_cont_m, lazy_other_m>;
+
+// Elements dropped to make room for those of another container are no longer
+// resident in theirs.
+TEST(Container, TestBufferPoolShared) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  InfoLazyPair inf(InfoLazyPair::Builder(_, _).SetDir(dir->clone()));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 10; i++) {
+    edit.lazy_cont.Emplace(InfoLazyPair::lazy_cont_t::Builder(i, i));
+    edit.lazy_other.Emplace(InfoLazyPair::lazy_other_t::Builder(i, -i));
+  }
+  EXPECT_TRUE(edit.Commit());
+  storage::Options options;
+  options.buffer_pool = std::make_shared<storage::BufferPool>(1 << 20);
+  auto inf2 = InfoLazyPair::Load(dir->clone(), "", nullptr, options);
+  inf2->lazy_cont.Get(0);
+  size_t element = options.buffer_pool->Used();
+
+  options.buffer_pool = std::make_shared<storage::BufferPool>(3 * element);
+  options.resident_limit = 2;
+  auto inf3 = InfoLazyPair::Load(dir->clone(), "", nullptr, options);
+  auto& pool = *options.buffer_pool;
+  for (int i = 0; i < 10; i++) {
+    EXPECT_THAT(*inf3->lazy_cont.Get(i).test2, Eq(i));
+    EXPECT_THAT(*inf3->lazy_other.Get(i).test2, Eq(-i));
+    EXPECT_THAT(
+        inf3->lazy_cont.ResidentSize() + inf3->lazy_other.ResidentSize(),
+        Eq(pool.FrameCount()));
+    EXPECT_LE(pool.Used(), 3 * element);
+  }
+  for (int i = 0; i < 10; i++) {
+    auto element = inf3->lazy_cont.Get(i).Edit();
+    *element.test2 = 2 * i;
+    EXPECT_TRUE(element.Commit());
+    EXPECT_THAT(*inf3->lazy_other.Get(9 - i).test2, Eq(i - 9));
+    EXPECT_THAT(
+        inf3->lazy_cont.ResidentSize() + inf3->lazy_other.ResidentSize(),
+        Eq(pool.FrameCount()));
+  }
+  inf3.reset();
+  EXPECT_THAT(pool.FrameCount(), Eq(0));
+  EXPECT_THAT(pool.Used(), Eq(0));
+  auto inf4 = InfoLazyPair::Load(dir->clone(), "", nullptr);
+  EXPECT_THAT(*inf4->lazy_cont.Get(9).test2, Eq(18));
+};
+
+DECLARE_MEMBER((LazyContainer<T, Foo, Key>), lazy_inner);
+
+template <typename T>
+using LazyOuter = Data<T, test_m, lazy_inner_m>;
+
+DECLARE_MEMBER((LazyContainer<T, LazyOuter, Key>), lazy_outer);
+
+using InfoLazyNested = MainData<lazy_outer_m>;
+
+TEST(Container, TestBufferPoolNested) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  InfoLazyNested inf(InfoLazyNested::Builder(_).SetDir(dir->clone()));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 4; i++) {
+    edit.lazy_outer.Emplace(InfoLazyNested::lazy_outer_t::Builder(i, _));
+  }
+  EXPECT_TRUE(edit.Commit());
+  for (int i = 0; i < 4; i++) {
+    auto edit = inf.lazy_outer.Get(i).Edit();
+    for (int j = 0; j < 5; j++) {
+      edit.lazy_inner.Emplace(
+          InfoLazyNested::lazy_outer_t::Contained::lazy_inner_t::Builder(j,
+                                                                         i));
+    }
+    EXPECT_TRUE(edit.Commit());
+  }
+  // Every load drops all the elements that do not contain the loaded one.
+  storage::Options options;
+  options.buffer_pool = std::make_shared<storage::BufferPool>(0);
+  auto inf2 = InfoLazyNested::Load(dir->clone(), "", nullptr, options);
+  EXPECT_THAT(*inf2->lazy_outer.Get(2).lazy_inner.Get(3).test2, Eq(2));
+  EXPECT_THAT(options.buffer_pool->FrameCount(), Eq(2));
+  EXPECT_THAT(*inf2->lazy_outer.Get(1).lazy_inner.Get(4).test2, Eq(1));
+  EXPECT_THAT(options.buffer_pool->FrameCount(), Eq(2));
+  EXPECT_THAT(inf2->lazy_outer.ResidentSize(), Eq(1));
+  EXPECT_TRUE(inf == *inf2);
+};
+
+
+DECLARE_MEMBER((Container<T, Foo, Key>), inner_cont);
+
+template <typename T>
+using Outer = Data<T, test_m, inner_cont_m>;
+
+DECLARE_MEMBER((Container<T, Outer, Key>), outer_cont);
+
+using InfoNested = MainData<outer_cont_m>;
+
+TEST(Container, TestParallelLoad) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  InfoNested inf(InfoNested::Builder(_).SetDir(dir->clone()));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 20; i++) {
+    edit.outer_cont.Emplace(InfoNested::outer_cont_t::Builder(i, _));
+  }
+  EXPECT_TRUE(edit.Commit());
+  for (int i = 0; i < 20; i++) {
+    auto edit = inf.outer_cont.Get(i).Edit();
+    for (int j = 0; j < 5; j++) {
+      edit.inner_cont.Emplace(
+          InfoNested::outer_cont_t::Contained::inner_cont_t::Builder(j, i));
+    }
+    EXPECT_TRUE(edit.Commit());
+  }
+  storage::Options options;
+  options.load_pool = std::make_shared<util::ThreadPool>(4);
+  auto inf2 = InfoNested::Load(dir->clone(), "", nullptr, options);
+  EXPECT_THAT(inf2->outer_cont.Size(), Eq(20));
+  EXPECT_THAT(*inf2->outer_cont.Get(7).inner_cont.Get(3).test2, Eq(7));
+  EXPECT_TRUE(inf == *inf2);
+};
+
+// Nested containers loaded in parallel write their key index, if they had
+// none, through the group commit from the threads of the pool.
+TEST(Container, TestParallelLoadWithoutKeyIndex) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  auto write = [&](kj::PathPtr path, kj::StringPtr text) {
+    auto f = dir->replaceFile(
+        path, kj::WriteMode::CREATE | kj::WriteMode::CREATE_PARENT);
+    f->get().writeAll(text);
+    f->commit();
+  };
+  std::string outer_keys;
+  for (int i = 0; i < 20; i++) {
+    outer_keys += (i ? "," : "") + std::to_string(i);
+    std::string name = std::to_string(i);
+    write(kj::Path{"outer_cont", name.c_str(), "data.json"},
+          kj::str(R"({"test": )", i, R"(, "inner_cont": [0, 1, 2]})"));
+    for (int j = 0; j < 3; j++) {
+      std::string inner = std::to_string(j);
+      write(kj::Path{"outer_cont", name.c_str(), "inner_cont", inner.c_str(),
+                     "data.json"},
+            kj::str(R"({"test": )", j, R"(, "test2": )", i, "}"));
+    }
+  }
+  write(kj::Path{"data.json"},
+        kj::str(R"({"outer_cont": [)", outer_keys.c_str(), "]}"));
+  storage::Options options;
+  options.load_pool = std::make_shared<util::ThreadPool>(4);
+  options.group_commit = std::make_shared<storage::GroupCommit>(16);
+  auto inf = InfoNested::Load(dir->clone(), "", nullptr, options);
+  options.group_commit->Flush();
+  auto inf2 = InfoNested::Load(dir->clone(), "", nullptr);
+  EXPECT_THAT(inf2->outer_cont.Size(), Eq(20));
+  EXPECT_THAT(inf2->outer_cont.Get(7).inner_cont.Size(), Eq(3));
+  EXPECT_THAT(*inf2->outer_cont.Get(7).inner_cont.Get(2).test2, Eq(7));
+  EXPECT_TRUE(*inf == *inf2);
+};
+
+TEST(Container, TestBinaryFormat) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  storage::Options options;
+  options.format = storage::Format::kBinary;
+  InfoNested inf(
+      InfoNested::Builder(_).SetDir(dir->clone()).SetStorage(options));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 5; i++) {
+    edit.outer_cont.Emplace(InfoNested::outer_cont_t::Builder(i, _));
+  }
+  EXPECT_TRUE(edit.Commit());
+  {
+    auto edit = inf.outer_cont.Get(3).Edit();
+    edit.inner_cont.Emplace(
+        InfoNested::outer_cont_t::Contained::inner_cont_t::Builder(1, -2));
+    EXPECT_TRUE(edit.Commit());
+  }
+  EXPECT_TRUE(dir->exists(kj::Path({"outer_cont", "3", "data.bin"})));
+  auto inf2 = InfoNested::Load(dir->clone(), "", nullptr, options);
+  EXPECT_THAT(*inf2->outer_cont.Get(3).inner_cont.Get(1).test2, Eq(-2));
+  EXPECT_TRUE(inf == *inf2);
+};
+
+TEST(Container, TestShardedLayout) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  storage::Options options;
+  options.layout = storage::Layout::kSharded;
+  InfoNested inf(
+      InfoNested::Builder(_).SetDir(dir->clone()).SetStorage(options));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 5; i++) {
+    edit.outer_cont.Emplace(InfoNested::outer_cont_t::Builder(i, _));
+  }
+  EXPECT_TRUE(edit.Commit());
+  {
+    auto edit = inf.outer_cont.Get(3).Edit();
+    edit.inner_cont.Emplace(
+        InfoNested::outer_cont_t::Contained::inner_cont_t::Builder(1, -2));
+    EXPECT_TRUE(edit.Commit());
+  }
+  auto shards = storage::Shards("3");
+  EXPECT_TRUE(dir->exists(
+      kj::Path({"outer_cont", shards[0].c_str(), shards[1].c_str(), "3"})));
+  EXPECT_FALSE(dir->exists(kj::Path({"outer_cont", "3"})));
+  auto inf2 = InfoNested::Load(dir->clone(), "", nullptr, options);
+  EXPECT_THAT(*inf2->outer_cont.Get(3).inner_cont.Get(1).test2, Eq(-2));
+  EXPECT_TRUE(inf == *inf2);
+
+  storage::MigrateLayout(*dir, storage::Layout::kSharded,
+                         storage::Layout::kFlat);
+  EXPECT_TRUE(dir->exists(kj::Path({"outer_cont", "3", "inner_cont", "1"})));
+  EXPECT_FALSE(dir->exists(kj::Path({"outer_cont", shards[0].c_str()})));
+  auto inf3 = InfoNested::Load(dir->clone(), "", nullptr);
+  EXPECT_TRUE(inf == *inf3);
+  storage::MigrateLayout(*dir, storage::Layout::kFlat,
+                         storage::Layout::kSharded);
+  auto inf4 = InfoNested::Load(dir->clone(), "", nullptr, options);
+  EXPECT_TRUE(inf == *inf4);
+};
+
+// Migrations interrupted by a crash are completed when they are run again.
+TEST(Container, TestMigrateLayoutResume) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  storage::Options options;
+  options.layout = storage::Layout::kSharded;
+  InfoNested inf(
+      InfoNested::Builder(_).SetDir(dir->clone()).SetStorage(options));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 5; i++) {
+    edit.outer_cont.Emplace(InfoNested::outer_cont_t::Builder(i, _));
+  }
+  EXPECT_TRUE(edit.Commit());
+  {
+    auto edit = inf.outer_cont.Get(3).Edit();
+    edit.inner_cont.Emplace(
+        InfoNested::outer_cont_t::Contained::inner_cont_t::Builder(1, -2));
+    EXPECT_TRUE(edit.Commit());
+  }
+  auto move = kj::WriteMode::CREATE | kj::WriteMode::CREATE_PARENT;
+  auto sharded = [](const char* name) {
+    auto shards = storage::Shards(name);
+    return kj::Path({shards[0].c_str(), shards[1].c_str(), name});
+  };
+
+  // Interrupted while moving the elements to the staging directory.
+  auto outer = dir->openSubdir(kj::Path("outer_cont"));
+  for (const char* name : {"1", "3"}) {
+    outer->transfer(kj::Path({"layout.tmp", name}), move, sharded(name),
+                    kj::TransferMode::MOVE);
+  }
+  storage::MigrateLayout(*dir, storage::Layout::kSharded,
+                         storage::Layout::kFlat);
+  EXPECT_TRUE(dir->exists(kj::Path({"outer_cont", "3", "inner_cont", "1"})));
+  EXPECT_FALSE(dir->exists(kj::Path({"outer_cont", "layout.tmp"})));
+  EXPECT_FALSE(dir->exists(kj::Path("layout.log")));
+  EXPECT_TRUE(inf == *InfoNested::Load(dir->clone(), "", nullptr));
+
+  // Interrupted after the elements of outer_cont were moved, while staging
+  // those of the inner_cont of 3.
+  for (const char* name : {"0", "1", "2", "3", "4"}) {
+    outer->transfer(sharded(name), move, kj::Path(name),
+                    kj::TransferMode::MOVE);
+  }
+  auto log = dir->appendFile(kj::Path("layout.log"), kj::WriteMode::CREATE);
+  log->write("outer_cont\n", 11);
+  auto inner = outer->openSubdir(sharded("3").append("inner_cont"));
+  inner->transfer(kj::Path({"layout.tmp", "1"}), move, kj::Path("1"),
+                  kj::TransferMode::MOVE);
+  storage::MigrateLayout(*dir, storage::Layout::kFlat,
+                         storage::Layout::kSharded);
+  EXPECT_TRUE(inner->exists(sharded("1")));
+  EXPECT_FALSE(inner->exists(kj::Path("layout.tmp")));
+  EXPECT_FALSE(dir->exists(kj::Path("layout.log")));
+  EXPECT_TRUE(inf == *InfoNested::Load(dir->clone(), "", nullptr, options));
+};
+
+TEST(Container, TestSegmentStore) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  storage::Options options;
+  options.segments = std::make_shared<storage::SegmentStore>(
+      dir->openSubdir(kj::Path("segments"), kj::WriteMode::CREATE),
+      /*segment_size=*/256);
+  InfoNested inf(
+      InfoNested::Builder(_).SetDir(dir->clone()).SetStorage(options));
+  for (int i = 0; i < 20; i++) {
+    auto edit = inf.Edit();
+    edit.outer_cont.Emplace(InfoNested::outer_cont_t::Builder(i, _));
+    EXPECT_TRUE(edit.Commit());
+    auto inner = inf.outer_cont.Get(i).Edit();
+    inner.inner_cont.Emplace(
+        InfoNested::outer_cont_t::Contained::inner_cont_t::Builder(1, i));
+    EXPECT_TRUE(inner.Commit());
+  }
+  EXPECT_FALSE(dir->exists(kj::Path("outer_cont")));
+  auto inf2 = InfoNested::Load(dir->clone(), "", nullptr, options);
+  EXPECT_THAT(*inf2->outer_cont.Get(7).inner_cont.Get(1).test2, Eq(7));
+  EXPECT_TRUE(inf == *inf2);
+};
+
+TEST(Container, TestBackup) {
+  kj::EventLoop loop;
+  kj::WaitScope ws(loop);
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  storage::Options options;
+  options.mode = storage::Mode::kLog;
+  options.backups = std::make_shared<storage::Backups>();
+  Info inf(Info::Builder(_).SetDir(dir->clone()).SetStorage(options));
+  for (int i = 0; i < 50; i++) {
+    auto edit = inf.Edit();
+    edit.cont.Emplace(Info::cont_t::Builder(i, 5));
+    EXPECT_TRUE(edit.Commit());
+  }
+  auto backup_dir = kj::newInMemoryDirectory(kj::nullClock());
+  auto done = Backup(inf, backup_dir->clone());
+  // Commits made while the backup runs are not part of it.
+  for (int i = 0; i < 50; i++) {
+    auto edit = inf.cont.Get(i).Edit();
+    *edit.test2 = 6;
+    EXPECT_TRUE(edit.Commit());
+  }
+  {
+    auto edit = inf.Edit();
+    edit.cont.Emplace(Info::cont_t::Builder(50, 5));
+    EXPECT_TRUE(edit.Commit());
+  }
+  done.wait(ws);
+  auto backup = Info::Load(backup_dir->clone(), "", nullptr);
+  EXPECT_THAT(backup->cont.Size(), Eq(50));
+  for (int i = 0; i < 50; i++) {
+    EXPECT_THAT(*backup->cont.Get(i).test2, Eq(5));
+  }
+  auto current = Info::Load(dir->clone(), "", nullptr);
+  EXPECT_THAT(current->cont.Size(), Eq(51));
+  EXPECT_THAT(*current->cont.Get(7).test2, Eq(6));
+};
+
+TEST(Container, TestBinarySnapshot) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  InfoNested inf(InfoNested::Builder(_).SetDir(dir->clone()));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 10; i++) {
+    edit.outer_cont.Emplace(InfoNested::outer_cont_t::Builder(i, _));
+  }
+  EXPECT_TRUE(edit.Commit());
+  for (int i = 0; i < 10; i++) {
+    auto edit = inf.outer_cont.Get(i).Edit();
+    for (int j = 0; j < 3; j++) {
+      edit.inner_cont.Emplace(
+          InfoNested::outer_cont_t::Contained::inner_cont_t::Builder(j, i));
+    }
+    EXPECT_TRUE(edit.Commit());
+  }
+  WriteBinarySnapshot(inf);
+  EXPECT_TRUE(dir->exists(kj::Path(storage::kBinarySnapshotFile)));
+
+  // Object files are not read when loading from the snapshot.
+  auto file = kj::Path({"outer_cont", "7", "inner_cont", "2", "data.json"});
+  auto old = dir->openFile(file)->readAllText();
+  dir->openFile(file, kj::WriteMode::MODIFY)->writeAll("{");
+  auto inf2 = LoadBinarySnapshot<InfoNested>(dir->clone(), "");
+  EXPECT_TRUE(inf == *inf2);
+  dir->openFile(file, kj::WriteMode::MODIFY)->writeAll(old);
+
+  // The first write makes the snapshot stale, and removes it.
+  {
+    auto edit = inf2->outer_cont.Get(7).inner_cont.Get(2).Edit();
+    *edit.test2 = 42;
+    EXPECT_TRUE(edit.Commit());
+  }
+  EXPECT_FALSE(dir->exists(kj::Path(storage::kBinarySnapshotFile)));
+  auto inf3 = LoadBinarySnapshot<InfoNested>(dir->clone(), "");
+  EXPECT_THAT(*inf3->outer_cont.Get(7).inner_cont.Get(2).test2, Eq(42));
+  EXPECT_TRUE(*inf2 == *inf3);
+};
+
+// The elements of a LazyContainer are neither loaded to write a snapshot nor
+// stored in it.
+TEST(Container, TestBinarySnapshotLazy) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  InfoLazy inf(InfoLazy::Builder(_).SetDir(dir->clone()));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 5; i++) {
+    edit.lazy_cont.Emplace(InfoLazy::lazy_cont_t::Builder(i, i + 5));
+  }
+  EXPECT_TRUE(edit.Commit());
+  auto inf2 = InfoLazy::Load(dir->clone(), "", nullptr);
+  WriteBinarySnapshot(*inf2);
+  EXPECT_THAT(inf2->lazy_cont.ResidentSize(), Eq(0));
+  auto inf3 = LoadBinarySnapshot<InfoLazy>(dir->clone(), "");
+  EXPECT_THAT(inf3->lazy_cont.Size(), Eq(5));
+  EXPECT_THAT(inf3->lazy_cont.ResidentSize(), Eq(0));
+  EXPECT_THAT(*inf3->lazy_cont.Get(3).test2, Eq(8));
+  EXPECT_TRUE(inf == *inf3);
+};
+
 DECLARE_MEMBER(
     (Subset<T, Foo, Key, ContainerGetter<placeholders::parent_, cont_m>>),
     sub_cont);
@@ -119,6 +1089,36 @@ TEST(Container, TestRoundTripSub) {
   EXPECT_TRUE(inf == *inf2);
 };
 
+// Containers edited by themselves are stored again by their parent.
+TEST(Container, TestEditSubStoresParent) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  using db::placeholders::_;
+  InfoSub inf(InfoSub::Builder(_, _).SetDir(dir->clone()));
+  auto edit = inf.Edit();
+  for (int i = 0; i < 3; i++) edit.cont.Emplace(InfoSub::cont_t::Builder(i, 5));
+  EXPECT_TRUE(edit.Commit());
+  auto edit2 = inf.sub_cont.Edit();
+  EXPECT_TRUE(edit2.Emplace(1));
+  EXPECT_TRUE(edit2.Commit());
+  EXPECT_TRUE(*InfoSub::Load(dir->clone(), "", nullptr) == inf);
+
+  auto edit3 = inf.Edit();
+  EXPECT_TRUE(edit3.sub_cont.Emplace(2));
+  EXPECT_TRUE(edit3.Commit());
+  auto edit4 = inf.sub_cont.Edit();
+  EXPECT_TRUE(edit4.Erase(1));
+  EXPECT_TRUE(edit4.Commit());
+  auto edit5 = inf.Edit();
+  *edit5.cont.Get(0).test2 = 6;
+  EXPECT_TRUE(edit5.Commit());
+  auto inf2 = InfoSub::Load(dir->clone(), "", nullptr);
+  EXPECT_FALSE(inf2->sub_cont.Count(1));
+  EXPECT_TRUE(inf2->sub_cont.Count(2));
+  EXPECT_TRUE(*inf2 == inf);
+  edit4.Rollback();
+  EXPECT_TRUE(*InfoSub::Load(dir->clone(), "", nullptr) == inf);
+};
+
 DECLARE_MEMBER((ConstrainedSet<T, Foo, Key,
                                ContainerGetter<placeholders::parent_, cont_m>>),
                constr_cont);
@@ -0,0 +1,142 @@
+#pragma once
+#include <kj/debug.h>
+#include <kj/filesystem.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+namespace db {
+namespace util {
+
+// Keeps at most capacity subdirectories of root open, closing the least
+// recently used one when another is needed. Directories that are evicted
+// while in use are closed once they are released.
+class DirPool : public std::enable_shared_from_this<DirPool> {
+ public:
+  static constexpr size_t kDefaultCapacity = 256;
+
+  DirPool(kj::Own<const kj::Directory> root, size_t capacity)
+      : root_(std::move(root)), capacity_(capacity) {}
+  DirPool(const DirPool&) = delete;
+  DirPool& operator=(const DirPool&) = delete;
+
+  // Opens the directory at path, a sequence of names separated by '/'. The
+  // empty path is the root. Missing directories are created if create is
+  // set, which is only done to write to them; otherwise null is returned.
+  std::shared_ptr<const kj::Directory> Open(const std::string& path,
+                                            bool create = true) {
+    if (path.empty()) {
+      return std::shared_ptr<const kj::Directory>(shared_from_this(),
+                                                  root_.get());
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = index_.find(path);
+      if (it != index_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->second;
+      }
+    }
+    // Opened without holding the lock, so that concurrent loads of different
+    // objects do not wait for each other.
+    auto parsed = kj::Path::parse(path.c_str());
+    std::shared_ptr<kj::Own<const kj::Directory>> own;
+    if (create) {
+      own = std::make_shared<kj::Own<const kj::Directory>>(root_->openSubdir(
+          parsed, kj::WriteMode::CREATE | kj::WriteMode::CREATE_PARENT |
+                      kj::WriteMode::MODIFY));
+    } else {
+      auto maybe_dir = root_->tryOpenSubdir(parsed);
+      KJ_IF_MAYBE(d, maybe_dir) {
+        own = std::make_shared<kj::Own<const kj::Directory>>(std::move(*d));
+      } else {
+        return nullptr;
+      }
+    }
+    std::shared_ptr<const kj::Directory> dir(own, own->get());
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(path);
+    if (it != index_.end()) return it->second->second;
+    lru_.emplace_front(path, dir);
+    index_.emplace(path, lru_.begin());
+    if (lru_.size() > capacity_) {
+      index_.erase(lru_.back().first);
+      lru_.pop_back();
+    }
+    return dir;
+  }
+
+  size_t OpenCount() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return lru_.size();
+  }
+
+ private:
+  using Entry = std::pair<std::string, std::shared_ptr<const kj::Directory>>;
+
+  kj::Own<const kj::Directory> root_;
+  size_t capacity_;
+  mutable std::mutex mutex_;
+  std::list<Entry> lru_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+};
+
+// Names a directory below the root of a DirPool, which is only opened while
+// it is accessed. Objects keep one of these rather than an open directory, so
+// that the number of open files does not grow with the number of objects. A
+// default-constructed Dir names no directory.
+class Dir {
+ public:
+  Dir() = default;
+  Dir(decltype(nullptr)) {}
+  Dir(kj::Own<const kj::Directory> root,
+      size_t capacity = DirPool::kDefaultCapacity)
+      : pool_(std::make_shared<DirPool>(std::move(root), capacity)) {}
+  Dir(kj::Maybe<kj::Own<const kj::Directory>> root) {
+    KJ_IF_MAYBE(r, root) {
+      pool_ =
+          std::make_shared<DirPool>(std::move(*r), DirPool::kDefaultCapacity);
+    }
+  }
+
+  explicit operator bool() const { return pool_ != nullptr; }
+
+  // The empty name (or a null one) names this same directory.
+  Dir Sub(const char* name) const {
+    if (!pool_ || !name || !name[0]) return *this;
+    std::string_view n(name);
+    KJ_REQUIRE(n != "." && n != ".." && n.find('/') == n.npos,
+               "invalid directory name", name);
+    Dir sub;
+    sub.pool_ = pool_;
+    sub.path_ = path_.empty() ? std::string(n) : path_ + "/" + std::string(n);
+    return sub;
+  }
+
+  // Creates the directory if it does not exist, so only used to write.
+  std::shared_ptr<const kj::Directory> Open() const {
+    KJ_REQUIRE(pool_ != nullptr, "no directory");
+    return pool_->Open(path_);
+  }
+
+  // Returns null if the directory does not exist.
+  std::shared_ptr<const kj::Directory> TryOpen() const {
+    KJ_REQUIRE(pool_ != nullptr, "no directory");
+    return pool_->Open(path_, /*create=*/false);
+  }
+
+  // Relative to the root of the pool.
+  const std::string& Path() const { return path_; }
+  const std::shared_ptr<DirPool>& Pool() const { return pool_; }
+
+ private:
+  std::shared_ptr<DirPool> pool_;
+  std::string path_;
+};
+
+}  // namespace util
+}  // namespace db
@@ -0,0 +1,474 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace db {
+namespace util {
+
+// Spreads the bits of std::hash, which is the identity for integers on most
+// standard libraries, as FlatMap uses the low bits and the high bits
+// separately.
+inline size_t MixHash(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  return h;
+}
+
+template <typename K>
+struct FlatHash {
+  size_t operator()(const K& k) const { return MixHash(std::hash<K>()(k)); }
+};
+
+// Strings can be looked up with anything convertible to std::string_view.
+template <>
+struct FlatHash<std::string> {
+  using is_transparent = void;
+  size_t operator()(std::string_view s) const {
+    return MixHash(std::hash<std::string_view>()(s));
+  }
+};
+
+// Hash map with open addressing, in the style of SwissTable: a byte of
+// metadata per slot, holding 7 bits of the hash of its key (or marking it as
+// empty or erased), is scanned 8 slots at a time, and keys are only compared
+// when those bits match. Entries are stored inline, so lookups touch the
+// metadata and then a single slot.
+//
+// Inserting may move the entries, which invalidates iterators and
+// references; erasing does not. Objects whose address must not change, such
+// as the elements of containers, are kept behind a pointer. Extracting and
+// inserting nodes moves the entry in and out of the table.
+template <typename K, typename V, typename Hash = FlatHash<K>>
+class FlatMap {
+  template <typename H, typename = void>
+  struct IsTransparent : std::false_type {};
+  template <typename H>
+  struct IsTransparent<H, std::void_t<typename H::is_transparent>>
+      : std::true_type {};
+  template <typename Q>
+  using EnableIfTransparent = std::enable_if_t<IsTransparent<Hash>::value &&
+                                               !std::is_same_v<Q, K>>;
+
+ public:
+  using key_type = K;
+  using mapped_type = V;
+  using value_type = std::pair<const K, V>;
+
+  template <bool kConst>
+  class Iterator {
+    using Map = std::conditional_t<kConst, const FlatMap, FlatMap>;
+
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = FlatMap::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = std::conditional_t<kConst, const value_type*, value_type*>;
+    using reference =
+        std::conditional_t<kConst, const value_type&, value_type&>;
+
+    Iterator() = default;
+    template <bool kOtherConst,
+              typename = std::enable_if_t<kConst && !kOtherConst>>
+    Iterator(const Iterator<kOtherConst>& other)
+        : map_(other.map_), index_(other.index_) {}
+
+    reference operator*() const { return map_->slots_[index_]; }
+    pointer operator->() const { return &map_->slots_[index_]; }
+    Iterator& operator++() {
+      index_ = map_->NextFull(index_ + 1);
+      return *this;
+    }
+    Iterator operator++(int) {
+      Iterator r = *this;
+      ++*this;
+      return r;
+    }
+    bool operator==(const Iterator& other) const {
+      return index_ == other.index_;
+    }
+    bool operator!=(const Iterator& other) const {
+      return index_ != other.index_;
+    }
+
+   private:
+    friend FlatMap;
+    Iterator(Map* map, size_t index) : map_(map), index_(index) {}
+    Map* map_ = nullptr;
+    size_t index_ = 0;
+  };
+  using iterator = Iterator<false>;
+  using const_iterator = Iterator<true>;
+
+  // An entry taken out of the map by extract.
+  class node_type {
+   public:
+    node_type() = default;
+    bool empty() const { return !entry_; }
+    explicit operator bool() const { return bool(entry_); }
+    K& key() { return entry_->first; }
+    V& mapped() { return entry_->second; }
+
+   private:
+    friend FlatMap;
+    std::optional<std::pair<K, V>> entry_;
+  };
+
+  struct insert_return_type {
+    iterator position;
+    bool inserted;
+    node_type node;
+  };
+
+  FlatMap() = default;
+  FlatMap(const FlatMap& other) {
+    reserve(other.size());
+    for (const auto& [k, v] : other) emplace(k, v);
+  }
+  FlatMap(FlatMap&& other) noexcept { Take(other); }
+  FlatMap& operator=(const FlatMap& other) {
+    if (this != &other) *this = FlatMap(other);
+    return *this;
+  }
+  FlatMap& operator=(FlatMap&& other) noexcept {
+    if (this != &other) {
+      Release();
+      Take(other);
+    }
+    return *this;
+  }
+  ~FlatMap() { Release(); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  iterator begin() { return iterator(this, NextFull(0)); }
+  iterator end() { return iterator(this, capacity_); }
+  const_iterator begin() const { return const_iterator(this, NextFull(0)); }
+  const_iterator end() const { return const_iterator(this, capacity_); }
+
+  iterator find(const K& key) { return iterator(this, Find(key)); }
+  const_iterator find(const K& key) const {
+    return const_iterator(this, Find(key));
+  }
+  template <typename Q, typename = EnableIfTransparent<Q>>
+  iterator find(const Q& key) {
+    return iterator(this, Find(key));
+  }
+  template <typename Q, typename = EnableIfTransparent<Q>>
+  const_iterator find(const Q& key) const {
+    return const_iterator(this, Find(key));
+  }
+
+  size_t count(const K& key) const { return Find(key) != capacity_; }
+  template <typename Q, typename = EnableIfTransparent<Q>>
+  size_t count(const Q& key) const {
+    return Find(key) != capacity_;
+  }
+
+  V& at(const K& key) { return At(key); }
+  const V& at(const K& key) const {
+    return const_cast<FlatMap*>(this)->At(key);
+  }
+  template <typename Q, typename = EnableIfTransparent<Q>>
+  V& at(const Q& key) {
+    return At(key);
+  }
+  template <typename Q, typename = EnableIfTransparent<Q>>
+  const V& at(const Q& key) const {
+    return const_cast<FlatMap*>(this)->At(key);
+  }
+
+  // Does not construct the value if the key is already present.
+  template <typename A, typename... Args>
+  std::pair<iterator, bool> emplace(A&& key, Args&&... args) {
+    if constexpr (std::is_same_v<std::decay_t<A>, K>) {
+      return Emplace(std::forward<A>(key), std::forward<Args>(args)...);
+    } else {
+      return Emplace(K(std::forward<A>(key)), std::forward<Args>(args)...);
+    }
+  }
+
+  V& operator[](const K& key) { return emplace(key).first->second; }
+
+  size_t erase(const K& key) {
+    size_t index = Find(key);
+    if (index == capacity_) return 0;
+    EraseAt(index);
+    return 1;
+  }
+  iterator erase(const_iterator it) {
+    EraseAt(it.index_);
+    return iterator(this, NextFull(it.index_ + 1));
+  }
+
+  node_type extract(const K& key) {
+    node_type node;
+    size_t index = Find(key);
+    if (index == capacity_) return node;
+    node.entry_.emplace(slots_[index].first, std::move(slots_[index].second));
+    EraseAt(index);
+    return node;
+  }
+
+  insert_return_type insert(node_type&& node) {
+    if (node.empty()) return {end(), false, node_type()};
+    auto it = find(node.key());
+    if (it != end()) return {it, false, std::move(node)};
+    auto r = emplace(std::move(node.key()), std::move(node.mapped()));
+    return {r.first, true, node_type()};
+  }
+
+  void clear() {
+    Release();
+    ctrl_ = nullptr;
+    slots_ = nullptr;
+    capacity_ = size_ = growth_left_ = 0;
+  }
+
+  // Makes room for n entries without rehashing.
+  void reserve(size_t n) {
+    size_t capacity = kGroupWidth;
+    while (capacity * 7 / 8 < n) capacity *= 2;
+    if (capacity > capacity_) Rehash(capacity);
+  }
+
+ private:
+  static constexpr size_t kGroupWidth = 8;
+  static constexpr int8_t kEmpty = -128;
+  static constexpr int8_t kDeleted = -2;
+  static constexpr uint64_t kLsbs = 0x0101010101010101ull;
+  static constexpr uint64_t kMsbs = 0x8080808080808080ull;
+
+  static size_t H1(size_t hash) { return hash >> 7; }
+  static int8_t H2(size_t hash) { return hash & 0x7F; }
+
+  // The metadata of the kGroupWidth slots starting at index, one per byte
+  // from the lowest. The first kGroupWidth bytes are mirrored at the end of
+  // ctrl_, so that groups can wrap around.
+  uint64_t Group(size_t index) const {
+    uint64_t group = 0;
+    for (size_t i = 0; i < kGroupWidth; i++) {
+      group |= uint64_t(uint8_t(ctrl_[index + i])) << (8 * i);
+    }
+    return group;
+  }
+  // Bytes equal to h2, possibly with false positives, which are excluded by
+  // checking the byte again.
+  static uint64_t Match(uint64_t group, int8_t h2) {
+    uint64_t x = group ^ (kLsbs * uint8_t(h2));
+    return (x - kLsbs) & ~x & kMsbs;
+  }
+  static uint64_t MatchEmpty(uint64_t group) {
+    return group & ~(group << 6) & kMsbs;
+  }
+  static uint64_t MatchFree(uint64_t group) {
+    return group & ~(group << 7) & kMsbs;
+  }
+  static size_t FirstByte(uint64_t mask) {
+    size_t i = 0;
+    while (!(mask & 0x80)) {
+      mask >>= 8;
+      i++;
+    }
+    return i;
+  }
+
+  void SetCtrl(size_t index, int8_t value) {
+    ctrl_[index] = value;
+    if (index < kGroupWidth) ctrl_[capacity_ + index] = value;
+  }
+
+  template <typename Q>
+  size_t Find(const Q& key) const {
+    return Find(key, Hash()(key));
+  }
+
+  // Returns capacity_ if key is missing.
+  template <typename Q>
+  size_t Find(const Q& key, size_t hash) const {
+    if (capacity_ == 0) return capacity_;
+    size_t mask = capacity_ - 1;
+    size_t pos = H1(hash) & mask;
+    int8_t h2 = H2(hash);
+    for (size_t probed = 0; probed < capacity_; probed += kGroupWidth) {
+      uint64_t group = Group(pos);
+      for (uint64_t m = Match(group, h2); m; m &= m - 1) {
+        size_t index = (pos + FirstByte(m & -m)) & mask;
+        if (ctrl_[index] == h2 && slots_[index].first == key) return index;
+      }
+      if (MatchEmpty(group)) break;
+      pos = (pos + kGroupWidth) & mask;
+    }
+    return capacity_;
+  }
+
+  V& At(const K& key) {
+    size_t index = Find(key);
+    if (index == capacity_) throw std::out_of_range("FlatMap::at");
+    return slots_[index].second;
+  }
+  template <typename Q>
+  V& At(const Q& key) {
+    size_t index = Find(key);
+    if (index == capacity_) throw std::out_of_range("FlatMap::at");
+    return slots_[index].second;
+  }
+
+  template <typename A, typename... Args>
+  std::pair<iterator, bool> Emplace(A&& key, Args&&... args) {
+    size_t hash = Hash()(key);
+    size_t index = Find(key, hash);
+    if (index != capacity_) return {iterator(this, index), false};
+    index = PrepareInsert(hash);
+    new (&slots_[index]) value_type(std::piecewise_construct,
+                                    std::forward_as_tuple(std::forward<A>(key)),
+                                    std::forward_as_tuple(
+                                        std::forward<Args>(args)...));
+    return {iterator(this, index), true};
+  }
+
+  // Returns the slot for a new entry with the given hash, growing the table
+  // if needed, and marks it as used.
+  size_t PrepareInsert(size_t hash) {
+    if (growth_left_ == 0) {
+      // Erased slots are only reclaimed by rehashing; if they are many, the
+      // table does not need to grow.
+      Rehash(capacity_ == 0                      ? kGroupWidth
+             : size_ < capacity_ * 7 / 16 ? capacity_
+                                                 : capacity_ * 2);
+    }
+    size_t mask = capacity_ - 1;
+    size_t pos = H1(hash) & mask;
+    while (true) {
+      uint64_t free = MatchFree(Group(pos));
+      if (free) {
+        size_t index = (pos + FirstByte(free & -free)) & mask;
+        if (ctrl_[index] == kEmpty) growth_left_--;
+        SetCtrl(index, H2(hash));
+        size_++;
+        return index;
+      }
+      pos = (pos + kGroupWidth) & mask;
+    }
+  }
+
+  void EraseAt(size_t index) {
+    slots_[index].~value_type();
+    SetCtrl(index, kDeleted);
+    size_--;
+  }
+
+  size_t NextFull(size_t index) const {
+    while (index < capacity_ && ctrl_[index] < 0) index++;
+    return index;
+  }
+
+  void Rehash(size_t capacity) {
+    FlatMap old;
+    old.Take(*this);
+    ctrl_ = new int8_t[capacity + kGroupWidth];
+    std::memset(ctrl_, uint8_t(kEmpty), capacity + kGroupWidth);
+    slots_ = std::allocator<value_type>().allocate(capacity);
+    capacity_ = capacity;
+    growth_left_ = capacity * 7 / 8;
+    for (size_t i = 0; i < old.capacity_; i++) {
+      if (old.ctrl_[i] < 0) continue;
+      auto& entry = old.slots_[i];
+      size_t index = PrepareInsert(Hash()(entry.first));
+      new (&slots_[index]) value_type(std::move(entry));
+    }
+  }
+
+  void Take(FlatMap& other) {
+    ctrl_ = std::exchange(other.ctrl_, nullptr);
+    slots_ = std::exchange(other.slots_, nullptr);
+    capacity_ = std::exchange(other.capacity_, 0);
+    size_ = std::exchange(other.size_, 0);
+    growth_left_ = std::exchange(other.growth_left_, 0);
+  }
+
+  void Release() {
+    if (!capacity_) return;
+    for (size_t i = 0; i < capacity_; i++) {
+      if (ctrl_[i] >= 0) slots_[i].~value_type();
+    }
+    std::allocator<value_type>().deallocate(slots_, capacity_);
+    delete[] ctrl_;
+  }
+
+  int8_t* ctrl_ = nullptr;
+  value_type* slots_ = nullptr;
+  size_t capacity_ = 0;
+  size_t size_ = 0;
+  // Empty slots that can still be used before the table must grow.
+  size_t growth_left_ = 0;
+};
+
+// Set counterpart of FlatMap.
+template <typename K, typename Hash = FlatHash<K>>
+class FlatSet {
+  struct Unit {};
+  using Map = FlatMap<K, Unit, Hash>;
+
+ public:
+  class const_iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = K;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const K*;
+    using reference = const K&;
+
+    const_iterator() = default;
+    explicit const_iterator(typename Map::const_iterator it) : it_(it) {}
+    reference operator*() const { return it_->first; }
+    pointer operator->() const { return &it_->first; }
+    const_iterator& operator++() {
+      ++it_;
+      return *this;
+    }
+    bool operator==(const const_iterator& o) const { return it_ == o.it_; }
+    bool operator!=(const const_iterator& o) const { return it_ != o.it_; }
+
+   private:
+    typename Map::const_iterator it_;
+  };
+  using iterator = const_iterator;
+
+  size_t size() const { return map_.size(); }
+  bool empty() const { return map_.empty(); }
+  const_iterator begin() const { return const_iterator(map_.begin()); }
+  const_iterator end() const { return const_iterator(map_.end()); }
+
+  std::pair<const_iterator, bool> emplace(K key) {
+    auto r = map_.emplace(std::move(key));
+    return {const_iterator(r.first), r.second};
+  }
+  std::pair<const_iterator, bool> insert(K key) {
+    return emplace(std::move(key));
+  }
+  size_t count(const K& key) const { return map_.count(key); }
+  const_iterator find(const K& key) const {
+    return const_iterator(map_.find(key));
+  }
+  size_t erase(const K& key) { return map_.erase(key); }
+  void clear() { map_.clear(); }
+  void reserve(size_t n) { map_.reserve(n); }
+
+ private:
+  Map map_;
+};
+
+}  // namespace util
+}  // namespace db
@@ -1,22 +1,483 @@
 #pragma once
 #include <nlohmann/json.hpp>
+#include <algorithm>
+#include <charconv>
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 #include "util/time.hpp"
 
 namespace db {
 using json = nlohmann::json;
 
+// Writes JSON text directly into a string, without building a json value.
+// The output is the same as json::dump(), except that strings are not
+// checked to be valid UTF-8.
+class JsonWriter {
+ public:
+  explicit JsonWriter(std::string& out) : out_(out) {}
+
+  void BeginObject() {
+    Separator();
+    out_ += '{';
+    first_.push_back(true);
+  }
+  void EndObject() {
+    out_ += '}';
+    first_.pop_back();
+  }
+  void BeginArray() {
+    Separator();
+    out_ += '[';
+    first_.push_back(true);
+  }
+  void EndArray() {
+    out_ += ']';
+    first_.pop_back();
+  }
+  void Key(std::string_view k) {
+    Separator();
+    Escape(k);
+    out_ += ':';
+    after_key_ = true;
+  }
+
+  void Null() {
+    Separator();
+    out_ += "null";
+  }
+  void Bool(bool v) {
+    Separator();
+    out_ += v ? "true" : "false";
+  }
+  template <typename T>
+  void Integer(T v) {
+    Separator();
+    char buf[24];
+    auto res = std::to_chars(buf, buf + sizeof(buf), v);
+    out_.append(buf, res.ptr);
+  }
+  void Double(double v) {
+    Separator();
+    out_ += json(v).dump();
+  }
+  void String(std::string_view v) {
+    Separator();
+    Escape(v);
+  }
+  void Json(const json& v) {
+    Separator();
+    out_ += v.dump();
+  }
+  // Appends an already encoded value.
+  void Raw(std::string_view v) {
+    Separator();
+    out_.append(v.data(), v.size());
+  }
+
+ private:
+  void Separator() {
+    if (after_key_) {
+      after_key_ = false;
+      return;
+    }
+    if (first_.empty()) return;
+    if (!first_.back()) out_ += ',';
+    first_.back() = false;
+  }
+
+  void Escape(std::string_view v) {
+    static const char* const kHex = "0123456789abcdef";
+    out_ += '"';
+    for (char c : v) {
+      switch (c) {
+        case '"':
+          out_ += "\\\"";
+          break;
+        case '\\':
+          out_ += "\\\\";
+          break;
+        case '\b':
+          out_ += "\\b";
+          break;
+        case '\f':
+          out_ += "\\f";
+          break;
+        case '\n':
+          out_ += "\\n";
+          break;
+        case '\r':
+          out_ += "\\r";
+          break;
+        case '\t':
+          out_ += "\\t";
+          break;
+        default:
+          if (static_cast<unsigned char>(c) < 0x20) {
+            out_ += "\\u00";
+            out_ += kHex[c >> 4];
+            out_ += kHex[c & 0xF];
+          } else {
+            out_ += c;
+          }
+      }
+    }
+    out_ += '"';
+  }
+
+  std::string& out_;
+  std::vector<bool> first_;
+  bool after_key_ = false;
+};
+
+// Pull parser that reads JSON text in place, without building a json value.
+class JsonReader {
+ public:
+  enum class Type { kNull, kBool, kNumber, kString, kArray, kObject };
+
+  explicit JsonReader(std::string_view text)
+      : pos_(text.data()), end_(text.data() + text.size()) {}
+
+  Type Peek() {
+    SkipSpace();
+    if (pos_ == end_) Fail();
+    switch (*pos_) {
+      case 'n':
+        return Type::kNull;
+      case 't':
+      case 'f':
+        return Type::kBool;
+      case '"':
+        return Type::kString;
+      case '[':
+        return Type::kArray;
+      case '{':
+        return Type::kObject;
+      default:
+        return Type::kNumber;
+    }
+  }
+
+  void Null() {
+    SkipSpace();
+    Literal("null");
+  }
+
+  bool Bool() {
+    SkipSpace();
+    if (pos_ != end_ && *pos_ == 't') {
+      Literal("true");
+      return true;
+    }
+    Literal("false");
+    return false;
+  }
+
+  template <typename T>
+  T Number() {
+    if (Peek() != Type::kNumber) Fail();
+    const char* start = pos_;
+    bool integral = true;
+    while (pos_ != end_ && IsNumberChar(*pos_)) {
+      if (*pos_ == '.' || *pos_ == 'e' || *pos_ == 'E') integral = false;
+      pos_++;
+    }
+    if constexpr (std::is_integral_v<T>) {
+      if (integral) {
+        T v;
+        auto res = std::from_chars(start, pos_, v);
+        if (res.ec != std::errc() || res.ptr != pos_) Fail();
+        return v;
+      }
+    }
+    double v;
+    auto res = std::from_chars(start, pos_, v);
+    if (res.ec != std::errc() || res.ptr != pos_) Fail();
+    return static_cast<T>(v);
+  }
+
+  std::string String() {
+    SkipSpace();
+    Expect('"');
+    std::string out;
+    while (true) {
+      const char* run = pos_;
+      while (pos_ != end_ && *pos_ != '"' && *pos_ != '\\') pos_++;
+      out.append(run, pos_);
+      if (pos_ == end_) Fail();
+      if (*pos_++ == '"') return out;
+      if (pos_ == end_) Fail();
+      char c = *pos_++;
+      switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+          out += c;
+          break;
+        case 'b':
+          out += '\b';
+          break;
+        case 'f':
+          out += '\f';
+          break;
+        case 'n':
+          out += '\n';
+          break;
+        case 'r':
+          out += '\r';
+          break;
+        case 't':
+          out += '\t';
+          break;
+        case 'u':
+          AppendUtf8(CodePoint(), out);
+          break;
+        default:
+          Fail();
+      }
+    }
+  }
+
+  // Array elements are read with NextElement() before each of them, which
+  // returns false (and consumes the closing bracket) at the end.
+  void BeginArray() {
+    SkipSpace();
+    Expect('[');
+    first_ = true;
+  }
+  bool NextElement() { return Next(']'); }
+
+  // Same for objects, with NextKey() reading the key of each member.
+  void BeginObject() {
+    SkipSpace();
+    Expect('{');
+    first_ = true;
+  }
+  bool NextKey(std::string& key) {
+    if (!Next('}')) return false;
+    key = String();
+    SkipSpace();
+    Expect(':');
+    return true;
+  }
+
+  // Skips a value, and returns its text.
+  std::string_view Skip() {
+    SkipSpace();
+    const char* start = pos_;
+    switch (Peek()) {
+      case Type::kNull:
+        Null();
+        break;
+      case Type::kBool:
+        Bool();
+        break;
+      case Type::kNumber:
+        SkipNumber();
+        break;
+      case Type::kString:
+        SkipString();
+        break;
+      case Type::kArray:
+        BeginArray();
+        while (NextElement()) Skip();
+        break;
+      case Type::kObject:
+        BeginObject();
+        while (Next('}')) {
+          SkipSpace();
+          SkipString();
+          SkipSpace();
+          Expect(':');
+          Skip();
+        }
+        break;
+    }
+    first_ = false;
+    return std::string_view(start, pos_ - start);
+  }
+
+  // Reads any value, for members without a direct parser.
+  json Value() { return json::parse(Skip()); }
+
+  bool Done() {
+    SkipSpace();
+    return pos_ == end_;
+  }
+
+ private:
+  [[noreturn]] static void Fail() {
+    throw std::runtime_error("Invalid deserialized data!");
+  }
+
+  static bool IsNumberChar(char c) {
+    return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+           c == 'e' || c == 'E';
+  }
+
+  void SkipSpace() {
+    while (pos_ != end_ &&
+           (*pos_ == ' ' || *pos_ == '\t' || *pos_ == '\n' || *pos_ == '\r')) {
+      pos_++;
+    }
+  }
+
+  void Expect(char c) {
+    if (pos_ == end_ || *pos_ != c) Fail();
+    pos_++;
+  }
+
+  void Literal(std::string_view l) {
+    if (size_t(end_ - pos_) < l.size() ||
+        std::string_view(pos_, l.size()) != l) {
+      Fail();
+    }
+    pos_ += l.size();
+  }
+
+  // Consumes the separator before the next element, or the closing bracket.
+  // first_ is only valid right after BeginArray/BeginObject, as nested
+  // values are always fully read or skipped before the next call.
+  bool Next(char close) {
+    SkipSpace();
+    if (pos_ != end_ && *pos_ == close) {
+      pos_++;
+      first_ = false;
+      return false;
+    }
+    if (!first_) Expect(',');
+    first_ = false;
+    return true;
+  }
+
+  void SkipString() {
+    Expect('"');
+    while (pos_ != end_ && *pos_ != '"') {
+      if (*pos_ == '\\') pos_++;
+      if (pos_ != end_) pos_++;
+    }
+    Expect('"');
+  }
+
+  // Numbers are only checked against the grammar, as skipped ones may not
+  // fit in a double, like 1e999.
+  void SkipNumber() {
+    auto digits = [this]() {
+      const char* start = pos_;
+      while (pos_ != end_ && *pos_ >= '0' && *pos_ <= '9') pos_++;
+      if (pos_ == start) Fail();
+    };
+    if (pos_ != end_ && *pos_ == '-') pos_++;
+    if (pos_ != end_ && *pos_ == '0') {
+      pos_++;
+    } else {
+      digits();
+    }
+    if (pos_ != end_ && *pos_ == '.') {
+      pos_++;
+      digits();
+    }
+    if (pos_ != end_ && (*pos_ == 'e' || *pos_ == 'E')) {
+      pos_++;
+      if (pos_ != end_ && (*pos_ == '+' || *pos_ == '-')) pos_++;
+      digits();
+    }
+  }
+
+  uint32_t Hex4() {
+    if (end_ - pos_ < 4) Fail();
+    uint32_t v;
+    auto res = std::from_chars(pos_, pos_ + 4, v, 16);
+    if (res.ec != std::errc() || res.ptr != pos_ + 4) Fail();
+    pos_ += 4;
+    return v;
+  }
+
+  uint32_t CodePoint() {
+    uint32_t cp = Hex4();
+    if (cp >= 0xD800 && cp < 0xDC00) {
+      Literal("\\u");
+      uint32_t low = Hex4();
+      if (low < 0xDC00 || low >= 0xE000) Fail();
+      cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+    }
+    return cp;
+  }
+
+  static void AppendUtf8(uint32_t cp, std::string& out) {
+    if (cp < 0x80) {
+      out += char(cp);
+    } else if (cp < 0x800) {
+      out += char(0xC0 | (cp >> 6));
+      out += char(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+      out += char(0xE0 | (cp >> 12));
+      out += char(0x80 | ((cp >> 6) & 0x3F));
+      out += char(0x80 | (cp & 0x3F));
+    } else {
+      out += char(0xF0 | (cp >> 18));
+      out += char(0x80 | ((cp >> 12) & 0x3F));
+      out += char(0x80 | ((cp >> 6) & 0x3F));
+      out += char(0x80 | (cp & 0x3F));
+    }
+  }
+
+  const char* pos_;
+  const char* end_;
+  bool first_ = false;
+};
+
+// Returns the text of the members of the JSON object in text with the given
+// names, and throws if one is missing. Other members are skipped.
+template <size_t N>
+std::array<std::string_view, N> SplitJsonObject(
+    std::string_view text, const std::array<const char*, N>& names) {
+  std::array<std::string_view, N> fields;
+  std::array<bool, N> found = {};
+  JsonReader in(text);
+  in.BeginObject();
+  std::string key;
+  while (in.NextKey(key)) {
+    std::string_view value = in.Skip();
+    for (size_t i = 0; i < N; i++) {
+      if (key == names[i]) {
+        fields[i] = value;
+        found[i] = true;
+        break;
+      }
+    }
+  }
+  if (!in.Done()) throw std::runtime_error("Invalid deserialized data!");
+  for (bool f : found) {
+    if (!f) throw std::runtime_error("Invalid deserialized data!");
+  }
+  return fields;
+}
+
 template <typename T, typename = void>
 struct FromJson;
 
 template <typename T>
 struct FromJson<T, std::enable_if_t<std::is_arithmetic_v<T>>> {
   T operator()(const json& j) const { return j; }
+  T operator()(JsonReader& in) const {
+    if constexpr (std::is_same_v<T, bool>) {
+      return in.Bool();
+    } else {
+      return in.Number<T>();
+    }
+  }
 };
 
 template <>
 struct FromJson<std::string> {
   std::string operator()(const json& j) const { return j; }
+  std::string operator()(JsonReader& in) const { return in.String(); }
 };
 
 // TODO: generalize to different containers?
@@ -29,6 +490,19 @@ struct FromJson<std::vector<T>> {
     }
     return res;
   }
+  // Empty collections may be written as null.
+  std::vector<T> operator()(JsonReader& in) {
+    std::vector<T> res;
+    if (in.Peek() == JsonReader::Type::kNull) {
+      in.Null();
+      return res;
+    }
+    in.BeginArray();
+    while (in.NextElement()) {
+      res.push_back(FromJson<T>()(in));
+    }
+    return res;
+  }
 };
 
 template <typename T>
@@ -40,6 +514,18 @@ struct FromJson<std::unordered_set<T>> {
     }
     return res;
   }
+  std::unordered_set<T> operator()(JsonReader& in) {
+    std::unordered_set<T> res;
+    if (in.Peek() == JsonReader::Type::kNull) {
+      in.Null();
+      return res;
+    }
+    in.BeginArray();
+    while (in.NextElement()) {
+      res.emplace(FromJson<T>()(in));
+    }
+    return res;
+  }
 };
 
 template <typename T, typename U>
@@ -51,11 +537,25 @@ struct FromJson<std::unordered_map<T, U>> {
     }
     return res;
   }
+  std::unordered_map<T, U> operator()(JsonReader& in) {
+    std::unordered_map<T, U> res;
+    if (in.Peek() == JsonReader::Type::kNull) {
+      in.Null();
+      return res;
+    }
+    in.BeginObject();
+    std::string key;
+    while (in.NextKey(key)) {
+      res.emplace(key, FromJson<U>()(in));
+    }
+    return res;
+  }
 };
 
 template <>
 struct FromJson<json> {
   json operator()(const json& j) { return j; }
+  json operator()(JsonReader& in) { return in.Value(); }
 };
 
 template <>
@@ -63,19 +563,43 @@ struct FromJson<::util::tm_time_t> {
   util::tm_time_t operator()(const json& j) {
     return util::FromTimestamp(j.get<double>());
   }
+  util::tm_time_t operator()(JsonReader& in) {
+    return util::FromTimestamp(in.Number<double>());
+  }
 };
 
+// Reads a value that takes the whole of text.
+template <typename T>
+T ParseJson(std::string_view text) {
+  JsonReader in(text);
+  T v = FromJson<T>()(in);
+  if (!in.Done()) throw std::runtime_error("Invalid deserialized data!");
+  return v;
+}
+
 template <typename T, typename = void>
 struct ToJson;
 
 template <typename T>
 struct ToJson<T, std::enable_if_t<std::is_arithmetic_v<T>>> {
   json operator()(const T& j) const { return j; }
+  void operator()(const T& j, JsonWriter& out) const {
+    if constexpr (std::is_same_v<T, bool>) {
+      out.Bool(j);
+    } else if constexpr (std::is_integral_v<T>) {
+      out.Integer(j);
+    } else {
+      out.Double(j);
+    }
+  }
 };
 
 template <>
 struct ToJson<std::string> {
   json operator()(const std::string& j) const { return j; }
+  void operator()(const std::string& j, JsonWriter& out) const {
+    out.String(j);
+  }
 };
 
 // TODO: generalize to different containers?
@@ -88,6 +612,15 @@ struct ToJson<std::vector<T>> {
     }
     return res;
   }
+  // Empty collections are null, as with the json overload.
+  void operator()(const std::vector<T>& j, JsonWriter& out) {
+    if (j.empty()) return out.Null();
+    out.BeginArray();
+    for (const auto& v : j) {
+      ToJson<T>()(v, out);
+    }
+    out.EndArray();
+  }
 };
 
 template <typename T>
@@ -99,6 +632,15 @@ struct ToJson<std::unordered_set<T>> {
     }
     return res;
   }
+  // Empty collections are null, as with the json overload.
+  void operator()(const std::unordered_set<T>& j, JsonWriter& out) {
+    if (j.empty()) return out.Null();
+    out.BeginArray();
+    for (const auto& v : j) {
+      ToJson<T>()(v, out);
+    }
+    out.EndArray();
+  }
 };
 
 template <typename T, typename U>
@@ -110,16 +652,35 @@ struct ToJson<std::unordered_map<T, U>> {
     }
     return res;
   }
+  // Keys are sorted, as in json objects.
+  void operator()(const std::unordered_map<T, U>& j, JsonWriter& out) {
+    if (j.empty()) return out.Null();
+    std::vector<const std::pair<const T, U>*> sorted;
+    sorted.reserve(j.size());
+    for (const auto& kv : j) sorted.push_back(&kv);
+    std::sort(sorted.begin(), sorted.end(),
+              [](const auto* a, const auto* b) { return a->first < b->first; });
+    out.BeginObject();
+    for (const auto* kv : sorted) {
+      out.Key(kv->first);
+      ToJson<U>()(kv->second, out);
+    }
+    out.EndObject();
+  }
 };
 
 template <>
 struct ToJson<json> {
   json operator()(const json& j) { return j; }
+  void operator()(const json& j, JsonWriter& out) { out.Json(j); }
 };
 
 template <>
 struct ToJson<::util::tm_time_t> {
   json operator()(const ::util::tm_time_t t) { return util::ToTimestamp(t); }
+  void operator()(const ::util::tm_time_t t, JsonWriter& out) {
+    out.Double(util::ToTimestamp(t));
+  }
 };
 
 }  // namespace db
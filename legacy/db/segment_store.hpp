@@ -0,0 +1,381 @@
+#pragma once
+#include <kj/debug.h>
+#include <kj/filesystem.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "db/binary.hpp"
+
+namespace db {
+namespace storage {
+
+// Keeps the files of many objects as records of a few large append-only
+// segment files, so that writing an object creates no file, and loading a
+// database reads a few files sequentially. An in-memory index maps each file
+// to its records: the last snapshot, and the log records that follow it.
+//
+// Records are length-prefixed, and made of their kind, the name of their file
+// and its contents. Records that are no longer indexed are garbage: once most
+// of the sealed segments is garbage, they are merged into one that only has
+// the live records, in the same order, and that takes the place of the newest
+// of them. This happens on a background thread, unless it is disabled, and
+// on Compact().
+class SegmentStore {
+ public:
+  explicit SegmentStore(kj::Own<const kj::Directory> dir,
+                        size_t segment_size = 64 << 20,
+                        bool background_compaction = true)
+      : dir_(std::move(dir)), segment_size_(segment_size) {
+    std::vector<uint64_t> ids;
+    for (const auto& e : dir_->listEntries()) {
+      std::string name(e.name.cStr());
+      if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) {
+        // Output of an interrupted compaction.
+        dir_->tryRemove(kj::Path({e.name.cStr()}));
+      } else if (name.size() > 4 &&
+                 name.compare(name.size() - 4, 4, ".seg") == 0) {
+        ids.push_back(std::stoull(name));
+      }
+    }
+    std::sort(ids.begin(), ids.end());
+    for (uint64_t id : ids) Scan(id);
+    if (ids.empty()) {
+      active_ = 1;
+      Create(active_);
+    } else {
+      active_ = ids.back();
+    }
+    if (background_compaction) thread_ = std::thread([this]() { Run(); });
+  }
+  SegmentStore(const SegmentStore&) = delete;
+  SegmentStore& operator=(const SegmentStore&) = delete;
+
+  ~SegmentStore() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) thread_.join();
+  }
+
+  // Writes are only durable after Sync().
+  void Snapshot(const std::string& name, std::string_view data) {
+    Write(kSnapshot, name, data);
+  }
+
+  void Append(const std::string& name, std::string_view lines) {
+    Write(kLog, name, lines);
+  }
+
+  void Sync() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    SyncLocked();
+  }
+
+  // Returns false if there is no file called name. The log is the
+  // concatenation of the logged records, and is null if there are none.
+  bool Read(const std::string& name, std::optional<std::string>& snapshot,
+            std::optional<std::string>& log) const {
+    std::vector<std::pair<std::shared_ptr<const kj::File>, Loc>> parts;
+    bool has_snapshot;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = index_.find(name);
+      if (it == index_.end()) return false;
+      const Entry& e = it->second;
+      has_snapshot = e.has_snapshot;
+      if (has_snapshot) {
+        parts.emplace_back(segments_.at(e.snapshot.segment).file, e.snapshot);
+      }
+      for (const Loc& l : e.log) {
+        parts.emplace_back(segments_.at(l.segment).file, l);
+      }
+    }
+    // Sealed segments are never modified, and the active one only grows, so
+    // records can be read without holding the lock.
+    size_t i = 0;
+    if (has_snapshot) {
+      snapshot = ReadLoc(*parts[0].first, parts[0].second);
+      i = 1;
+    }
+    if (i < parts.size()) log.emplace();
+    for (; i < parts.size(); i++) {
+      *log += ReadLoc(*parts[i].first, parts[i].second);
+    }
+    return true;
+  }
+
+  // Merges the sealed segments, leaving out the garbage.
+  void Compact() {
+    std::lock_guard<std::mutex> compact_lock(compact_mutex_);
+    struct Move {
+      const std::string* name;
+      uint64_t kind;
+      Loc from;
+      Loc to;
+    };
+    std::vector<Move> moves;
+    std::map<uint64_t, std::shared_ptr<const kj::File>> inputs;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (const auto& [id, s] : segments_) {
+        if (id != active_) inputs.emplace(id, s.file);
+      }
+      if (inputs.empty()) return;
+      // Index entries are never removed, so names stay valid.
+      for (const auto& [name, e] : index_) {
+        if (e.has_snapshot && inputs.count(e.snapshot.segment)) {
+          moves.push_back(Move{&name, kSnapshot, e.snapshot, {}});
+        }
+        for (const Loc& l : e.log) {
+          if (inputs.count(l.segment)) {
+            moves.push_back(Move{&name, kLog, l, {}});
+          }
+        }
+      }
+    }
+    // Only sealed segments are read, so the lock is not needed.
+    uint64_t last = inputs.rbegin()->first;
+    kj::Path tmp({(FileName(last) + ".tmp").c_str()});
+    auto own = dir_->openFile(tmp, kj::WriteMode::CREATE |
+                                       kj::WriteMode::MODIFY);
+    own->truncate(0);
+    std::shared_ptr<const kj::File> file = Share(std::move(own));
+    Segment merged{file, 0, 0, 0};
+    for (auto& m : moves) {
+      std::string data = ReadLoc(*inputs.at(m.from.segment), m.from);
+      m.to = Append(merged, last, m.kind, *m.name, data);
+    }
+    file->datasync();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::map<std::pair<uint64_t, uint64_t>, Loc> moved;
+    for (const auto& m : moves) {
+      moved.emplace(std::make_pair(m.from.segment, m.from.offset), m.to);
+    }
+    auto update = [&](Loc& l) {
+      auto it = moved.find(std::make_pair(l.segment, l.offset));
+      if (it == moved.end()) return;
+      l = it->second;
+      merged.live += l.size;
+    };
+    const std::string* previous = nullptr;
+    for (const auto& m : moves) {
+      if (m.name == previous) continue;
+      previous = m.name;
+      Entry& e = index_.at(*m.name);
+      if (e.has_snapshot) update(e.snapshot);
+      for (Loc& l : e.log) update(l);
+    }
+    dir_->transfer(kj::Path({FileName(last).c_str()}), kj::WriteMode::MODIFY,
+                   tmp, kj::TransferMode::MOVE);
+    for (const auto& [id, f] : inputs) {
+      if (id != last) dir_->tryRemove(kj::Path({FileName(id).c_str()}));
+      segments_.erase(id);
+    }
+    segments_.emplace(last, std::move(merged));
+    dir_->sync();
+    compaction_failed_ = false;
+  }
+
+  size_t SegmentCount() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return segments_.size();
+  }
+
+ private:
+  static const constexpr uint64_t kSnapshot = 0;
+  static const constexpr uint64_t kLog = 1;
+
+  // Location of the contents of a record.
+  struct Loc {
+    uint64_t segment;
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  struct Entry {
+    bool has_snapshot = false;
+    Loc snapshot;
+    std::vector<Loc> log;
+  };
+
+  struct Segment {
+    std::shared_ptr<const kj::File> file;
+    uint64_t size;
+    // Sizes of the contents of all records, and of the indexed ones.
+    uint64_t data;
+    uint64_t live;
+  };
+
+  static std::string FileName(uint64_t id) {
+    char name[32];
+    snprintf(name, sizeof(name), "%010llu.seg", (unsigned long long)id);
+    return name;
+  }
+
+  static std::shared_ptr<const kj::File> Share(kj::Own<const kj::File> file) {
+    auto own = std::make_shared<kj::Own<const kj::File>>(std::move(file));
+    return std::shared_ptr<const kj::File>(own, own->get());
+  }
+
+  static std::string ReadLoc(const kj::File& file, const Loc& loc) {
+    std::string data(loc.size, '\0');
+    size_t n = file.read(
+        loc.offset,
+        kj::ArrayPtr<kj::byte>(reinterpret_cast<kj::byte*>(&data[0]),
+                               data.size()));
+    KJ_REQUIRE(n == loc.size, "truncated segment");
+    return data;
+  }
+
+  // Writes a record at the end of segment, which has the given id.
+  static Loc Append(Segment& segment, uint64_t id, uint64_t kind,
+                    const std::string& name, std::string_view data) {
+    std::string header;
+    binary::PutVarint(header, kind);
+    binary::PutLengthPrefixed(header, name);
+    std::string record;
+    binary::PutVarint(record, header.size() + data.size());
+    record += header;
+    record.append(data.data(), data.size());
+    segment.file->write(
+        segment.size,
+        kj::ArrayPtr<const kj::byte>(
+            reinterpret_cast<const kj::byte*>(record.data()), record.size()));
+    Loc loc{id, segment.size + record.size() - data.size(), data.size()};
+    segment.size += record.size();
+    segment.data += data.size();
+    return loc;
+  }
+
+  void Create(uint64_t id) {
+    segments_.emplace(
+        id, Segment{Share(dir_->openFile(kj::Path({FileName(id).c_str()}),
+                                         kj::WriteMode::CREATE)),
+                    0, 0, 0});
+    dir_->sync();
+  }
+
+  // Adds the records of a segment to the index. An incomplete last record
+  // (i.e. an interrupted write) is dropped.
+  void Scan(uint64_t id) {
+    auto file = Share(dir_->openFile(kj::Path({FileName(id).c_str()}),
+                                     kj::WriteMode::MODIFY));
+    Segment& segment =
+        segments_.emplace(id, Segment{file, 0, 0, 0}).first->second;
+    auto bytes = file->readAllBytes();
+    std::string_view all(reinterpret_cast<const char*>(bytes.begin()),
+                         bytes.size());
+    binary::Reader r(all);
+    std::string_view record;
+    while (r.TryLengthPrefixed(record)) {
+      uint64_t end = all.size() - r.Remaining();
+      binary::Reader fields(record);
+      uint64_t kind = fields.Varint();
+      std::string name(fields.LengthPrefixed());
+      uint64_t size = fields.Remaining();
+      Apply(kind, name, Loc{id, end - size, size});
+      segment.data += size;
+    }
+    segment.size = all.size() - r.Remaining();
+    if (segment.size != all.size()) file->truncate(segment.size);
+  }
+
+  void Apply(uint64_t kind, const std::string& name, const Loc& loc) {
+    Entry& e = index_[name];
+    if (kind == kSnapshot) {
+      if (e.has_snapshot) Drop(e.snapshot);
+      for (const Loc& l : e.log) Drop(l);
+      e.has_snapshot = true;
+      e.snapshot = loc;
+      e.log.clear();
+    } else {
+      e.log.push_back(loc);
+    }
+    segments_.at(loc.segment).live += loc.size;
+  }
+
+  void Drop(const Loc& loc) { segments_.at(loc.segment).live -= loc.size; }
+
+  void Write(uint64_t kind, const std::string& name, std::string_view data) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Segment& active = segments_.at(active_);
+    Loc loc = Append(active, active_, kind, name, data);
+    dirty_ = true;
+    Apply(kind, name, loc);
+    if (active.size >= segment_size_) {
+      // Sealed segments are always durable.
+      SyncLocked();
+      Create(++active_);
+    }
+    bool compact = NeedsCompaction();
+    lock.unlock();
+    if (compact) cv_.notify_one();
+  }
+
+  void SyncLocked() {
+    if (!dirty_) return;
+    segments_.at(active_).file->datasync();
+    dirty_ = false;
+  }
+
+  // True if most of the sealed segments is garbage.
+  bool NeedsCompaction() const {
+    if (compaction_failed_) return false;
+    uint64_t data = 0, live = 0;
+    for (const auto& [id, s] : segments_) {
+      if (id == active_) continue;
+      data += s.data;
+      live += s.live;
+    }
+    return data > 2 * live;
+  }
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this]() { return stop_ || NeedsCompaction(); });
+      if (stop_) return;
+      lock.unlock();
+      bool failed = false;
+      try {
+        Compact();
+      } catch (...) {
+        failed = true;
+      }
+      lock.lock();
+      // Background compaction stops until Compact() succeeds.
+      if (failed) compaction_failed_ = true;
+    }
+  }
+
+  kj::Own<const kj::Directory> dir_;
+  size_t segment_size_;
+  mutable std::mutex mutex_;
+  // Held by Compact(), which runs without holding mutex_ for most of its
+  // work.
+  std::mutex compact_mutex_;
+  std::condition_variable cv_;
+  std::map<uint64_t, Segment> segments_;
+  uint64_t active_ = 0;
+  std::unordered_map<std::string, Entry> index_;
+  bool dirty_ = false;
+  bool compaction_failed_ = false;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+}  // namespace storage
+}  // namespace db
@@ -1,8 +1,15 @@
 #pragma once
 #include <kj/filesystem.h>
+#include <array>
+#include <memory>
+#include <string>
+#include <string_view>
 #include <tuple>
 #include <utility>
+#include "db/binary.hpp"
+#include "db/callback_table.hpp"
 #include "db/json.hpp"
+#include "db/storage.hpp"
 #include "db/util.hpp"
 #include "db/value.hpp"
 
@@ -20,8 +27,7 @@
                                                                                \
     template <typename... Args>                                                \
     name_##_m(Args... args) : name_##_priv(std::move(args)...) {}              \
-    name_##_m(util::JsonConstructorTag(),                                      \
-              kj::Maybe<kj::Own<const kj::Directory>>&& dir, T* parent,        \
+    name_##_m(util::JsonConstructorTag(), util::Dir&& dir, T* parent,          \
               const json& j)                                                   \
         : name_##_priv(util::JsonConstructorTag(), std::move(dir), json_name_, \
                        parent, j) {}                                           \
@@ -75,6 +81,26 @@ struct member_ref<db::Value<U, T>, std::enable_if_t<T::kIsSubObject>> {
   using type = T&;
 };
 
+// Holds the parent pointer of a Data. This is a base class rather than a
+// member so that it is already set while the members are constructed, as
+// their initial commit walks up the parents to find the storage options.
+template <typename U>
+class DataParent {
+ protected:
+  DataParent(U* parent, const storage::Options&) : parent_(parent) {}
+  U* parent_;
+};
+
+// The root of the tree also holds the storage options of the database.
+template <>
+class DataParent<void> {
+ protected:
+  DataParent(void* parent, const storage::Options& storage)
+      : parent_(parent), storage_(storage) {}
+  void* parent_;
+  storage::Options storage_;
+};
+
 template <typename U, typename... Args>
 class DataEditor : public Args... {
   template <typename T>
@@ -101,6 +127,7 @@ class DataEditor : public Args... {
     autocommit_ = other.autocommit_;
     finalized_ = other.finalized_;
     rolled_back_ = other.rolled_back_;
+    changed_ = other.changed_;
     other.finalized_ = true;
     other.rolled_back_ = true;
     other.obj = nullptr;
@@ -108,10 +135,12 @@ class DataEditor : public Args... {
   DataEditor& operator=(DataEditor&& other) {
     ((this->Args::editor_ = std::move((Args&)other)), ...);
     if (this == &other) return *this;
+    if (obj) obj->Pin(false);
     obj = other.obj;
     autocommit_ = other.autocommit_;
     finalized_ = other.finalized_;
     rolled_back_ = other.rolled_back_;
+    changed_ = other.changed_;
     other.finalized_ = true;
     other.rolled_back_ = true;
     other.obj = nullptr;
@@ -123,6 +152,8 @@ class DataEditor : public Args... {
     finalized_ = true;
     size_t done = 0;
     bool fail = false;
+    if (obj) obj->committing_ = true;
+    KJ_DEFER(if (obj) obj->committing_ = false);
     try {
       (TryCommit<Args>(done, fail), ...);
     } catch (...) {
@@ -137,9 +168,10 @@ class DataEditor : public Args... {
       }
     } else {
       KJ_ASSERT(done == sizeof...(Args));
+      changed_ = {this->Args::Changed()...};
       if (obj) {
         try {
-          if (!obj->Commit()) {
+          if (!obj->Commit(&changed_)) {
             try {
               UndoAllCommits(done);
             } catch (std::exception& exc) {
@@ -147,6 +179,7 @@ class DataEditor : public Args... {
             }
             return false;
           } else {
+            obj->NotifyParent();
             return true;
           }
         } catch (std::exception& exc) {
@@ -158,6 +191,13 @@ class DataEditor : public Args... {
     return !fail;
   }
 
+  // Same as Commit, but resolves once the commit is on disk.
+  kj::Promise<bool> CommitAsync() {
+    bool committed = Commit();
+    return storage::WhenCommitted(
+        committed, obj ? obj->Storage() : storage::DefaultOptions());
+  }
+
   void Rollback() {
     KJ_REQUIRE(!rolled_back_);
     rolled_back_ = true;
@@ -170,19 +210,33 @@ class DataEditor : public Args... {
   void UndoCommit() {
     KJ_REQUIRE(finalized_);
     size_t done = sizeof...(Args);
+    if (obj) obj->committing_ = true;
+    KJ_DEFER(if (obj) obj->committing_ = false);
     UndoAllCommits(done);
     if (obj) {
-      obj->UndoCommit();
+      obj->UndoCommit(&changed_);
+      obj->NotifyParent();
+    }
+  }
+
+  // Whether the last commit modified any member.
+  bool Changed() const {
+    for (bool c : changed_) {
+      if (c) return true;
     }
+    return false;
   }
 
   ~DataEditor() {
     if (!finalized_ && autocommit_) Commit();
+    if (obj) obj->Pin(false);
   }
 
   DataEditor(Data<U, Args::template parent_t...>* obj, bool autocommit,
              Args... args)
-      : Args(std::move(args))..., obj(obj), autocommit_(autocommit) {}
+      : Args(std::move(args))..., obj(obj), autocommit_(autocommit) {
+    if (obj) obj->Pin(true);
+  }
 
   friend Data<U, Args::template parent_t...>;
 
@@ -191,15 +245,21 @@ class DataEditor : public Args... {
   bool autocommit_;
   bool finalized_ = false;
   bool rolled_back_ = false;
+  std::array<bool, sizeof...(Args)> changed_ = {};
 };
 
 }  // namespace detail
 
 template <typename U, template <typename T> class... Args>
-class Data : public Args<Data<U, Args...>>... {
+class Data : public detail::DataParent<U>, public Args<Data<U, Args...>>... {
+  using Callbacks = util::CallbackTable<Data>;
+
  public:
   // No move constructor. Use unique pointers.
   Data(Data&&) = delete;
+  ~Data() {
+    if (has_callbacks_) Callbacks::Remove(this);
+  }
 
   template <typename... T>
   class BuilderClass {
@@ -209,7 +269,7 @@ class Data : public Args<Data<U, Args...>>... {
       parent = parent_;
       return std::move(*this);
     }
-    BuilderClass&& SetDir(kj::Maybe<kj::Own<const kj::Directory>> dir_) {
+    BuilderClass&& SetDir(util::Dir dir_) {
       dir = std::move(dir_);
       return std::move(*this);
     }
@@ -217,6 +277,11 @@ class Data : public Args<Data<U, Args...>>... {
       field_name = name_;
       return std::move(*this);
     }
+    // Only used when building the root of the tree.
+    BuilderClass&& SetStorage(storage::Options storage_) {
+      storage = storage_;
+      return std::move(*this);
+    }
     template <size_t N>
     auto& Get() {
       return std::get<N>(args);
@@ -224,8 +289,9 @@ class Data : public Args<Data<U, Args...>>... {
 
     std::tuple<T...> args;
     U* parent = nullptr;
-    kj::Maybe<kj::Own<const kj::Directory>> dir = nullptr;
+    util::Dir dir = nullptr;
     const char* field_name = nullptr;
+    storage::Options storage;
   };
 
   // Workaround for https://gcc.gnu.org/bugzilla/show_bug.cgi?id=79501
@@ -234,17 +300,37 @@ class Data : public Args<Data<U, Args...>>... {
     return BuilderClass<T...>(std::move(t)...);
   }
 
-  Data(util::JsonConstructorTag, kj::Maybe<kj::Own<const kj::Directory>> dir,
-       const char* field_name, U* parent, const json& js)
-      : Args<Data<U, Args...>>(util::JsonConstructorTag(),
+  Data(util::JsonConstructorTag, util::Dir dir,
+       const char* field_name, U* parent, const json& js,
+       const storage::Options& storage = storage::DefaultOptions())
+      : detail::DataParent<U>(parent, storage),
+        Args<Data<U, Args...>>(util::JsonConstructorTag(),
                                util::SubDir(dir, field_name),
                                Args<Data<U, Args...>>::json_name_, this,
                                js.at(Args<Data<U, Args...>>::json_name_))...,
-        dir_(util::SubDir(dir, field_name)),
-        parent_(parent) {}
+        dir_(util::SubDir(dir, field_name)) {}
+
+  Data(util::JsonTextConstructorTag,
+       util::Dir dir, const char* field_name,
+       U* parent, std::string_view text,
+       const storage::Options& storage = storage::DefaultOptions())
+      : Data(util::JsonTextConstructorTag(),
+             std::index_sequence_for<Args<Data>...>(), std::move(dir),
+             field_name, parent,
+             SplitJsonObject(text, std::array<const char*, sizeof...(Args)>{
+                                       Args<Data>::json_name_...}),
+             storage) {}
+
+  Data(util::BinaryConstructorTag, util::Dir dir,
+       const char* field_name, U* parent, std::string_view data,
+       const storage::Options& storage = storage::DefaultOptions())
+      : Data(util::BinaryConstructorTag(),
+             std::index_sequence_for<Args<Data>...>(), std::move(dir),
+             field_name, parent,
+             binary::SplitFields<sizeof...(Args)>(data), storage) {}
 
   template <typename... T>
-  Data(kj::Maybe<kj::Own<const kj::Directory>> dir, const char* field_name,
+  Data(util::Dir dir, const char* field_name,
        U* parent, BuilderClass<T...> builder)
       : Data(std::move(builder.SetDir(std::move(dir))
                            .SetField(field_name)
@@ -252,11 +338,11 @@ class Data : public Args<Data<U, Args...>>... {
 
   template <typename... T, std::size_t... Is>
   Data(std::index_sequence<Is...>, BuilderClass<T...> builder)
-      : Args<Data<U, Args...>>(util::SubDir(builder.dir, builder.field_name),
+      : detail::DataParent<U>(builder.parent, builder.storage),
+        Args<Data<U, Args...>>(util::SubDir(builder.dir, builder.field_name),
                                Args<Data<U, Args...>>::json_name_, this,
                                std::move(builder.template Get<Is>()))...,
-        dir_(util::SubDir(builder.dir, builder.field_name)),
-        parent_(builder.parent) {
+        dir_(util::SubDir(builder.dir, builder.field_name)) {
     Commit();
   }
 
@@ -274,12 +360,44 @@ class Data : public Args<Data<U, Args...>>... {
     return j;
   }
 
-  void SetDir(kj::Maybe<kj::Own<const kj::Directory>>&& dir,
-              const char* field_name) {
-    KJ_IF_MAYBE(d, dir_) {
-      KJ_FAIL_ASSERT("SetDir should only be called when dir is null");
-    }
+  void Serialize(JsonWriter& out) const {
+    out.BeginObject();
+    ((void)(Args<Data<U, Args...>>::value_type_::SkipSerialize ||
+            (out.Key(Args<Data<U, Args...>>::json_name_),
+             this->Args<Data<U, Args...>>::Raw().Serialize(out), true)),
+     ...);
+    out.EndObject();
+  }
+
+  void SerializeBinary(std::string& out) const {
+    SerializeBinaryMembers(out, std::index_sequence_for<Args<Data>...>());
+  }
+
+  // What gets written to disk, which leaves out what sub-objects store by
+  // themselves.
+  void StoreBinary(std::string& out) const {
+    out += Encode(nullptr, storage::Format::kBinary);
+  }
+
+  void Store(JsonWriter& out) const {
+    out.Raw(Encode(nullptr, storage::Format::kJson));
+  }
+
+  // Adds the elements of sub-objects to writer, and encodes in out what the
+  // binary constructor needs to load this object from the snapshot.
+  void BinarySnapshot(storage::BinarySnapshotWriter& writer,
+                      std::string& out) const {
+    BinarySnapshotMembers(writer, out,
+                          std::index_sequence_for<Args<Data>...>());
+  }
+
+  void SetDir(util::Dir&& dir, const char* field_name) {
+    KJ_REQUIRE(!dir_, "SetDir should only be called when dir is null");
     dir_ = util::SubDir(dir, field_name);
+    // Sub-objects created without a directory get one now.
+    (this->Args<Data<U, Args...>>::Raw().SetDir(
+         util::Dir(dir_), Args<Data<U, Args...>>::json_name_),
+     ...);
     Commit();
   }
 
@@ -298,12 +416,12 @@ class Data : public Args<Data<U, Args...>>... {
   DECLARE_OPERATOR(!=);
 
   // Returns true if successful.
-  using callback_t = std::function<bool()>;
+  using callback_t = typename Callbacks::callback_t;
   // Should never fail, as it would leave everything in an inconsistent state.
-  using revert_callback_t = std::function<void()>;
+  using revert_callback_t = typename Callbacks::revert_callback_t;
   void OnChange(callback_t action, revert_callback_t revert = []() {}) {
-    on_commit.push_back(action);
-    on_undo_commit.push_back(revert);
+    Callbacks::Add(this, std::move(action), std::move(revert));
+    has_callbacks_ = true;
   }
 
   friend detail::DataEditor<U, typename Args<Data<U, Args...>>::Editor_...>;
@@ -318,10 +436,67 @@ class Data : public Args<Data<U, Args...>>... {
     return this->T<Data<U, Args...>>::Raw();
   }
 
-  U* Parent() { return parent_; }
-  const U* Parent() const { return parent_; }
+  U* Parent() { return this->parent_; }
+  const U* Parent() const { return this->parent_; }
   using ParentType = U;
 
+  const storage::Options& Storage() const {
+    if constexpr (std::is_void_v<U>) {
+      return this->storage_;
+    } else {
+      if (!this->parent_) return storage::DefaultOptions();
+      return this->parent_->Storage();
+    }
+  }
+
+  // Editors pin the object they edit, and the objects containing it, so that
+  // a LazyContainer does not drop it from memory while they are open.
+  void Pin(bool pin) const {
+    if (pin) {
+      pins_++;
+    } else {
+      pins_--;
+    }
+    if constexpr (!std::is_void_v<U>) {
+      if (this->parent_) this->parent_->Pin(pin);
+    }
+  }
+  bool Pinned() const { return pins_ != 0; }
+
+  // The frame of the buffer pool of the element of a LazyContainer that is,
+  // or contains, this object.
+  storage::BufferPool::FrameId Frame() const {
+    if constexpr (std::is_void_v<U>) {
+      return storage::BufferPool::kNoFrame;
+    } else {
+      if (!this->parent_) return storage::BufferPool::kNoFrame;
+      return this->parent_->FrameOf(*this);
+    }
+  }
+  template <typename T>
+  storage::BufferPool::FrameId FrameOf(const T&) const {
+    return Frame();
+  }
+
+  // Called by the sub-object child once it was changed by an editor of its
+  // own, rather than by one of this object, which stores it on commit. What
+  // this object stores of it is stored again, and so on up the tree.
+  template <typename Child>
+  void ChildChanged(const Child& child) {
+    if (committing_) return;
+    Mask changed = {IsMember<Args<Data>>(child)...};
+    Invalidate(&changed);
+    Persist(&changed);
+    NotifyParent();
+  }
+
+  // Only allowed on the root of the tree.
+  void SetStorage(const storage::Options& storage) {
+    static_assert(std::is_void_v<U>,
+                  "Storage options can only be set on the root object");
+    this->storage_ = storage;
+  }
+
   const constexpr static bool kIsAlsoValue = true;
   const constexpr static bool kIsSubObject = true;
   const constexpr static bool SkipSerialize = false;
@@ -332,9 +507,7 @@ class Data : public Args<Data<U, Args...>>... {
                                         this->Args<Data>::Edit()...);
   }
 
-  const kj::Maybe<kj::Own<const kj::Directory>>& Directory() const {
-    return dir_;
-  }
+  const util::Dir& Directory() const { return dir_; }
 
   template <typename GetObject, typename Fun>
   static void Visit(std::vector<std::string>& path, const GetObject& get_object,
@@ -344,6 +517,29 @@ class Data : public Args<Data<U, Args...>>... {
   }
 
  private:
+  // Builds each member from its own part of the encoded object.
+  template <typename Tag, size_t... Is>
+  Data(Tag, std::index_sequence<Is...>,
+       util::Dir dir, const char* field_name,
+       U* parent, const std::array<std::string_view, sizeof...(Args)>& fields,
+       const storage::Options& storage)
+      : detail::DataParent<U>(parent, storage),
+        Args<Data<U, Args...>>(Tag(), util::SubDir(dir, field_name),
+                               Args<Data<U, Args...>>::json_name_, this,
+                               fields[Is])...,
+        dir_(util::SubDir(dir, field_name)) {}
+
+  template <size_t... Is>
+  void SerializeBinaryMembers(std::string& out,
+                              std::index_sequence<Is...>) const {
+    std::string member;
+    ((void)(Args<Data<U, Args...>>::value_type_::SkipSerialize ||
+            (member.clear(),
+             this->Args<Data<U, Args...>>::Raw().SerializeBinary(member),
+             binary::PutField(out, Is, member), true)),
+     ...);
+  }
+
   template <typename A, typename GetObject, typename Fun>
   static void VisitSingle(std::vector<std::string>& path,
                           const GetObject& get_object, const Fun& reg) {
@@ -358,34 +554,242 @@ class Data : public Args<Data<U, Args...>>... {
                           },
                           reg);
   }
-  bool Commit() {
-    if (!util::propagate_callback_safe(on_commit, on_undo_commit)) return false;
-    KJ_IF_MAYBE(d, dir_) {
-      auto replacer = (*d)->replaceFile(
-          kj::Path("data.json"), kj::WriteMode::CREATE | kj::WriteMode::MODIFY);
-      replacer->get().writeAll(std::string(Serialize().dump()).c_str());
-      replacer->commit();
+  template <size_t... Is>
+  void BinarySnapshotMembers(storage::BinarySnapshotWriter& writer,
+                             std::string& out,
+                             std::index_sequence<Is...>) const {
+    std::string member;
+    ((void)(Args<Data<U, Args...>>::value_type_::SkipSerialize ||
+            (member.clear(),
+             BinarySnapshotMember<Args<Data<U, Args...>>>(writer, member),
+             binary::PutField(out, Is, member), true)),
+     ...);
+  }
+
+  template <typename A>
+  void BinarySnapshotMember(storage::BinarySnapshotWriter& writer,
+                            std::string& out) const {
+    if constexpr (A::value_type_::kIsSubObject) {
+      this->A::Raw().BinarySnapshot(writer, out);
+    } else {
+      this->A::Raw().SerializeBinary(out);
     }
+  }
+
+  using Mask = std::array<bool, sizeof...(Args)>;
+
+  template <typename A, typename Child>
+  bool IsMember(const Child& child) const {
+    if constexpr (std::is_base_of_v<Child, typename A::value_type_>) {
+      return static_cast<const Child*>(&this->A::Raw()) == &child;
+    } else {
+      return false;
+    }
+  }
+
+  void NotifyParent() {
+    if constexpr (!std::is_void_v<U>) {
+      if (this->parent_) this->parent_->ChildChanged(*this);
+    }
+  }
+
+  // Encoded members of an object that has a directory. Fragments of
+  // sub-objects are never cached, as they can be edited without going through
+  // this object.
+  struct Encoded {
+    storage::Format format;
+    std::array<std::string, sizeof...(Args)> fragments;
+    Mask valid = {};
+  };
+
+  // Encodes the members selected by only (or all of them, if null) as a JSON
+  // object or as binary fields, re-encoding only the ones that changed since
+  // the last call.
+  std::string Encode(const Mask* only, storage::Format format) const {
+    if (!encoded_ || encoded_->format != format) {
+      encoded_ = std::make_unique<Encoded>();
+      encoded_->format = format;
+    }
+    std::string out;
+    JsonWriter writer(out);
+    if (format == storage::Format::kJson) writer.BeginObject();
+    EncodeMembers(only, out, writer, std::index_sequence_for<Args<Data>...>());
+    if (format == storage::Format::kJson) writer.EndObject();
+    return out;
+  }
+
+  template <size_t... Is>
+  void EncodeMembers(const Mask* only, std::string& out, JsonWriter& writer,
+                     std::index_sequence<Is...>) const {
+    (EncodeMember<Args<Data<U, Args...>>, Is>(only, out, writer), ...);
+  }
+
+  template <typename A, size_t I>
+  void EncodeMember(const Mask* only, std::string& out,
+                    JsonWriter& writer) const {
+    if constexpr (!A::value_type_::SkipSerialize) {
+      if (only && !(*only)[I]) return;
+      if (encoded_->format == storage::Format::kBinary) {
+        if constexpr (A::value_type_::kIsSubObject) {
+          std::string member;
+          this->A::Raw().StoreBinary(member);
+          binary::PutField(out, I, member);
+        } else {
+          if (!encoded_->valid[I]) {
+            encoded_->fragments[I].clear();
+            this->A::Raw().SerializeBinary(encoded_->fragments[I]);
+            encoded_->valid[I] = true;
+          }
+          binary::PutField(out, I, encoded_->fragments[I]);
+        }
+        return;
+      }
+      writer.Key(A::json_name_);
+      if constexpr (A::value_type_::kIsSubObject) {
+        this->A::Raw().Store(writer);
+      } else {
+        if (!encoded_->valid[I]) {
+          encoded_->fragments[I].clear();
+          JsonWriter fragment(encoded_->fragments[I]);
+          this->A::Raw().Serialize(fragment);
+          encoded_->valid[I] = true;
+        }
+        writer.Raw(encoded_->fragments[I]);
+      }
+    }
+  }
+
+  void Invalidate(const Mask* changed) {
+    if (!encoded_) return;
+    if (!changed) {
+      encoded_ = nullptr;
+      return;
+    }
+    for (size_t i = 0; i < sizeof...(Args); i++) {
+      if ((*changed)[i]) encoded_->valid[i] = false;
+    }
+  }
+
+  // If changed is null, all members are considered to be changed.
+  bool Commit(const Mask* changed = nullptr) {
+    if (has_callbacks_ && !Callbacks::Run(this)) return false;
+    Invalidate(changed);
+    Persist(changed);
     return true;
   }
 
-  void UndoCommit() noexcept {
-    for (const auto& f : on_undo_commit) f();
-    KJ_IF_MAYBE(d, dir_) {
-      auto replacer = (*d)->replaceFile(
-          kj::Path("data.json"), kj::WriteMode::CREATE | kj::WriteMode::MODIFY);
-      replacer->get().writeAll(std::string(Serialize().dump()).c_str());
-      replacer->commit();
+  void UndoCommit(const Mask* changed = nullptr) noexcept {
+    if (has_callbacks_) Callbacks::Revert(this);
+    Invalidate(changed);
+    Persist(changed);
+  }
+
+  void Persist(const Mask* changed) {
+    if (dir_) {
+      const storage::Options& options = Storage();
+      const storage::Files& files = options.format == storage::Format::kBinary
+                                        ? storage::kBinaryObjectFiles
+                                        : storage::kObjectFiles;
+      if (changed && options.mode == storage::Mode::kLog &&
+          log_records_ < options.checkpoint_interval) {
+        std::string record = Encode(changed, options.format);
+        if (record.empty() || record == "{}") return;
+        storage::Append(options, this, dir_, files, record);
+        log_records_++;
+      } else {
+        storage::Snapshot(options, this, dir_, files,
+                          Encode(nullptr, options.format), !changed);
+        log_records_ = 0;
+      }
     }
   }
-  kj::Maybe<kj::Own<const kj::Directory>> dir_;
-  std::vector<callback_t> on_commit;
-  std::vector<revert_callback_t> on_undo_commit;
-  U* parent_;
+
+  util::Dir dir_;
+  // Records appended to the log since the last snapshot by this object.
+  size_t log_records_ = 0;
+  mutable std::unique_ptr<Encoded> encoded_;
+  // Open editors of this object and of the objects it contains.
+  mutable size_t pins_ = 0;
+  // Set while an editor of this object commits or undoes, which also stores
+  // the sub-objects it changed.
+  bool committing_ = false;
+  // The callbacks are in Callbacks, as most objects have none.
+  bool has_callbacks_ = false;
   friend U;
+  template <typename, typename, typename>
+  friend class detail::Value;
 };
 
 template <template <typename T> class... Args>
 using MainData = Value<void, Data<void, Args...>>;
 
+// Writes the whole tree to a binary snapshot in the directory of root. The
+// first write that follows removes it, so that it is only used if it is up to
+// date; databases that have one must be opened with LoadBinarySnapshot.
+template <typename Root>
+void WriteBinarySnapshot(Root& root) {
+  storage::Options options = root.Storage();
+  storage::Flush(options);
+  KJ_REQUIRE(bool(root.Directory()), "binary snapshots require a directory");
+  auto dir = root.Directory().Open();
+  storage::BinarySnapshotWriter writer;
+  std::string encoded;
+  root.BinarySnapshot(writer, encoded);
+  writer.Add(encoded);
+  auto data = writer.Finish();
+  auto replacer =
+      dir->replaceFile(kj::Path(storage::kBinarySnapshotFile),
+                       kj::WriteMode::CREATE | kj::WriteMode::MODIFY);
+  replacer->get().writeAll(
+      kj::ArrayPtr<const kj::byte>(data.data(), data.size()));
+  replacer->get().datasync();
+  replacer->commit();
+  dir->sync();
+  options.write_guard = std::make_shared<storage::WriteGuard>(
+      root.Directory(), storage::kBinarySnapshotFile);
+  root.SetStorage(options);
+}
+
+// Loads the database from its binary snapshot, mapped in memory, if it has
+// one, and from the files of its objects otherwise.
+template <typename Root>
+std::unique_ptr<Root> LoadBinarySnapshot(
+    util::Dir dir, const char* field_name,
+    storage::Options options = storage::DefaultOptions()) {
+  auto root_dir = util::SubDir(dir, field_name);
+  auto opened = root_dir.TryOpen();
+  auto maybe_file =
+      opened ? opened->tryOpenFile(kj::Path(storage::kBinarySnapshotFile))
+             : nullptr;
+  KJ_IF_MAYBE(file, maybe_file) {
+    auto snapshot = std::make_shared<const storage::BinarySnapshotReader>(
+        (*file)->mmap(0, (*file)->stat().size));
+    storage::Options load_options = options;
+    load_options.binary_snapshot = snapshot;
+    auto root = Root::FromBinary(std::move(dir), field_name, nullptr,
+                                 snapshot->Root(), load_options);
+    // The new options no longer refer to the mapping, which is released.
+    options.write_guard = std::make_shared<storage::WriteGuard>(
+        std::move(root_dir), storage::kBinarySnapshotFile);
+    root->SetStorage(options);
+    return root;
+  }
+  return Root::Load(std::move(dir), field_name, nullptr, options);
+}
+
+// Copies the files of the database of root to target as they are after every
+// commit done so far, while the database keeps being edited. Resolves once
+// the copy is complete. Requires storage::Options::backups, and does not
+// support segment stores.
+template <typename Root>
+kj::Promise<void> Backup(Root& root, kj::Own<const kj::Directory> target) {
+  const storage::Options& options = root.Storage();
+  KJ_REQUIRE(options.backups != nullptr, "backups are not enabled");
+  KJ_REQUIRE(options.segments == nullptr,
+             "backups of segment stores are not supported");
+  KJ_REQUIRE(bool(root.Directory()), "backups require a directory");
+  storage::Flush(options);
+  return options.backups->Start(root.Directory(), std::move(target));
+}
+
 }  // namespace db
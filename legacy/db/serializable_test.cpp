@@ -1,4 +1,7 @@
 #include "db/serializable.hpp"
+#include <kj/async.h>
+#include <chrono>
+#include <thread>
 #include <unordered_map>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
@@ -56,6 +59,49 @@ TEST(Serializable, TestRoundNested) {
   EXPECT_TRUE(v == *vp);
 }
 
+TEST(Serializable, TestStreamingSerialize) {
+  Vp v(Vp::Builder(std::unordered_map<std::string, int>{{"b", 1}, {"a", -2}},
+                   std::vector<int>{},
+                   Vp::data_t::Builder(std::string("q\"\\\n\x01\xc3\xa8"))));
+  std::string out;
+  JsonWriter writer(out);
+  v.Serialize(writer);
+  EXPECT_THAT(json::parse(out), Eq(v.Serialize()));
+  auto vp = Vp::FromJson(nullptr, "", nullptr, json::parse(out));
+  EXPECT_TRUE(v == *vp);
+}
+
+TEST(Serializable, TestParseText) {
+  std::string text =
+      R"({"vec": null, "extra": [{"a": [1, 2]}, "x"], "data": {"prova":)"
+      R"( "a\"\n\u00e8\ud83d\ude00"}, "mp": {"x": 1, "y": -2}})";
+  auto vp = Vp::FromJsonText(nullptr, "", nullptr, text);
+  EXPECT_THAT(*vp->data.prova, Eq("a\"\n\xc3\xa8\xf0\x9f\x98\x80"));
+  EXPECT_THAT(vp->mp->at("y"), Eq(-2));
+  EXPECT_TRUE(vp->vec->empty());
+  EXPECT_TRUE(*vp == *Vp::FromJson(nullptr, "", nullptr, json::parse(text)));
+  EXPECT_THROW(Vp::FromJsonText(nullptr, "", nullptr, text.substr(1)),
+               std::runtime_error);
+  EXPECT_THROW(Vp::FromJsonText(nullptr, "", nullptr, R"({"vec": []})"),
+               std::runtime_error);
+}
+
+// Skipped numbers are not converted, so they may be out of double range.
+TEST(Serializable, TestParseTextSkipNumber) {
+  std::string text =
+      R"({"vec": [1], "big": 1e999, "small": -2.5E-999, "zero": 0,)"
+      R"( "data": {"prova": "a"}, "mp": {}})";
+  auto vp = Vp::FromJsonText(nullptr, "", nullptr, text);
+  EXPECT_THAT(*vp->vec, Eq(std::vector<int>{1}));
+  EXPECT_THAT(*vp->data.prova, Eq("a"));
+  for (const char* bad : {"01", "1.", "-", "1e", ".5", "+1"}) {
+    std::string invalid = text;
+    invalid.replace(invalid.find("1e999"), 5, bad);
+    EXPECT_THROW(Vp::FromJsonText(nullptr, "", nullptr, invalid),
+                 std::runtime_error);
+  }
+}
+
 // Commit/rollback
 
 TEST(Serializable, TestEditData) {
@@ -265,6 +311,58 @@ TEST(Serializable, TestRollbackCallbackData) {
   EXPECT_THAT(t2, Eq(1));
 }
 
+// Callbacks are kept out of the objects, which pay for them only when they
+// have some.
+TEST(Serializable, TestMemberSize) {
+  EXPECT_LE(sizeof(detail::Value<void, int>), 2 * sizeof(int));
+  EXPECT_LE(sizeof(detail::Value<void, std::string>),
+            sizeof(std::string) + sizeof(void*));
+}
+
+TEST(Serializable, TestCallbacksRemoved) {
+  int t = 0;
+  auto v = std::make_unique<V>(V::Builder("ciao", 3, std::vector<int>{}));
+  v->num.OnChange([&t](int o, int n) {
+    t++;
+    return true;
+  });
+  v->OnChange([&t]() {
+    t++;
+    return true;
+  });
+  v = nullptr;
+  // New objects, which may take the place of the old one, have no callbacks.
+  for (int i = 0; i < 10; i++) {
+    auto w = std::make_unique<V>(V::Builder("ciao", 3, std::vector<int>{}));
+    auto edit = w->Edit();
+    *edit.num = i;
+    EXPECT_TRUE(edit.Commit());
+  }
+  EXPECT_THAT(t, Eq(0));
+}
+
+TEST(Serializable, TestCallbacksCopied) {
+  int t = 0;
+  detail::Value<void, int> v(nullptr, nullptr, nullptr, 3);
+  v.OnChange([&t](int o, int n) {
+    t++;
+    return true;
+  });
+  detail::Value<void, int> copy = v;
+  auto edit = copy.Edit();
+  *edit = 4;
+  EXPECT_TRUE(edit.Commit());
+  EXPECT_THAT(*copy, Eq(4));
+  EXPECT_THAT(*v, Eq(3));
+  EXPECT_THAT(t, Eq(1));
+  detail::Value<void, int> other(nullptr, nullptr, nullptr, 0);
+  other = v;
+  auto edit2 = other.Edit();
+  *edit2 = 5;
+  EXPECT_TRUE(edit2.Commit());
+  EXPECT_THAT(t, Eq(2));
+}
+
 TEST(Serializable, TestRollbackCallbackValueExc) {
   V v(V::Builder("ciao", 3, std::vector<int>{1, 2, 3}));
   int t = 0;
@@ -452,6 +550,408 @@ TEST(Serializable, TestWriteOnCommit) {
   EXPECT_TRUE(v == *vp);
 };
 
+TEST(Serializable, TestWriteOnCommitTwice) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  V v(V::Builder("ciao", 3, std::vector<int>{1, 2, 3}).SetDir(dir->clone()));
+  auto edit = v.Edit();
+  *edit.num = 4;
+  EXPECT_TRUE(edit.Commit());
+  auto edit2 = v.Edit();
+  edit2.test->push_back(4);
+  EXPECT_TRUE(edit2.Commit());
+  auto vp = V::Load(dir->clone(), "", nullptr);
+  EXPECT_THAT(*vp->num, Eq(4));
+  EXPECT_TRUE(v == *vp);
+};
+
+TEST(Serializable, TestWriteOnSubCommit) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  Vp v(Vp::Builder(std::unordered_map<std::string, int>{{"ciao", 3}},
+                   std::vector<int>{1, 3},
+                   Vp::data_t::Builder(std::string("ciao")))
+           .SetDir(dir->clone()));
+  auto edit = v.data.Edit();
+  *edit.prova = "test";
+  EXPECT_TRUE(edit.Commit());
+  auto edit2 = v.Edit();
+  edit2.vec->push_back(4);
+  EXPECT_TRUE(edit2.Commit());
+  auto vp = Vp::Load(dir->clone(), "", nullptr);
+  EXPECT_THAT(*vp->data.prova, Eq("test"));
+  EXPECT_TRUE(v == *vp);
+};
+
+// Sub-objects edited by themselves are stored again by their parent.
+TEST(Serializable, TestWriteOnSubCommitOnly) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  for (auto mode : {storage::Mode::kSnapshot, storage::Mode::kLog}) {
+    Vp v(Vp::Builder(std::unordered_map<std::string, int>{{"ciao", 3}},
+                     std::vector<int>{1, 3},
+                     Vp::data_t::Builder(std::string("ciao")))
+             .SetDir(dir->clone())
+             .SetStorage({mode}));
+    auto edit = v.data.Edit();
+    *edit.prova = "test";
+    EXPECT_TRUE(edit.Commit());
+    auto vp = Vp::Load(dir->clone(), "", nullptr, v.Storage());
+    EXPECT_THAT(*vp->data.prova, Eq("test"));
+    auto edit2 = v.Edit();
+    edit2.vec->push_back(4);
+    EXPECT_TRUE(edit2.Commit());
+    edit.Rollback();
+    vp = Vp::Load(dir->clone(), "", nullptr, v.Storage());
+    EXPECT_THAT(*vp->data.prova, Eq("ciao"));
+    EXPECT_TRUE(v == *vp);
+  }
+};
+
+// Log storage mode
+
+TEST(Serializable, TestLogWriteOnCommit) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  V v(V::Builder("ciao", 3, std::vector<int>{1, 2, 3})
+          .SetDir(dir->clone())
+          .SetField("stuff")
+          .SetStorage({storage::Mode::kLog}));
+  EXPECT_FALSE(dir->exists(kj::Path{"stuff", "log.jsonl"}));
+  auto edit = v.Edit();
+  *edit.num = 4;
+  EXPECT_TRUE(edit.Commit());
+  EXPECT_TRUE(dir->exists(kj::Path{"stuff", "log.jsonl"}));
+  auto vp = V::Load(dir->clone(), "stuff", nullptr);
+  EXPECT_TRUE(v == *vp);
+};
+
+TEST(Serializable, TestLogRollback) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  V v(V::Builder("ciao", 3, std::vector<int>{1, 2, 3})
+          .SetDir(dir->clone())
+          .SetStorage({storage::Mode::kLog}));
+  auto edit = v.Edit();
+  *edit.num = 4;
+  edit.test->push_back(4);
+  EXPECT_TRUE(edit.Commit());
+  edit.Rollback();
+  auto vp = V::Load(dir->clone(), "", nullptr);
+  EXPECT_THAT(*vp->num, Eq(3));
+  EXPECT_TRUE(v == *vp);
+};
+
+TEST(Serializable, TestLogCheckpoint) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  V v(V::Builder("ciao", 3, std::vector<int>{1, 2, 3})
+          .SetDir(dir->clone())
+          .SetStorage({storage::Mode::kLog, /*checkpoint_interval=*/2}));
+  for (int i = 4; i < 7; i++) {
+    auto edit = v.Edit();
+    *edit.num = i;
+    EXPECT_TRUE(edit.Commit());
+  }
+  EXPECT_FALSE(dir->exists(kj::Path("log.jsonl")));
+  auto vp = V::Load(dir->clone(), "", nullptr);
+  EXPECT_THAT(*vp->num, Eq(6));
+};
+
+TEST(Serializable, TestLogCheckpointAfterLoad) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  storage::Options options{storage::Mode::kLog, /*checkpoint_interval=*/3};
+  {
+    V v(V::Builder("ciao", 3, std::vector<int>{1, 2, 3})
+            .SetDir(dir->clone())
+            .SetStorage(options));
+    for (int i = 4; i < 6; i++) {
+      auto edit = v.Edit();
+      *edit.num = i;
+      EXPECT_TRUE(edit.Commit());
+    }
+  }
+  auto vp = V::Load(dir->clone(), "", nullptr, options);
+  for (int i = 6; i < 8; i++) {
+    EXPECT_TRUE(dir->exists(kj::Path("log.jsonl")));
+    // The fourth record of the log is a checkpoint.
+    auto edit = vp->Edit();
+    *edit.num = i;
+    EXPECT_TRUE(edit.Commit());
+  }
+  EXPECT_FALSE(dir->exists(kj::Path("log.jsonl")));
+  EXPECT_THAT(*V::Load(dir->clone(), "", nullptr)->num, Eq(7));
+};
+
+TEST(Serializable, TestLogIncompleteRecord) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  V v(V::Builder("ciao", 3, std::vector<int>{1, 2, 3})
+          .SetDir(dir->clone())
+          .SetStorage({storage::Mode::kLog}));
+  auto edit = v.Edit();
+  *edit.num = 4;
+  EXPECT_TRUE(edit.Commit());
+  std::string partial = R"({"num": 5)";
+  dir->appendFile(kj::Path("log.jsonl"), kj::WriteMode::MODIFY)
+      ->write(partial.data(), partial.size());
+  auto vp = V::Load(dir->clone(), "", nullptr);
+  EXPECT_THAT(*vp->num, Eq(4));
+};
+
+// Binary format
+
+TEST(Serializable, TestBinaryRoundNested) {
+  Vp v(Vp::Builder(std::unordered_map<std::string, int>{{"ciao", -3}},
+                   std::vector<int>{1, 300, -70000},
+                   Vp::data_t::Builder(std::string("ciao"))));
+  std::string data;
+  v.SerializeBinary(data);
+  auto vp = Vp::FromBinary(nullptr, "", nullptr, data);
+  EXPECT_TRUE(v == *vp);
+  EXPECT_THROW(Vp::FromBinary(nullptr, "", nullptr,
+                              std::string_view(data).substr(1)),
+               std::runtime_error);
+}
+
+TEST(Serializable, TestBinaryStorage) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  storage::Options options;
+  options.mode = storage::Mode::kLog;
+  options.format = storage::Format::kBinary;
+  V v(V::Builder("ciao", 3, std::vector<int>{1, 2, 3})
+          .SetDir(dir->clone())
+          .SetStorage(options));
+  EXPECT_TRUE(dir->exists(kj::Path("data.bin")));
+  EXPECT_FALSE(dir->exists(kj::Path("data.json")));
+  for (int i = -1; i > -4; i--) {
+    auto edit = v.Edit();
+    *edit.num = i;
+    EXPECT_TRUE(edit.Commit());
+  }
+  EXPECT_TRUE(dir->exists(kj::Path("log.bin")));
+  std::string partial = "\x05\x01";
+  dir->appendFile(kj::Path("log.bin"), kj::WriteMode::MODIFY)
+      ->write(partial.data(), partial.size());
+  auto vp = V::Load(dir->clone(), "", nullptr, options);
+  EXPECT_THAT(*vp->num, Eq(-3));
+  EXPECT_TRUE(v == *vp);
+};
+
+// Values stored by themselves are read in the format of the database.
+TEST(Serializable, TestBinaryValueLoad) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  storage::Options options;
+  options.format = storage::Format::kBinary;
+  V v(V::Builder("ciao", 3, std::vector<int>{}).SetStorage(options));
+  std::string data;
+  ToBinary<int>()(42, data);
+  storage::WriteSnapshot(
+      *dir->openSubdir(kj::Path("num"), kj::WriteMode::CREATE),
+      storage::kBinaryObjectFiles, data);
+  auto num = detail::Value<V, int>::Load(dir->clone(), "num", &v);
+  EXPECT_THAT(**num, Eq(42));
+};
+
+// Group commit
+
+TEST(Serializable, TestGroupCommit) {
+  kj::EventLoop loop;
+  kj::WaitScope ws(loop);
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  auto group = std::make_shared<storage::GroupCommit>(
+      /*max_records=*/100, std::chrono::hours(1));
+  storage::Options options;
+  options.group_commit = group;
+  V v(V::Builder("ciao", 3, std::vector<int>{1, 2, 3})
+          .SetDir(dir->clone())
+          .SetStorage(options));
+  EXPECT_FALSE(dir->exists(kj::Path("data.json")));
+  group->Flush();
+  for (int i = 4; i < 7; i++) {
+    auto edit = v.Edit();
+    *edit.num = i;
+    EXPECT_TRUE(edit.Commit());
+    EXPECT_THAT(*v.num, Eq(i));
+  }
+  EXPECT_THAT(group->PendingRecords(), Eq(3));
+  auto durable = group->WhenDurable();
+  EXPECT_FALSE(durable.poll(ws));
+  EXPECT_THAT(*V::Load(dir->clone(), "", nullptr)->num, Eq(3));
+  group->Flush();
+  durable.wait(ws);
+  EXPECT_THAT(*V::Load(dir->clone(), "", nullptr)->num, Eq(6));
+};
+
+TEST(Serializable, TestGroupCommitMaxRecords) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  storage::Options options;
+  options.mode = storage::Mode::kLog;
+  options.group_commit = std::make_shared<storage::GroupCommit>(
+      /*max_records=*/3, std::chrono::hours(1));
+  V v(V::Builder("ciao", 3, std::vector<int>{1, 2, 3})
+          .SetDir(dir->clone())
+          .SetStorage(options));
+  for (int i = 4; i < 6; i++) {
+    auto edit = v.Edit();
+    *edit.num = i;
+    EXPECT_TRUE(edit.Commit());
+  }
+  EXPECT_THAT(options.group_commit->PendingRecords(), Eq(0));
+  EXPECT_THAT(*V::Load(dir->clone(), "", nullptr)->num, Eq(5));
+};
+
+// Flushes may run on other threads, such as the ones that load the database.
+// Commits are durable once the group that holds them is written, even if it
+// was taken before WhenDurable() was called.
+TEST(Serializable, TestGroupCommitOtherThread) {
+  kj::EventLoop loop;
+  kj::WaitScope ws(loop);
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  auto group = std::make_shared<storage::GroupCommit>(
+      /*max_records=*/100, std::chrono::hours(1));
+  storage::Options options;
+  options.group_commit = group;
+  V v(V::Builder("ciao", 3, std::vector<int>{1, 2, 3})
+          .SetDir(dir->clone())
+          .SetStorage(options));
+  group->Flush();
+  for (int i = 0; i < 100; i++) {
+    {
+      auto edit = v.Edit();
+      *edit.num = i;
+      EXPECT_TRUE(edit.Commit());
+    }
+    std::thread flusher([&group]() { group->Flush(); });
+    // Half of the times, only once the flusher has taken the group.
+    while (i % 2 && group->PendingRecords()) std::this_thread::yield();
+    group->WhenDurable().wait(ws);
+    EXPECT_THAT(*V::Load(dir->clone(), "", nullptr)->num, Eq(i));
+    flusher.join();
+  }
+};
+
+// Commits of a group that failed to be written are never reported as
+// durable, and neither are the later ones.
+TEST(Serializable, TestGroupCommitFailure) {
+  kj::EventLoop loop;
+  kj::WaitScope ws(loop);
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  storage::GroupCommit group(/*max_records=*/100, std::chrono::hours(1));
+  int owner;
+  // Writes without a directory fail.
+  group.Snapshot(&owner, storage::Destination{}, storage::kObjectFiles, "{}",
+                 /*first=*/true);
+  auto durable = group.WhenDurable();
+  EXPECT_ANY_THROW(group.Flush());
+  EXPECT_ANY_THROW(durable.wait(ws));
+  EXPECT_ANY_THROW(group.WhenDurable().wait(ws));
+  storage::Destination to{util::Dir(dir->clone())};
+  EXPECT_ANY_THROW(group.Snapshot(&owner, to, storage::kObjectFiles, "{}",
+                                  /*first=*/true));
+  EXPECT_ANY_THROW(group.Flush());
+  EXPECT_ANY_THROW(group.WhenDurable().wait(ws));
+  EXPECT_FALSE(dir->exists(kj::Path("data.json")));
+};
+
+// Asynchronous commit
+
+TEST(Serializable, TestAsyncCommit) {
+  kj::EventLoop loop;
+  kj::WaitScope ws(loop);
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  storage::Options options;
+  options.mode = storage::Mode::kLog;
+  options.async_writer = std::make_shared<storage::AsyncWriter>();
+  V v(V::Builder("ciao", 3, std::vector<int>{1, 2, 3})
+          .SetDir(dir->clone())
+          .SetStorage(options));
+  for (int i = 4; i < 7; i++) {
+    auto edit = v.Edit();
+    *edit.num = i;
+    auto committed = edit.CommitAsync();
+    EXPECT_THAT(*v.num, Eq(i));
+    EXPECT_TRUE(committed.wait(ws));
+    EXPECT_THAT(*V::Load(dir->clone(), "", nullptr)->num, Eq(i));
+  }
+  {
+    auto edit = v.Edit();
+    *edit.num = 7;
+    EXPECT_TRUE(edit.Commit());
+  }
+  storage::WhenDurable(options).wait(ws);
+  EXPECT_THAT(*V::Load(dir->clone(), "", nullptr)->num, Eq(7));
+};
+
+// Segment store
+
+TEST(Serializable, TestSegmentStore) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  auto segments_dir =
+      dir->openSubdir(kj::Path("segments"), kj::WriteMode::CREATE);
+  storage::Options options;
+  options.mode = storage::Mode::kLog;
+  options.checkpoint_interval = 2;
+  options.segments = std::make_shared<storage::SegmentStore>(
+      segments_dir->clone(), /*segment_size=*/64,
+      /*background_compaction=*/false);
+  V v(V::Builder("ciao", 3, std::vector<int>{1, 2, 3})
+          .SetDir(dir->clone())
+          .SetStorage(options));
+  for (int i = 0; i < 20; i++) {
+    auto edit = v.Edit();
+    *edit.num = i;
+    EXPECT_TRUE(edit.Commit());
+  }
+  EXPECT_FALSE(dir->exists(kj::Path("data.json")));
+  EXPECT_GT(options.segments->SegmentCount(), 2);
+  options.segments->Compact();
+  EXPECT_THAT(options.segments->SegmentCount(), Eq(2));
+  auto vp = V::Load(dir->clone(), "", nullptr, options);
+  EXPECT_TRUE(v == *vp);
+  options.segments->Sync();
+  options.segments = std::make_shared<storage::SegmentStore>(
+      segments_dir->clone(), 64, false);
+  vp = V::Load(dir->clone(), "", nullptr, options);
+  EXPECT_THAT(*vp->num, Eq(19));
+  EXPECT_TRUE(v == *vp);
+};
+
+TEST(Serializable, TestCompression) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  std::vector<std::string> samples;
+  for (int i = 0; i < 20; i++) {
+    V s(V::Builder("ciao" + std::to_string(i), i, std::vector<int>{i, 2, 3})
+            .SetDir(dir->clone()));
+    auto bytes = dir->openFile(kj::Path("data.json"))->readAllBytes();
+    samples.emplace_back(bytes.begin(), bytes.end());
+  }
+  std::string dictionary = storage::Compressor::Train(samples);
+  EXPECT_THAT(dictionary.find("\"prova\":"), Ne(std::string::npos));
+
+  storage::Options options;
+  options.compressor = std::make_shared<storage::Compressor>(
+      std::vector<std::string>{dictionary});
+  V v(V::Builder("ciao", 3, std::vector<int>{1, 2, 3})
+          .SetDir(dir->clone())
+          .SetStorage(options));
+  auto edit = v.Edit();
+  *edit.num = 7;
+  EXPECT_TRUE(edit.Commit());
+  auto bytes = dir->openFile(kj::Path("data.json"))->readAllBytes();
+  EXPECT_TRUE(storage::Compressor::IsCompressed(
+      std::string(bytes.begin(), bytes.end())));
+  auto stats = options.compressor->Stats();
+  EXPECT_GE(stats.compressions, 2);
+  EXPECT_GT(stats.Ratio(), 1.5);
+
+  auto vp = V::Load(dir->clone(), "", nullptr, options);
+  EXPECT_TRUE(v == *vp);
+  EXPECT_THAT(options.compressor->Stats().decompressions, Eq(1));
+  // The dictionary is needed to read the database.
+  EXPECT_ANY_THROW(V::Load(dir->clone(), "", nullptr));
+
+  std::string data;
+  for (int i = 0; i < 100; i++) data += "{\"num\": " + std::to_string(i) + "}";
+  storage::Compressor plain;
+  std::string compressed = plain.Compress(data);
+  EXPECT_LT(compressed.size(), data.size() / 2);
+  EXPECT_THAT(storage::Compressor::Decompress(compressed, nullptr), Eq(data));
+};
+
 // Parent pointer
 TEST(Serializable, TestParent) {
   Vp v(Vp::Builder(std::unordered_map<std::string, int>{{"ciao", 3}},
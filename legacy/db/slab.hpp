@@ -0,0 +1,118 @@
+#pragma once
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace db {
+namespace util {
+
+// Allocates objects of type T in slabs of slots, which grow geometrically,
+// and reuses the slots of destroyed objects. Objects never move until they
+// are destroyed, through their Ptr, which returns their slot to the pool; the
+// pool must outlive them.
+//
+// Allocation is thread safe, so that elements can be loaded in parallel.
+template <typename T>
+class SlabPool {
+  struct Slot;
+
+ public:
+  struct Deleter {
+    void operator()(T* p) const {
+      // The object is at the start of its slot.
+      Slot* slot = reinterpret_cast<Slot*>(p);
+      p->~T();
+      slot->pool->Release(slot);
+    }
+  };
+  using Ptr = std::unique_ptr<T, Deleter>;
+
+  SlabPool() = default;
+  SlabPool(const SlabPool&) = delete;
+  SlabPool& operator=(const SlabPool&) = delete;
+
+  template <typename... Args>
+  Ptr New(Args&&... args) {
+    Slot* slot = Take();
+    T* p;
+    try {
+      p = new (slot->value) T(std::forward<Args>(args)...);
+    } catch (...) {
+      Release(slot);
+      throw;
+    }
+    return Ptr(p);
+  }
+
+  // Makes room for n more objects in a single slab.
+  void Reserve(size_t n) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (n > free_count_) AddSlab(n - free_count_);
+  }
+
+  // Number of live objects.
+  size_t Size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return capacity_ - free_count_;
+  }
+
+  // Number of slots, live or free.
+  size_t Capacity() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return capacity_;
+  }
+
+ private:
+  static constexpr size_t kMinSlab = 4;
+  static constexpr size_t kMaxSlab = 1024;
+
+  struct Slot {
+    union {
+      alignas(T) unsigned char value[sizeof(T)];
+      Slot* next;
+    };
+    SlabPool* pool;
+  };
+
+  Slot* Take() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_) {
+      AddSlab(std::clamp(capacity_, kMinSlab, kMaxSlab));
+    }
+    Slot* slot = free_;
+    free_ = slot->next;
+    free_count_--;
+    return slot;
+  }
+
+  void Release(Slot* slot) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    slot->next = free_;
+    free_ = slot;
+    free_count_++;
+  }
+
+  void AddSlab(size_t n) {
+    auto slab = std::make_unique<Slot[]>(n);
+    for (size_t i = n; i-- > 0;) {
+      slab[i].pool = this;
+      slab[i].next = free_;
+      free_ = &slab[i];
+    }
+    slabs_.push_back(std::move(slab));
+    capacity_ += n;
+    free_count_ += n;
+  }
+
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<Slot[]>> slabs_;
+  Slot* free_ = nullptr;
+  size_t capacity_ = 0;
+  size_t free_count_ = 0;
+};
+
+}  // namespace util
+}  // namespace db
@@ -0,0 +1,1165 @@
+#pragma once
+#include <kj/async.h>
+#include <kj/debug.h>
+#include <kj/filesystem.h>
+#include <kj/timer.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "db/binary.hpp"
+#include "db/buffer_pool.hpp"
+#include "db/compression.hpp"
+#include "db/dir.hpp"
+#include "db/json.hpp"
+#include "db/segment_store.hpp"
+#include "db/thread_pool.hpp"
+
+namespace db {
+namespace storage {
+
+enum class Mode {
+  // Every commit rewrites data.json.
+  kSnapshot,
+  // Every commit appends the changed members as one line of log.jsonl.
+  // data.json is rewritten, and the log dropped, every checkpoint_interval
+  // records.
+  kLog,
+};
+
+// Encoding of objects, on disk or in API answers.
+enum class Format {
+  kJson,
+  // See db/binary.hpp. Only used for the objects, as the key indexes are
+  // small and rarely read.
+  kBinary,
+};
+
+// Where the elements of a container are stored, below its directory.
+enum class Layout {
+  // In a directory named after the key.
+  kFlat,
+  // In ab/cd/<key>, where abcd are the first hex digits of a hash of the key,
+  // so that no directory gets too many entries.
+  kSharded,
+};
+
+class GroupCommit;
+class AsyncWriter;
+class BinarySnapshotReader;
+class WriteGuard;
+class Backups;
+
+// Per-database storage settings, held by the root object.
+struct Options {
+  Mode mode = Mode::kSnapshot;
+  size_t checkpoint_interval = 1024;
+  // Databases must always be loaded with the format they were written in.
+  Format format = Format::kJson;
+  Format api_format = Format::kJson;
+  // Also fixed for the lifetime of a database, unless it is converted with
+  // MigrateLayout.
+  Layout layout = Layout::kFlat;
+  // Maximum number of elements of each LazyContainer kept in memory, or 0 for
+  // no limit.
+  size_t resident_limit = 0;
+  // If set, bounds the memory used by the elements of all LazyContainers,
+  // in addition to resident_limit.
+  std::shared_ptr<BufferPool> buffer_pool;
+  // If set, the elements of containers are loaded in parallel on this pool.
+  // Only used if the options are given when loading the database.
+  std::shared_ptr<util::ThreadPool> load_pool;
+  // If set, writes are deferred and flushed in groups.
+  std::shared_ptr<GroupCommit> group_commit;
+  // If set, writes are done on a separate thread. Takes precedence over
+  // group_commit.
+  std::shared_ptr<AsyncWriter> async_writer;
+  // Set while the database is loaded from a binary snapshot.
+  std::shared_ptr<const BinarySnapshotReader> binary_snapshot;
+  // Called before every write.
+  std::shared_ptr<WriteGuard> write_guard;
+  // If set, the files of objects are records of this store rather than files
+  // in their directories.
+  std::shared_ptr<SegmentStore> segments;
+  // If set, object snapshots are compressed with it. Databases can be read
+  // without one, unless they were written with a dictionary.
+  std::shared_ptr<Compressor> compressor;
+  // Must be set when the database is opened for db::Backup to be used.
+  std::shared_ptr<Backups> backups;
+};
+
+inline const Options& DefaultOptions() {
+  static const Options options;
+  return options;
+}
+
+// The files in which an object is stored: a snapshot, and a log of the
+// changes made after it. Records of binary logs are prefixed by their length,
+// the others end with a newline.
+struct Files {
+  const char* snapshot;
+  const char* log;
+  bool binary = false;
+  // Whether the snapshot is compressed, if there is a compressor.
+  bool compressed = false;
+};
+
+static const constexpr Files kObjectFiles = {"data.json", "log.jsonl", false,
+                                             true};
+static const constexpr Files kBinaryObjectFiles = {"data.bin", "log.bin",
+                                                   true, true};
+// Key index of a Container.
+static const constexpr Files kKeyFiles = {"keys.json", "keys.jsonl"};
+
+// Fan-out directories of the element named name in the sharded layout.
+inline std::array<std::string, 2> Shards(std::string_view name) {
+  // FNV-1a, as the layout must not depend on the standard library.
+  uint32_t h = 2166136261u;
+  for (char c : name) {
+    h ^= uint8_t(c);
+    h *= 16777619u;
+  }
+  static const constexpr char kHex[] = "0123456789abcdef";
+  return {std::string{kHex[h >> 28], kHex[(h >> 24) & 0xF]},
+          std::string{kHex[(h >> 20) & 0xF], kHex[(h >> 16) & 0xF]}};
+}
+
+// Directory that holds the directory of the element named name.
+inline util::Dir ElementParent(const util::Dir& dir, Layout layout,
+                               std::string_view name) {
+  if (layout == Layout::kFlat) return dir;
+  auto shards = Shards(name);
+  return dir.Sub(shards[0].c_str()).Sub(shards[1].c_str());
+}
+
+inline kj::Path ElementPath(Layout layout, const std::string& name) {
+  if (layout == Layout::kFlat) return kj::Path({name.c_str()});
+  auto shards = Shards(name);
+  return kj::Path({shards[0].c_str(), shards[1].c_str(), name.c_str()});
+}
+
+// Replaces the snapshot in dir, and drops its log, as the snapshot already
+// contains all the logged changes.
+inline void WriteSnapshot(const kj::Directory& dir, const Files& files,
+                          const std::string& data, bool sync = false) {
+  auto replacer = dir.replaceFile(
+      kj::Path(files.snapshot), kj::WriteMode::CREATE | kj::WriteMode::MODIFY);
+  replacer->get().writeAll(kj::ArrayPtr<const kj::byte>(
+      reinterpret_cast<const kj::byte*>(data.data()), data.size()));
+  if (sync) replacer->get().datasync();
+  replacer->commit();
+  dir.tryRemove(kj::Path(files.log));
+}
+
+// Appends one or more newline-terminated records to the log in dir.
+inline void AppendLog(const kj::Directory& dir, const Files& files,
+                      const std::string& lines, bool sync = false) {
+  auto log = dir.appendFile(kj::Path(files.log),
+                            kj::WriteMode::CREATE | kj::WriteMode::MODIFY);
+  log->write(lines.data(), lines.size());
+  if (sync) log->datasync();
+}
+
+// Name of the files of the object in dir in a segment store.
+inline std::string SegmentKey(const util::Dir& dir, const Files& files) {
+  return dir.Path() + "/" + files.snapshot;
+}
+
+// Copies the files of a database to another directory as they were when
+// Start was called, while they keep being written. Writers first copy the
+// files of an object they are about to change, if they were not copied yet; a
+// thread copies all the others. Only the files of objects and key indexes are
+// copied.
+class Backups {
+ public:
+  using WriteLock = std::shared_lock<std::shared_mutex>;
+
+  Backups() = default;
+  Backups(const Backups&) = delete;
+  Backups& operator=(const Backups&) = delete;
+  ~Backups() {
+    if (thread_.joinable()) thread_.join();
+  }
+
+  // Copies the files below root to target. Resolves once they are all
+  // copied. Only waits for writes that are being done.
+  kj::Promise<void> Start(util::Dir root, kj::Own<const kj::Directory> target) {
+    std::unique_lock<std::shared_mutex> freeze(freeze_);
+    KJ_REQUIRE(!running_, "a backup is already running");
+    if (thread_.joinable()) thread_.join();
+    auto paf = kj::newPromiseAndCrossThreadFulfiller<void>();
+    root_ = std::move(root);
+    target_ = std::move(target);
+    fulfiller_ = std::move(paf.fulfiller);
+    done_.clear();
+    running_ = true;
+    thread_ = std::thread([this]() { Run(); });
+    return std::move(paf.promise);
+  }
+
+  // Writers hold the returned lock while they change the files of the object
+  // in dir, so that a backup never starts halfway through a write.
+  WriteLock BeforeWrite(const util::Dir& dir, const Files& files) {
+    WriteLock lock(freeze_);
+    if (!running_) return lock;
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto source = dir.Open();
+    Copy(*source, dir.Path(), files.snapshot);
+    Copy(*source, dir.Path(), files.log);
+    return lock;
+  }
+
+ private:
+  static std::string Join(const std::string& path, const std::string& name) {
+    return path.empty() ? name : path + "/" + name;
+  }
+
+  static bool IsDatabaseFile(std::string_view name) {
+    for (const Files& f : {kObjectFiles, kBinaryObjectFiles, kKeyFiles}) {
+      if (name == f.snapshot || name == f.log) return true;
+    }
+    return false;
+  }
+
+  // Copies file name of the directory at path (relative to the root of the
+  // pool) unless it already was. Files missing at that point are never
+  // copied. Called with mutex_ held.
+  void Copy(const kj::Directory& dir, const std::string& path,
+            const std::string& name) {
+    std::string key = Join(path, name);
+    if (!done_.insert(key).second) return;
+    auto maybe_file = dir.tryOpenFile(kj::Path(name.c_str()));
+    KJ_IF_MAYBE(file, maybe_file) {
+      const std::string& prefix = root_.Path();
+      std::string relative =
+          prefix.empty() ? key : key.substr(prefix.size() + 1);
+      auto bytes = (*file)->readAllBytes();
+      auto replacer =
+          target_->replaceFile(kj::Path::parse(relative.c_str()),
+                               kj::WriteMode::CREATE |
+                                   kj::WriteMode::CREATE_PARENT |
+                                   kj::WriteMode::MODIFY);
+      replacer->get().writeAll(
+          kj::ArrayPtr<const kj::byte>(bytes.begin(), bytes.size()));
+      replacer->commit();
+    }
+  }
+
+  void Walk(const kj::Directory& dir, const std::string& path) {
+    for (const auto& entry : dir.listEntries()) {
+      std::string name(entry.name.cStr());
+      if (entry.type == kj::FsNode::Type::DIRECTORY) {
+        auto maybe_sub = dir.tryOpenSubdir(kj::Path(name.c_str()));
+        KJ_IF_MAYBE(sub, maybe_sub) { Walk(**sub, Join(path, name)); }
+      } else if (IsDatabaseFile(name)) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        Copy(dir, path, name);
+      }
+    }
+  }
+
+  void Run() {
+    bool failed = false;
+    try {
+      Walk(*root_.Open(), root_.Path());
+      target_->sync();
+    } catch (...) {
+      failed = true;
+    }
+    std::unique_lock<std::shared_mutex> freeze(freeze_);
+    running_ = false;
+    done_.clear();
+    if (failed) {
+      fulfiller_->reject(KJ_EXCEPTION(FAILED, "backup failed"));
+    } else {
+      fulfiller_->fulfill();
+    }
+  }
+
+  // Held exclusively to start and finish a backup.
+  std::shared_mutex freeze_;
+  // Guards done_ and the copies.
+  std::mutex mutex_;
+  bool running_ = false;
+  util::Dir root_;
+  kj::Own<const kj::Directory> target_;
+  kj::Own<kj::CrossThreadPromiseFulfiller<void>> fulfiller_;
+  std::unordered_set<std::string> done_;
+  std::thread thread_;
+};
+
+// Where the files of an object are written: its directory, or the segment
+// store of the database if it has one.
+struct Destination {
+  util::Dir dir;
+  std::shared_ptr<SegmentStore> segments;
+  std::shared_ptr<Compressor> compressor;
+  std::shared_ptr<Backups> backups;
+};
+
+// Writes to segment stores are only synced by Sync.
+inline void WriteSnapshot(const Destination& to, const Files& files,
+                          const std::string& data, bool sync = false) {
+  if (to.compressor && files.compressed) {
+    Destination plain = to;
+    plain.compressor = nullptr;
+    return WriteSnapshot(plain, files, to.compressor->Compress(data), sync);
+  }
+  if (to.segments) {
+    return to.segments->Snapshot(SegmentKey(to.dir, files), data);
+  }
+  Backups::WriteLock lock;
+  if (to.backups) lock = to.backups->BeforeWrite(to.dir, files);
+  WriteSnapshot(*to.dir.Open(), files, data, sync);
+}
+
+inline void AppendLog(const Destination& to, const Files& files,
+                      const std::string& lines, bool sync = false) {
+  if (to.segments) {
+    return to.segments->Append(SegmentKey(to.dir, files), lines);
+  }
+  Backups::WriteLock lock;
+  if (to.backups) lock = to.backups->BeforeWrite(to.dir, files);
+  AppendLog(*to.dir.Open(), files, lines, sync);
+}
+
+inline void Sync(const Destination& to) {
+  if (to.segments) return to.segments->Sync();
+  to.dir.Open()->sync();
+}
+
+inline void AddLogRecord(const Files& files, const std::string& record,
+                         std::string& lines) {
+  if (files.binary) {
+    binary::PutLengthPrefixed(lines, record);
+  } else {
+    lines += record;
+    lines.push_back('\n');
+  }
+}
+
+// The contents of a file, either mapped from disk or held in memory (e.g. if
+// it was read from a segment or decompressed), so that objects are parsed
+// from it without a copy.
+class FileContents {
+ public:
+  explicit FileContents(kj::Array<const kj::byte> mapped)
+      : mapped_(std::move(mapped)) {}
+  explicit FileContents(std::string data) : data_(std::move(data)) {}
+
+  std::string_view View() const {
+    if (mapped_.size() == 0) return data_;
+    return std::string_view(reinterpret_cast<const char*>(mapped_.begin()),
+                            mapped_.size());
+  }
+
+ private:
+  kj::Array<const kj::byte> mapped_;
+  std::string data_;
+};
+
+// The contents of the files of an object, or null for the missing ones.
+struct StoredFiles {
+  std::optional<FileContents> snapshot;
+  std::optional<FileContents> log;
+};
+
+inline StoredFiles ReadFiles(const kj::Directory& dir, const Files& files) {
+  StoredFiles result;
+  auto read = [&dir](const char* name, std::optional<FileContents>& out) {
+    auto maybe_file = dir.tryOpenFile(kj::Path(name));
+    KJ_IF_MAYBE(file, maybe_file) {
+      // Empty files can not be mapped.
+      uint64_t size = (*file)->stat().size;
+      if (size == 0) {
+        out.emplace(std::string());
+      } else {
+        out.emplace((*file)->mmap(0, size));
+      }
+    }
+  };
+  read(files.snapshot, result.snapshot);
+  read(files.log, result.log);
+  return result;
+}
+
+inline StoredFiles ReadFiles(const Options& options, const util::Dir& dir,
+                             const Files& files) {
+  StoredFiles result;
+  if (options.segments) {
+    std::optional<std::string> snapshot, log;
+    options.segments->Read(SegmentKey(dir, files), snapshot, log);
+    if (snapshot) result.snapshot.emplace(std::move(*snapshot));
+    if (log) result.log.emplace(std::move(*log));
+  } else if (auto d = dir.TryOpen()) {
+    result = ReadFiles(*d, files);
+  }
+  if (files.compressed && result.snapshot &&
+      Compressor::IsCompressed(result.snapshot->View())) {
+    result.snapshot.emplace(Compressor::Decompress(result.snapshot->View(),
+                                                   options.compressor.get()));
+  }
+  return result;
+}
+
+// Calls f on the text of each record of a log, and returns the number of
+// records. An incomplete last line (i.e. an interrupted append) is ignored.
+template <typename F>
+size_t ForEachLogLine(std::string_view log, const F& f) {
+  size_t records = 0;
+  const char* pos = log.data();
+  const char* end = pos + log.size();
+  while (pos != end) {
+    const char* eol = std::find(pos, end, '\n');
+    if (eol == end) break;
+    f(std::string_view(pos, eol - pos));
+    records++;
+    pos = eol + 1;
+  }
+  return records;
+}
+
+// Same as ForEachLogLine, with the records parsed.
+template <typename F>
+size_t ForEachLogRecord(std::string_view log, const F& f) {
+  return ForEachLogLine(log, [&f](std::string_view line) {
+    f(json::parse(line.begin(), line.end()));
+  });
+}
+
+// Same as ForEachLogRecord, for binary logs.
+template <typename F>
+size_t ForEachBinaryLogRecord(std::string_view log, const F& f) {
+  size_t records = 0;
+  binary::Reader r(log);
+  std::string_view record;
+  while (r.TryLengthPrefixed(record)) {
+    f(record);
+    records++;
+  }
+  return records;
+}
+
+// Replays the log of an object on top of its snapshot, and sets log_records
+// to the number of records in it. The snapshot is returned as is if there is
+// no log.
+inline FileContents ReadObjectText(StoredFiles files, size_t& log_records) {
+  KJ_REQUIRE(!!files.snapshot, "missing object");
+  log_records = 0;
+  if (!files.log) return std::move(*files.snapshot);
+  std::map<std::string, std::string_view> members;
+  bool has_log = false;
+  auto add_members = [&members](std::string_view object) {
+    JsonReader in(object);
+    in.BeginObject();
+    std::string key;
+    while (in.NextKey(key)) members[key] = in.Skip();
+  };
+  log_records = ForEachLogLine(files.log->View(), [&](std::string_view r) {
+    if (!has_log) {
+      add_members(files.snapshot->View());
+      has_log = true;
+    }
+    add_members(r);
+  });
+  if (!has_log) return std::move(*files.snapshot);
+  std::string text;
+  JsonWriter writer(text);
+  writer.BeginObject();
+  for (const auto& [k, v] : members) {
+    writer.Key(k);
+    writer.Raw(v);
+  }
+  writer.EndObject();
+  return FileContents(std::move(text));
+}
+
+inline FileContents ReadObjectText(const Options& options,
+                                   const util::Dir& dir, size_t& log_records) {
+  return ReadObjectText(ReadFiles(options, dir, kObjectFiles), log_records);
+}
+
+// Same as ReadObjectText, for objects stored in binary.
+inline FileContents ReadBinaryObject(StoredFiles files, size_t& log_records) {
+  KJ_REQUIRE(!!files.snapshot, "missing object");
+  log_records = 0;
+  if (!files.log) return std::move(*files.snapshot);
+  std::map<size_t, std::string_view> fields;
+  bool has_log = false;
+  auto add_fields = [&fields](std::string_view data) {
+    binary::ForEachField(
+        data, [&fields](size_t id, std::string_view f) { fields[id] = f; });
+  };
+  log_records =
+      ForEachBinaryLogRecord(files.log->View(), [&](std::string_view r) {
+        if (!has_log) {
+          add_fields(files.snapshot->View());
+          has_log = true;
+        }
+        add_fields(r);
+      });
+  if (!has_log) return std::move(*files.snapshot);
+  std::string data;
+  for (const auto& [id, f] : fields) binary::PutField(data, id, f);
+  return FileContents(std::move(data));
+}
+
+inline FileContents ReadBinaryObject(const Options& options,
+                                     const util::Dir& dir,
+                                     size_t& log_records) {
+  return ReadBinaryObject(ReadFiles(options, dir, kBinaryObjectFiles),
+                          log_records);
+}
+
+// Key index records are ["+", key] for insertions and ["-", key] for
+// removals.
+inline std::string KeyRecord(bool insert, const json& key) {
+  return json::array({insert ? "+" : "-", key}).dump();
+}
+
+// Reads a key index, in sorted order. Returns false if there is no index.
+inline bool ReadKeys(const StoredFiles& files, std::vector<json>& keys,
+                     size_t& log_records) {
+  log_records = 0;
+  if (!files.snapshot && !files.log) return false;
+  std::set<json> result;
+  if (files.snapshot) {
+    for (auto& k : json::parse(files.snapshot->View())) {
+      result.insert(std::move(k));
+    }
+  }
+  if (files.log) {
+    log_records =
+        ForEachLogRecord(files.log->View(), [&result](const json& r) {
+          if (r.at(0) == "+") {
+            result.insert(r.at(1));
+          } else {
+            result.erase(r.at(1));
+          }
+        });
+  }
+  keys.assign(result.begin(), result.end());
+  return true;
+}
+
+inline bool ReadKeys(const kj::Directory& dir, std::vector<json>& keys,
+                     size_t& log_records) {
+  return ReadKeys(ReadFiles(dir, kKeyFiles), keys, log_records);
+}
+
+inline bool ReadKeys(const Options& options, const util::Dir& dir,
+                     std::vector<json>& keys, size_t& log_records) {
+  return ReadKeys(ReadFiles(options, dir, kKeyFiles), keys, log_records);
+}
+
+namespace detail {
+
+// Elements are moved through a staging directory, as the fan-out directories
+// of one layout may have the names of elements of the other. The staged file
+// is created once all the elements of a container are in it.
+static const constexpr char kLayoutStaging[] = "layout.tmp";
+static const constexpr char kLayoutStaged[] = "layout.staged";
+// Paths of the containers whose elements were all moved, one per line, which
+// are not moved again when an interrupted migration is resumed.
+static const constexpr char kLayoutLog[] = "layout.log";
+
+// path is the path of dir from the root of the migration.
+inline void MigrateLayout(const kj::Directory& dir, const std::string& path,
+                          Layout from, Layout to,
+                          const std::set<std::string>& done,
+                          kj::AppendableFile& log) {
+  auto join = [&path](const std::string& name) {
+    return path.empty() ? name : path + "/" + name;
+  };
+  std::vector<json> keys;
+  size_t log_records;
+  if (!ReadKeys(dir, keys, log_records)) {
+    for (const auto& e : dir.listEntries()) {
+      if (e.type == kj::FsNode::Type::DIRECTORY) {
+        MigrateLayout(*dir.openSubdir(kj::Path({e.name.cStr()})),
+                      join(e.name.cStr()), from, to, done, log);
+      }
+    }
+    return;
+  }
+  std::vector<std::string> names;
+  for (const auto& k : keys) {
+    names.push_back(k.is_string() ? k.get<std::string>() : k.dump());
+    KJ_REQUIRE(names.back() != kLayoutStaging &&
+                   names.back() != kLayoutStaged,
+               "key clashes with staging directory");
+  }
+  kj::Path staging({kLayoutStaging});
+  kj::Path staged({kLayoutStaged});
+  if (!done.count(path)) {
+    // Until the staged file exists, each element is either staged or in the
+    // old layout; then, either staged or in the new layout.
+    if (!dir.exists(staged)) {
+      for (const auto& name : names) {
+        if (dir.exists(staging.append(name.c_str()))) continue;
+        dir.transfer(staging.append(name.c_str()),
+                     kj::WriteMode::CREATE | kj::WriteMode::CREATE_PARENT,
+                     ElementPath(from, name), kj::TransferMode::MOVE);
+      }
+      if (from == Layout::kSharded) {
+        for (const auto& name : names) {
+          dir.tryRemove(kj::Path({Shards(name)[0].c_str()}));
+        }
+      }
+      dir.openFile(staged, kj::WriteMode::CREATE | kj::WriteMode::MODIFY);
+      dir.sync();
+    }
+    for (const auto& name : names) {
+      if (!dir.exists(staging.append(name.c_str()))) continue;
+      dir.transfer(ElementPath(to, name),
+                   kj::WriteMode::CREATE | kj::WriteMode::MODIFY |
+                       kj::WriteMode::CREATE_PARENT,
+                   staging.append(name.c_str()), kj::TransferMode::MOVE);
+    }
+    dir.sync();
+    std::string line = path + "\n";
+    log.write(line.data(), line.size());
+    log.datasync();
+    dir.tryRemove(staging);
+    dir.tryRemove(staged);
+  }
+  for (const auto& name : names) {
+    std::string element = name;
+    if (to == Layout::kSharded) {
+      auto shards = Shards(name);
+      element = shards[0] + "/" + shards[1] + "/" + name;
+    }
+    MigrateLayout(*dir.openSubdir(ElementPath(to, name)), join(element), from,
+                  to, done, log);
+  }
+}
+
+}  // namespace detail
+
+// Moves the elements of every container below dir from one layout to the
+// other. Containers are found through their key index, so databases written
+// before it must be loaded and written once first. The database must not be
+// open meanwhile. If the migration is interrupted, calling this again with
+// the same layouts completes it.
+inline void MigrateLayout(const kj::Directory& dir, Layout from, Layout to) {
+  if (from == to) return;
+  kj::Path log_path({detail::kLayoutLog});
+  std::set<std::string> done;
+  auto maybe_file = dir.tryOpenFile(log_path);
+  KJ_IF_MAYBE(file, maybe_file) {
+    auto bytes = (*file)->readAllBytes();
+    ForEachLogLine(std::string_view(reinterpret_cast<const char*>(
+                                        bytes.begin()),
+                                    bytes.size()),
+                   [&done](std::string_view line) { done.emplace(line); });
+  }
+  auto log = dir.appendFile(log_path,
+                            kj::WriteMode::CREATE | kj::WriteMode::MODIFY);
+  detail::MigrateLayout(dir, "", from, to, done, *log);
+  dir.tryRemove(log_path);
+  dir.sync();
+}
+
+// A binary snapshot holds the whole tree in one file: a header with the
+// number of objects and their offsets, followed by the objects in the binary
+// encoding (see db/binary.hpp). Containers with a directory are encoded as
+// their number of elements followed by the key of each and, unless they are
+// lazy, the index of the element, so each object comes after its elements and
+// the root comes last. Integers in the header are little-endian.
+static const constexpr char kBinarySnapshotFile[] = "snapshot.bin";
+static const constexpr char kBinarySnapshotMagic[] = "DBSNAP01";
+static const constexpr size_t kBinarySnapshotMagicSize =
+    sizeof(kBinarySnapshotMagic) - 1;
+
+class BinarySnapshotWriter {
+ public:
+  // Returns the index of the object.
+  size_t Add(std::string_view data) {
+    offsets_.push_back(objects_.size());
+    objects_.append(data.data(), data.size());
+    return offsets_.size() - 1;
+  }
+
+  std::vector<uint8_t> Finish() const {
+    KJ_REQUIRE(!offsets_.empty(), "binary snapshot without objects");
+    size_t header = kBinarySnapshotMagicSize + 8 * (offsets_.size() + 2);
+    std::vector<uint8_t> out(kBinarySnapshotMagic,
+                             kBinarySnapshotMagic + kBinarySnapshotMagicSize);
+    PutU64(out, offsets_.size());
+    for (size_t offset : offsets_) PutU64(out, header + offset);
+    PutU64(out, header + objects_.size());
+    out.insert(out.end(), objects_.begin(), objects_.end());
+    return out;
+  }
+
+ private:
+  static void PutU64(std::vector<uint8_t>& out, uint64_t v) {
+    for (size_t i = 0; i < 8; i++) out.push_back((v >> (8 * i)) & 0xFF);
+  }
+
+  std::vector<size_t> offsets_;
+  std::string objects_;
+};
+
+// Objects are decoded directly from the (usually memory-mapped) file contents,
+// so only the pages of the objects that are read get loaded.
+class BinarySnapshotReader {
+ public:
+  explicit BinarySnapshotReader(kj::Array<const kj::byte> data)
+      : data_(std::move(data)) {
+    KJ_REQUIRE(data_.size() >= kBinarySnapshotMagicSize + 8 &&
+                   std::equal(kBinarySnapshotMagic,
+                              kBinarySnapshotMagic + kBinarySnapshotMagicSize,
+                              data_.begin()),
+               "invalid binary snapshot");
+    count_ = GetU64(kBinarySnapshotMagicSize);
+    KJ_REQUIRE(count_ > 0 && count_ < data_.size() &&
+                   kBinarySnapshotMagicSize + 8 * (count_ + 2) <= data_.size(),
+               "invalid binary snapshot");
+  }
+
+  size_t Size() const { return count_; }
+
+  // Valid as long as the reader.
+  std::string_view Get(size_t i) const {
+    KJ_REQUIRE(i < count_, "invalid object index in binary snapshot", i);
+    uint64_t begin = Offset(i);
+    uint64_t end = Offset(i + 1);
+    KJ_REQUIRE(begin <= end && end <= data_.size(), "invalid binary snapshot");
+    const char* data = reinterpret_cast<const char*>(data_.begin());
+    return std::string_view(data + begin, end - begin);
+  }
+
+  std::string_view Root() const { return Get(count_ - 1); }
+
+ private:
+  uint64_t Offset(size_t i) const {
+    return GetU64(kBinarySnapshotMagicSize + 8 * (i + 1));
+  }
+
+  uint64_t GetU64(size_t pos) const {
+    uint64_t v = 0;
+    for (size_t i = 0; i < 8; i++) {
+      v |= uint64_t(data_.begin()[pos + i]) << (8 * i);
+    }
+    return v;
+  }
+
+  kj::Array<const kj::byte> data_;
+  size_t count_;
+};
+
+// Removes a file that describes the database at some point in time (such as
+// a binary snapshot) before the first write that makes it stale.
+class WriteGuard {
+ public:
+  WriteGuard(util::Dir dir, std::string file)
+      : dir_(std::move(dir)), file_(std::move(file)) {}
+
+  // Thread safe, as containers may write while they are loaded in parallel.
+  void OnWrite() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!armed_) return;
+    auto d = dir_.Open();
+    d->tryRemove(kj::Path(file_));
+    d->sync();
+    armed_ = false;
+  }
+
+ private:
+  std::mutex mutex_;
+  util::Dir dir_;
+  std::string file_;
+  bool armed_ = true;
+};
+
+// Collects the writes of many commits and performs them together, so that
+// each object file is written (and synced) once per group. Commits are
+// visible in memory immediately; WhenDurable() tells when they reach the disk.
+// Writes are flushed when max_records are pending, when a write arrives more
+// than window after the oldest pending one, on Flush() and by Run().
+//
+// Writes may come from several threads, as containers write while they are
+// loaded in parallel; groups are written one at a time, in order. Once a group
+// fails to be written, its commits are lost, so every later write, flush and
+// WhenDurable() fails too.
+class GroupCommit {
+ public:
+  GroupCommit(size_t max_records = 1024,
+              std::chrono::steady_clock::duration window =
+                  std::chrono::milliseconds(10))
+      : max_records_(max_records), window_(window) {}
+  GroupCommit(const GroupCommit&) = delete;
+  GroupCommit& operator=(const GroupCommit&) = delete;
+  // Destructors cannot throw, so a failure to write the pending changes is
+  // only logged; call Flush first to handle it.
+  ~GroupCommit() {
+    try {
+      Flush();
+    } catch (const std::exception& e) {
+      KJ_LOG(ERROR, "group commit failed on destruction", e.what());
+    }
+  }
+
+  // A snapshot replaces the pending writes of the same object, unless it is
+  // the first write of a new object (which may reuse the owner address).
+  void Snapshot(const void* owner, const Destination& to, const Files& files,
+                const std::string& data, bool first) {
+    bool full;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      KJ_REQUIRE(!failed_, "group commit failed");
+      Pending& p = Get(owner, to, files, first);
+      p.snapshot = data;
+      p.has_snapshot = true;
+      p.log.clear();
+      full = Added();
+    }
+    if (full) Flush();
+  }
+
+  void Append(const void* owner, const Destination& to, const Files& files,
+              const std::string& record, bool first) {
+    bool full;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      KJ_REQUIRE(!failed_, "group commit failed");
+      Pending& p = Get(owner, to, files, first);
+      AddLogRecord(files, record, p.log);
+      full = Added();
+    }
+    if (full) Flush();
+  }
+
+  // Resolves once every commit done so far is on disk, which may be when
+  // another thread finishes writing the group that holds it.
+  kj::Promise<void> WhenDurable() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (failed_) return KJ_EXCEPTION(FAILED, "group commit failed");
+    // Pending writes go in the next group, the others may still be written.
+    uint64_t target = taken_ + !pending_.empty();
+    if (written_ >= target) return kj::READY_NOW;
+    auto paf = kj::newPromiseAndCrossThreadFulfiller<void>();
+    waiting_.push_back(Waiting{target, std::move(paf.fulfiller)});
+    return std::move(paf.promise);
+  }
+
+  void Flush() {
+    std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+    std::vector<Pending> pending;
+    uint64_t group;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      KJ_REQUIRE(!failed_, "group commit failed");
+      if (pending_.empty()) return;
+      pending = std::move(pending_);
+      pending_.clear();
+      by_owner_.clear();
+      records_ = 0;
+      group = ++taken_;
+    }
+    std::exception_ptr error;
+    try {
+      for (auto& p : pending) {
+        if (p.has_snapshot) {
+          WriteSnapshot(p.to, p.files, p.snapshot, /*sync=*/true);
+        }
+        if (!p.log.empty()) {
+          AppendLog(p.to, p.files, p.log, /*sync=*/true);
+        }
+      }
+      // After all writes, so that a segment store is synced once.
+      for (auto& p : pending) Sync(p.to);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    std::vector<Waiting> done;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // Later writes will never be flushed either.
+      if (error) failed_ = true;
+      written_ = group;
+      auto it = std::partition(
+          waiting_.begin(), waiting_.end(),
+          [this](const Waiting& w) { return !failed_ && w.target > written_; });
+      std::move(it, waiting_.end(), std::back_inserter(done));
+      waiting_.erase(it, waiting_.end());
+    }
+    for (auto& w : done) {
+      if (error) {
+        w.fulfiller->reject(KJ_EXCEPTION(FAILED, "group commit failed"));
+      } else {
+        w.fulfiller->fulfill();
+      }
+    }
+    if (error) std::rethrow_exception(error);
+  }
+
+  // Flushes the pending writes every window, on the event loop of timer.
+  kj::Promise<void> Run(kj::Timer& timer) {
+    auto delay =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(window_).count();
+    return timer.afterDelay(delay * kj::NANOSECONDS).then([this, &timer]() {
+      if (PendingRecords()) Flush();
+      return Run(timer);
+    });
+  }
+
+  size_t PendingRecords() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return records_;
+  }
+
+ private:
+  struct Pending {
+    Pending(const Destination& to, const Files& files)
+        : to(to), files(files) {}
+    Destination to;
+    Files files;
+    bool has_snapshot = false;
+    std::string snapshot;
+    std::string log;
+  };
+
+  struct Waiting {
+    uint64_t target;
+    kj::Own<kj::CrossThreadPromiseFulfiller<void>> fulfiller;
+  };
+
+  // Called with mutex_ held.
+  Pending& Get(const void* owner, const Destination& to, const Files& files,
+               bool first) {
+    if (pending_.empty()) first_pending_ = std::chrono::steady_clock::now();
+    auto key = std::make_pair(owner, files.snapshot);
+    auto it = by_owner_.find(key);
+    if (first || it == by_owner_.end()) {
+      by_owner_[key] = pending_.size();
+      pending_.emplace_back(to, files);
+      return pending_.back();
+    }
+    return pending_[it->second];
+  }
+
+  // Returns whether the pending writes are due to be flushed.
+  bool Added() {
+    records_++;
+    return records_ >= max_records_ ||
+           std::chrono::steady_clock::now() - first_pending_ >= window_;
+  }
+
+  // Guards the members below; flush_mutex_ keeps groups in order.
+  mutable std::mutex mutex_;
+  std::mutex flush_mutex_;
+  size_t max_records_;
+  std::chrono::steady_clock::duration window_;
+  std::chrono::steady_clock::time_point first_pending_;
+  size_t records_ = 0;
+  // Groups taken by Flush, and written by it; written_ only lags behind
+  // while a group is being written.
+  uint64_t taken_ = 0;
+  uint64_t written_ = 0;
+  bool failed_ = false;
+  std::vector<Pending> pending_;
+  std::map<std::pair<const void*, const char*>, size_t> by_owner_;
+  std::vector<Waiting> waiting_;
+};
+
+// Performs writes on a dedicated thread, in the order in which they are made,
+// so that commits never wait for the disk. Writes are synced before the
+// commits that made them are reported as durable.
+class AsyncWriter {
+ public:
+  AsyncWriter() : thread_([this]() { Run(); }) {}
+  AsyncWriter(const AsyncWriter&) = delete;
+  AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+  // Pending writes are done before returning.
+  ~AsyncWriter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  void Snapshot(const Destination& to, const Files& files, std::string data) {
+    Push(Write{to, files, true, std::move(data)});
+  }
+
+  void Append(const Destination& to, const Files& files, std::string lines) {
+    Push(Write{to, files, false, std::move(lines)});
+  }
+
+  // Resolves once every write made so far is on disk. Once a write has
+  // failed, the returned promises are always rejected.
+  kj::Promise<void> WhenDurable() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (failed_) return KJ_EXCEPTION(FAILED, "asynchronous write failed");
+    if (written_ == queued_) return kj::READY_NOW;
+    auto paf = kj::newPromiseAndCrossThreadFulfiller<void>();
+    waiting_.push_back(Waiting{queued_, std::move(paf.fulfiller)});
+    return std::move(paf.promise);
+  }
+
+  // Blocks until every write made so far is done, e.g. before reading files
+  // back.
+  void Drain() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    uint64_t target = queued_;
+    written_cv_.wait(lock, [&]() { return written_ >= target; });
+  }
+
+ private:
+  struct Write {
+    Destination to;
+    Files files;
+    bool snapshot;
+    std::string data;
+  };
+
+  struct Waiting {
+    uint64_t target;
+    kj::Own<kj::CrossThreadPromiseFulfiller<void>> fulfiller;
+  };
+
+  void Push(Write write) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(std::move(write));
+      queued_++;
+    }
+    cv_.notify_one();
+  }
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) return;
+      auto batch = std::move(queue_);
+      queue_.clear();
+      lock.unlock();
+      bool failed = false;
+      try {
+        for (auto& w : batch) {
+          if (w.snapshot) {
+            WriteSnapshot(w.to, w.files, w.data, /*sync=*/true);
+          } else {
+            AppendLog(w.to, w.files, w.data, /*sync=*/true);
+          }
+        }
+        for (auto& w : batch) Sync(w.to);
+      } catch (...) {
+        failed = true;
+      }
+      lock.lock();
+      written_ += batch.size();
+      failed_ = failed_ || failed;
+      std::vector<Waiting> done;
+      auto it = std::partition(
+          waiting_.begin(), waiting_.end(),
+          [this](const Waiting& w) { return !failed_ && w.target > written_; });
+      std::move(it, waiting_.end(), std::back_inserter(done));
+      waiting_.erase(it, waiting_.end());
+      bool ok = !failed_;
+      lock.unlock();
+      written_cv_.notify_all();
+      for (auto& w : done) {
+        if (ok) {
+          w.fulfiller->fulfill();
+        } else {
+          w.fulfiller->reject(
+              KJ_EXCEPTION(FAILED, "asynchronous write failed"));
+        }
+      }
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable written_cv_;
+  std::deque<Write> queue_;
+  uint64_t queued_ = 0;
+  uint64_t written_ = 0;
+  bool failed_ = false;
+  bool stop_ = false;
+  std::vector<Waiting> waiting_;
+  std::thread thread_;
+};
+
+// Writes a snapshot, through the group commit if there is one. first is true
+// for the first write of a newly created owner.
+inline void Snapshot(const Options& options, const void* owner,
+                     const util::Dir& dir, const Files& files,
+                     const std::string& data, bool first) {
+  if (options.write_guard) options.write_guard->OnWrite();
+  Destination to{dir, options.segments, options.compressor,
+                 options.backups};
+  if (options.async_writer) {
+    options.async_writer->Snapshot(to, files, data);
+  } else if (options.group_commit) {
+    options.group_commit->Snapshot(owner, to, files, data, first);
+  } else {
+    WriteSnapshot(to, files, data);
+  }
+}
+
+inline void Append(const Options& options, const void* owner,
+                   const util::Dir& dir, const Files& files,
+                   const std::string& record, bool first = false) {
+  if (options.write_guard) options.write_guard->OnWrite();
+  Destination to{dir, options.segments, options.compressor,
+                 options.backups};
+  if (options.group_commit && !options.async_writer) {
+    options.group_commit->Append(owner, to, files, record, first);
+    return;
+  }
+  std::string lines;
+  AddLogRecord(files, record, lines);
+  if (options.async_writer) {
+    options.async_writer->Append(to, files, std::move(lines));
+  } else {
+    AppendLog(to, files, lines);
+  }
+}
+
+// Resolves once every commit done so far is on disk.
+inline kj::Promise<void> WhenDurable(const Options& options) {
+  if (options.async_writer) return options.async_writer->WhenDurable();
+  if (options.group_commit) return options.group_commit->WhenDurable();
+  return kj::READY_NOW;
+}
+
+// Resolves to false right away if a commit failed, and to true once it is on
+// disk otherwise.
+inline kj::Promise<bool> WhenCommitted(bool committed,
+                                       const Options& options) {
+  if (!committed) return false;
+  return WhenDurable(options).then([]() { return true; });
+}
+
+// Makes sure that the files reflect every commit done so far.
+inline void Flush(const Options& options) {
+  if (options.async_writer) options.async_writer->Drain();
+  if (options.group_commit) options.group_commit->Flush();
+}
+
+}  // namespace storage
+}  // namespace db
@@ -0,0 +1,112 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace db {
+namespace util {
+
+class ThreadPool {
+ public:
+  explicit ThreadPool(size_t num_threads) {
+    for (size_t i = 0; i < num_threads; i++) {
+      threads_.emplace_back([this]() { Worker(); });
+    }
+  }
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_) t.join();
+  }
+
+  // Calls f(i) for each i in [0, n) on the workers and on the calling thread,
+  // and returns once all calls are done. The calling thread keeps running
+  // items until none is left, so f can itself call ParallelFor without
+  // risking a deadlock. If any call throws, one of the exceptions is
+  // rethrown.
+  void ParallelFor(size_t n, const std::function<void(size_t)>& f) {
+    if (n == 0) return;
+    auto job = std::make_shared<Job>();
+    job->n = n;
+    job->f = &f;
+    size_t helpers = std::min(threads_.size(), n - 1);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (size_t i = 0; i < helpers; i++) {
+        tasks_.push_back([job]() { Run(*job); });
+      }
+    }
+    cv_.notify_all();
+    Run(*job);
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->cv.wait(lock, [&job]() { return job->done == job->n; });
+    if (job->error) std::rethrow_exception(job->error);
+  }
+
+  size_t Size() const { return threads_.size(); }
+
+ private:
+  struct Job {
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> done{0};
+    size_t n;
+    // Only dereferenced while some item is unfinished, so it outlives the
+    // uses by helpers that start late.
+    const std::function<void(size_t)>* f;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::exception_ptr error;
+  };
+
+  static void Run(Job& job) {
+    size_t i;
+    while ((i = job.next++) < job.n) {
+      try {
+        (*job.f)(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(job.mutex);
+        if (!job.error) job.error = std::current_exception();
+      }
+      if (++job.done == job.n) {
+        std::lock_guard<std::mutex> lock(job.mutex);
+        job.cv.notify_all();
+      }
+    }
+  }
+
+  void Worker() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+        if (tasks_.empty()) return;
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> tasks_;
+  bool stop_ = false;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace util
+}  // namespace db
@@ -4,10 +4,14 @@
 #include <functional>
 #include <tuple>
 #include <vector>
+#include "db/dir.hpp"
 
 namespace db {
 namespace util {
 class JsonConstructorTag {};
+// Constructs from JSON text rather than from a json value.
+class JsonTextConstructorTag {};
+class BinaryConstructorTag {};
 
 namespace detail {
 
@@ -64,33 +68,20 @@ struct argument_type<T(U)> {
   typedef U type;
 };
 
-inline kj::Maybe<kj::Own<const kj::Directory>> CloneDir(
-    kj::Maybe<kj::Own<const kj::Directory>>& dir) {
-  KJ_IF_MAYBE(d, dir) { return (*d)->clone(); }
-  else {
-    return nullptr;
-  }
-}
+// A pair of iterators that can be used in range-based for loops.
+template <typename It>
+class IteratorRange {
+ public:
+  IteratorRange(It begin, It end) : begin_(begin), end_(end) {}
+  It begin() const { return begin_; }
+  It end() const { return end_; }
+  bool empty() const { return begin_ == end_; }
 
-inline kj::Maybe<kj::Own<const kj::Directory>> SubDir(
-    kj::Maybe<kj::Own<const kj::Directory>>& dir, const char* name) {
-  if (!name || !name[0]) return CloneDir(dir);
-  KJ_IF_MAYBE(d, dir) {
-    return (*d)->openSubdir(kj::Path{name}, kj::WriteMode::CREATE |
-                                                kj::WriteMode::CREATE_PARENT |
-                                                kj::WriteMode::MODIFY);
-  }
-  else {
-    return nullptr;
-  }
-}
+ private:
+  It begin_;
+  It end_;
+};
 
-inline kj::Own<const kj::Directory> SubDir(kj::Own<const kj::Directory>&& dir,
-                                           const char* name) {
-  if (!name || !name[0]) return dir->clone();
-  return dir->openSubdir(kj::Path{name}, kj::WriteMode::CREATE |
-                                             kj::WriteMode::CREATE_PARENT |
-                                             kj::WriteMode::MODIFY);
-}
+inline Dir SubDir(const Dir& dir, const char* name) { return dir.Sub(name); }
 }  // namespace util
 }  // namespace db
@@ -3,9 +3,14 @@
 #include <kj/filesystem.h>
 #include <functional>
 #include <iostream>
+#include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
+#include "db/binary.hpp"
+#include "db/callback_table.hpp"
 #include "db/json.hpp"
+#include "db/storage.hpp"
 #include "db/util.hpp"
 
 namespace db {
@@ -30,6 +35,7 @@ class ValueEditor {
     autocommit = other.autocommit;
     finalized = other.finalized;
     rolled_back = other.rolled_back;
+    changed = other.changed;
     other.finalized = true;
     other.rolled_back = true;
     other.obj = nullptr;
@@ -58,7 +64,7 @@ class ValueEditor {
     if (obj) obj->is_edited = false;
     bool ret = true;
     if (obj) {
-      ret = obj->Commit(val, old);
+      ret = obj->Commit(val, old, changed);
     }
     finalized = true;
     if (!ret) {
@@ -81,6 +87,9 @@ class ValueEditor {
     if (obj) obj->UndoCommit(old);
   }
 
+  // Whether the last commit modified the value.
+  bool Changed() const { return changed; }
+
   ~ValueEditor() {
     if (!finalized && autocommit) Commit();
     if (obj) obj->is_edited = false;
@@ -96,6 +105,7 @@ class ValueEditor {
   bool autocommit;
   bool finalized = false;
   bool rolled_back = false;
+  bool changed = false;
 };
 
 template <typename U, typename T>
@@ -103,29 +113,55 @@ class ValueEditor<U, T, std::enable_if_t<T::kIsAlsoValue>> : public T::Editor {
  public:
   using T::Editor::Editor;
 
+  using T::Editor::Changed;
   using T::Editor::Commit;
+  using T::Editor::CommitAsync;
   using T::Editor::Rollback;
   using T::Editor::UndoCommit;
 };
 
 template <typename U, typename T, typename>
 class Value {
+  using Callbacks = util::CallbackTable<Value, const T&, const T&>;
+
  public:
   const constexpr static bool SkipSerialize = false;
   // Returns true if successful.
-  using callback_t = std::function<bool(const T&, const T&)>;
+  using callback_t = typename Callbacks::callback_t;
   // Should never fail, as it would leave everything in an inconsistent state.
-  using revert_callback_t = std::function<void(const T&, const T&)>;
-  Value(kj::Maybe<kj::Own<const kj::Directory>>&& dir, const char* field_name,
-        U* parent, T&& v)
+  using revert_callback_t = typename Callbacks::revert_callback_t;
+  Value(util::Dir&& dir, const char* field_name, U* parent, T&& v)
       : v(std::move(v)) {}
-  Value(kj::Maybe<kj::Own<const kj::Directory>>&& dir, const char* field_name,
-        U* parent, const T& v)
+  Value(util::Dir&& dir, const char* field_name, U* parent, const T& v)
       : v(v) {}
-  Value(util::JsonConstructorTag, kj::Maybe<kj::Own<const kj::Directory>>&& dir,
-        const char* field_name, U* parent, const json& j)
+  Value(util::JsonConstructorTag, util::Dir&& dir, const char* field_name,
+        U* parent, const json& j)
       : Value(std::move(dir), field_name, parent, db::FromJson<T>()(j)) {}
+  Value(util::JsonTextConstructorTag, util::Dir&& dir, const char* field_name,
+        U* parent, std::string_view text)
+      : Value(std::move(dir), field_name, parent, ParseJson<T>(text)) {}
+  Value(util::BinaryConstructorTag, util::Dir&& dir, const char* field_name,
+        U* parent, std::string_view data)
+      : Value(std::move(dir), field_name, parent, binary::Decode<T>(data)) {}
+  // Copies have the callbacks of the original.
+  Value(const Value& other) : v(other.v), is_edited(other.is_edited) {
+    CopyCallbacks(other);
+  }
+  Value& operator=(const Value& other) {
+    if (this == &other) return *this;
+    v = other.v;
+    is_edited = other.is_edited;
+    if (has_callbacks_) Callbacks::Remove(this);
+    has_callbacks_ = false;
+    CopyCallbacks(other);
+    return *this;
+  }
+  ~Value() {
+    if (has_callbacks_) Callbacks::Remove(this);
+  }
   json Serialize() const { return ToJson<T>()(v); }
+  void Serialize(JsonWriter& out) const { ToJson<T>()(v, out); }
+  void SerializeBinary(std::string& out) const { ToBinary<T>()(v, out); }
 
   friend class ValueEditor<U, T>;
 
@@ -136,12 +172,11 @@ class Value {
   operator const T&() const { return v; }
   void OnChange(callback_t action, revert_callback_t revert =
                                        [](const auto&, const auto&) {}) const {
-    on_commit.push_back(action);
-    on_undo_commit.push_back(revert);
+    Callbacks::Add(this, std::move(action), std::move(revert));
+    has_callbacks_ = true;
   }
 
-  void SetDir(kj::Maybe<kj::Own<const kj::Directory>>&& dir,
-              const char* field_name) {}
+  void SetDir(util::Dir&& dir, const char* field_name) {}
 
   ValueEditor<U, T> Edit(bool autocommit = false) {
     KJ_REQUIRE(!is_edited);
@@ -149,19 +184,27 @@ class Value {
     return ValueEditor<U, T>(this, v, autocommit);
   }
 
-  static auto FromJson(kj::Maybe<kj::Own<const kj::Directory>>&& dir,
-                       const char* field_name, U* parent, const json& j) {
+  static auto FromJson(util::Dir&& dir, const char* field_name, U* parent,
+                       const json& j) {
     return std::make_unique<Value>(util::JsonConstructorTag(), std::move(dir),
                                    field_name, parent, j);
   }
 
-  static auto Load(kj::Own<const kj::Directory>&& dir, const char* field_name,
-                   U* parent) {
-    return FromJson(dir->clone(), field_name, parent,
-                    json::parse(util::SubDir(std::move(dir), field_name)
-                                    ->openFile(kj::Path("data.json"))
-                                    ->readAllText()
-                                    .cStr()));
+  static auto Load(util::Dir dir, const char* field_name, U* parent) {
+    const storage::Options* options = &storage::DefaultOptions();
+    if constexpr (!std::is_void_v<U>) {
+      if (parent) options = &parent->Storage();
+    }
+    auto sub = util::SubDir(dir, field_name);
+    size_t log_records;
+    if (options->format == storage::Format::kBinary) {
+      return std::make_unique<Value>(
+          util::BinaryConstructorTag(), std::move(dir), field_name, parent,
+          storage::ReadBinaryObject(*options, sub, log_records).View());
+    }
+    return std::make_unique<Value>(
+        util::JsonTextConstructorTag(), std::move(dir), field_name, parent,
+        storage::ReadObjectText(*options, sub, log_records).View());
   }
 
   const constexpr static bool kIsSubObject = false;
@@ -173,23 +216,32 @@ class Value {
   T v;
   bool is_edited = false;
 
+  void CopyCallbacks(const Value& other) {
+    if (!other.has_callbacks_) return;
+    Callbacks::Copy(&other, this);
+    has_callbacks_ = true;
+  }
+
   // Doesn't do anything if the value did not change.
-  bool Commit(T val, T& old) {
+  bool Commit(T val, T& old, bool& changed) {
     is_edited = false;
     old = this->v;
+    changed = false;
     if constexpr (util::is_equality_comparable_v<T>) {
       if (val == v) return true;
     }
+    changed = true;
     this->v = val;
     try {
-      bool ret = util::propagate_callback_safe(on_commit, on_undo_commit, old,
-                                               this->v);
+      bool ret = !has_callbacks_ || Callbacks::Run(this, old, this->v);
       if (!ret) {
         this->v = old;
+        changed = false;
       }
       return ret;
     } catch (std::exception& exc) {
       this->v = old;
+      changed = false;
       throw;
     }
   }
@@ -201,11 +253,10 @@ class Value {
     }
     T rollbacked = this->v;
     this->v = old;
-    for (const auto& f : on_undo_commit) f(old, rollbacked);
+    if (has_callbacks_) Callbacks::Revert(this, old, rollbacked);
   }
-  mutable std::vector<callback_t> on_commit;
-  mutable std::vector<revert_callback_t> on_undo_commit;
-  bool initialized_ = false;
+  // The callbacks are in Callbacks, as most values have none.
+  mutable bool has_callbacks_ = false;
 };
 
 template <typename U, typename T>
@@ -214,19 +265,63 @@ class Value<U, T, std::enable_if_t<T::kIsAlsoValue>> : public T {
   using T::T;
   const T& operator*() const { return *this; }
   using T::Edit;
-  static auto FromJson(kj::Maybe<kj::Own<const kj::Directory>>&& dir,
-                       const char* field_name, U* parent, const json& j) {
+  // storage is only used when loading the root of the tree.
+  static auto FromJson(
+      util::Dir&& dir, const char* field_name, U* parent, const json& j,
+      const storage::Options& storage = storage::DefaultOptions()) {
     return std::make_unique<Value>(util::JsonConstructorTag(), std::move(dir),
-                                   field_name, parent, j);
+                                   field_name, parent, j, storage);
   }
 
-  static auto Load(kj::Own<const kj::Directory>&& dir, const char* field_name,
-                   U* parent) {
-    return FromJson(dir->clone(), field_name, parent,
-                    json::parse(util::SubDir(std::move(dir), field_name)
-                                    ->openFile(kj::Path("data.json"))
-                                    ->readAllText()
-                                    .cStr()));
+  static auto FromJsonText(
+      util::Dir&& dir, const char* field_name, U* parent, std::string_view text,
+      const storage::Options& storage = storage::DefaultOptions()) {
+    return std::make_unique<Value>(util::JsonTextConstructorTag(),
+                                   std::move(dir), field_name, parent, text,
+                                   storage);
+  }
+
+  static auto FromBinary(
+      util::Dir&& dir, const char* field_name, U* parent, std::string_view data,
+      const storage::Options& storage = storage::DefaultOptions()) {
+    return std::make_unique<Value>(util::BinaryConstructorTag(),
+                                   std::move(dir), field_name, parent, data,
+                                   storage);
+  }
+
+  // The options of the parent are used to read the object, if there is one.
+  static auto Load(
+      util::Dir dir, const char* field_name, U* parent,
+      const storage::Options& storage = storage::DefaultOptions()) {
+    return Load(std::move(dir), field_name, parent, storage,
+                [](auto&&... args) {
+                  return std::make_unique<Value>(
+                      std::forward<decltype(args)>(args)...);
+                });
+  }
+
+  // Constructs the object with make, which is given the arguments of a
+  // constructor, and returns its result. The object continues the log it was
+  // read from, so that it is checkpointed after the same number of records.
+  template <typename Make>
+  static auto Load(util::Dir dir, const char* field_name, U* parent,
+                   const storage::Options& storage, const Make& make) {
+    const storage::Options* options = &storage;
+    if constexpr (!std::is_void_v<U>) {
+      if (parent) options = &parent->Storage();
+    }
+    auto sub = util::SubDir(dir, field_name);
+    bool binary = options->format == storage::Format::kBinary;
+    size_t log_records;
+    auto contents = binary
+                        ? storage::ReadBinaryObject(*options, sub, log_records)
+                        : storage::ReadObjectText(*options, sub, log_records);
+    auto obj = binary ? make(util::BinaryConstructorTag(), std::move(dir),
+                             field_name, parent, contents.View(), storage)
+                      : make(util::JsonTextConstructorTag(), std::move(dir),
+                             field_name, parent, contents.View(), storage);
+    obj->log_records_ = log_records;
+    return obj;
   }
 };
 